@@ -0,0 +1,68 @@
+#include "arena.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+arena::arena(std::size_t block_size) :
+	block_size(block_size),
+	current(0),
+	used(0)
+{
+}
+
+char *
+arena::allocate(std::size_t size)
+{
+	// Keep everything aligned well enough for any type.
+	std::size_t padded = (size + alignof(std::max_align_t) - 1) &
+		~(alignof(std::max_align_t) - 1);
+
+	// Move along to the first block with enough space left, allocating
+	// a new one if we run off the end.  Oversized requests get a block
+	// of their own, which is also kept for reuse after reset().
+	while (current < blocks.size() && used + padded > blocks[current].size) {
+		++current;
+		used = 0;
+	}
+	if (current >= blocks.size()) {
+		std::size_t size = std::max(block_size, padded);
+		blocks.push_back(block{std::make_unique<char[]>(size), size});
+		current = blocks.size() - 1;
+		used = 0;
+	}
+
+	char *result = blocks[current].data.get() + used;
+	used += padded;
+
+	return result;
+}
+
+std::string_view
+arena::copy(const char *data, std::size_t size)
+{
+	if (size == 0)
+		return std::string_view();
+
+	char *result = allocate(size);
+	std::memcpy(result, data, size);
+
+	return std::string_view(result, size);
+}
+
+void
+arena::reset()
+{
+	current = 0;
+	used = 0;
+}
+
+std::size_t
+arena::capacity() const
+{
+	std::size_t total = 0;
+
+	for (const auto& block : blocks)
+		total += block.size;
+
+	return total;
+}
@@ -0,0 +1,42 @@
+#ifndef ARENA_HPP
+#define ARENA_HPP
+
+#include <cstddef>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+/*
+ * A simple bump allocator for variable-length data that all dies at the
+ * same time, such as the strings belonging to a batch of operations.
+ * Memory is retained by reset(), so a long-running loop that fills and
+ * resets the same arena settles down to a fixed footprint and stops
+ * calling the heap allocator.
+ */
+struct arena {
+	explicit arena(std::size_t block_size = 64 * 1024);
+
+	char *allocate(std::size_t size);
+	std::string_view copy(const char *data, std::size_t size);
+	std::string_view copy(std::string_view data) { return copy(data.data(), data.size()); }
+
+	/*
+	 * Forget all allocations, but keep the memory for reuse.
+	 */
+	void reset();
+
+	std::size_t capacity() const;
+
+private:
+	struct block {
+		std::unique_ptr<char[]> data;
+		std::size_t size;
+	};
+
+	std::size_t block_size;
+	std::vector<block> blocks;
+	std::size_t current;
+	std::size_t used;
+};
+
+#endif
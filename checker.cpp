@@ -0,0 +1,195 @@
+#include "checker.hpp"
+#include "image_hash.hpp"
+
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char **environ;
+
+std::string
+stringify(check_result::verdict_type verdict)
+{
+	switch (verdict) {
+	case check_result::PASSED:
+		return "passed";
+	case check_result::FAILED:
+		return "failed";
+	case check_result::TIMED_OUT:
+		return "timed-out";
+	default:
+		return "<unknown>";
+	}
+}
+
+check_result
+run_checker(const std::string& command,
+			const std::string& image,
+			const std::vector<std::string>& extra_environment,
+			const std::string& output_path,
+			double timeout)
+{
+	typedef std::chrono::steady_clock clock;
+	check_result result;
+	clock::time_point start = clock::now();
+	int status;
+
+	// Everything the child needs is built before forking, since other
+	// threads may be holding locks that the child would never see
+	// released.
+	std::vector<const char *> arguments = {
+		"sh", "-c", command.c_str(), "sh", image.c_str(), nullptr
+	};
+	std::vector<const char *> environment;
+	for (char **variable = environ; *variable; ++variable)
+		environment.push_back(*variable);
+	for (const std::string& variable : extra_environment)
+		environment.push_back(variable.c_str());
+	environment.push_back(nullptr);
+
+	int output = ::open(output_path.c_str(),
+						O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (output < 0) {
+		std::string error = std::strerror(errno);
+		throw std::runtime_error("could not create " + output_path + ": " + error);
+	}
+
+	pid_t pid = ::fork();
+	if (pid < 0) {
+		std::string error = std::strerror(errno);
+		::close(output);
+		throw std::runtime_error("could not fork: " + error);
+	} else if (pid == 0) {
+		// Lead a new process group, so that a timeout can kill anything
+		// the checker started too.
+		::setpgid(0, 0);
+		::dup2(output, STDOUT_FILENO);
+		::dup2(output, STDERR_FILENO);
+		::execve("/bin/sh",
+				 const_cast<char *const *>(arguments.data()),
+				 const_cast<char *const *>(environment.data()));
+		::_exit(127);
+	}
+	::close(output);
+	// Also from this side, so there's no window where the child hasn't
+	// got round to it yet.
+	::setpgid(pid, pid);
+
+	result.verdict = check_result::PASSED;
+	for (int attempt = 0;; ++attempt) {
+		pid_t rc = ::waitpid(pid, &status, WNOHANG);
+		if (rc == pid)
+			break;
+		if (rc < 0 && errno != EINTR) {
+			std::string error = std::strerror(errno);
+			throw std::runtime_error("could not wait for checker: " + error);
+		}
+		if (timeout > 0 && result.verdict != check_result::TIMED_OUT &&
+			clock::now() - start > std::chrono::duration<double>(timeout)) {
+			::kill(-pid, SIGKILL);
+			result.verdict = check_result::TIMED_OUT;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(
+			attempt < 10 ? 1 : 10));
+	}
+	// Don't leave anything it started running into the next job.
+	::kill(-pid, SIGKILL);
+
+	result.seconds = std::chrono::duration<double>(clock::now() - start).count();
+	if (WIFEXITED(status)) {
+		result.status = WEXITSTATUS(status);
+		if (result.status != 0 && result.verdict == check_result::PASSED)
+			result.verdict = check_result::FAILED;
+	} else {
+		result.status = WIFSIGNALED(status) ? WTERMSIG(status) : -1;
+		if (result.verdict == check_result::PASSED)
+			result.verdict = check_result::FAILED;
+	}
+	return result;
+}
+
+/*
+ * The file has a line for each verdict: the key in hex, the verdict, the
+ * exit status and how long the check took.
+ */
+verdict_cache::verdict_cache(const std::string& path) :
+	path(path)
+{
+	std::ifstream in(path);
+	std::string line;
+	int line_number = 0;
+
+	while (std::getline(in, line)) {
+		std::istringstream fields(line);
+		std::uint64_t key;
+		std::string verdict;
+		check_result result;
+
+		++line_number;
+		if (!(fields >> std::hex >> key >> verdict >> std::dec >> result.status >>
+			  result.seconds) ||
+			(verdict != stringify(check_result::PASSED) &&
+			 verdict != stringify(check_result::FAILED)))
+			throw std::runtime_error("bad verdict at line " +
+									 std::to_string(line_number) + " of " + path);
+		result.verdict = verdict == stringify(check_result::PASSED) ?
+			check_result::PASSED : check_result::FAILED;
+		verdicts[key] = result;
+	}
+
+	out.open(path, std::ios_base::app);
+	if (!out)
+		throw std::runtime_error("could not open " + path);
+}
+
+std::uint64_t
+verdict_cache::key(std::uint64_t image_hash, const std::string& command)
+{
+	return hash_bytes(hash_value(hash_seed, image_hash), command.data(), command.size());
+}
+
+bool
+verdict_cache::find(std::uint64_t key, check_result& result)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	auto found = verdicts.find(key);
+
+	if (found == verdicts.end())
+		return false;
+	result = found->second;
+	return true;
+}
+
+void
+verdict_cache::insert(std::uint64_t key, const check_result& result)
+{
+	std::lock_guard<std::mutex> guard(lock);
+	char hex[17];
+
+	if (result.verdict == check_result::TIMED_OUT ||
+		!verdicts.emplace(key, result).second)
+		return;
+	std::snprintf(hex, sizeof(hex), "%016llx", static_cast<unsigned long long>(key));
+	out << hex << " " << stringify(result.verdict) << " " << result.status << " "
+		<< result.seconds << "\n";
+	if (!out.flush())
+		throw std::runtime_error("could not write " + path);
+}
+
+verdict_cache::verdict_map
+verdict_cache::snapshot()
+{
+	std::lock_guard<std::mutex> guard(lock);
+
+	return verdicts;
+}
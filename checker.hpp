@@ -0,0 +1,75 @@
+#ifndef CHECKER_HPP
+#define CHECKER_HPP
+
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/*
+ * What a recovery checker made of a crash image.
+ */
+struct check_result {
+	enum verdict_type { PASSED, FAILED, TIMED_OUT } verdict;
+	int status;
+	double seconds;
+};
+
+std::string
+stringify(check_result::verdict_type verdict);
+
+/*
+ * Run command with /bin/sh, with the image path as $1 and environment
+ * variables from extra_environment (NAME=value) added to ours.  Its
+ * output goes to output_path.  If it hasn't finished after timeout
+ * seconds (0 for no limit), it and everything it started are killed.
+ * The status is the exit status, or the signal number if it was killed
+ * by one.
+ */
+check_result
+run_checker(const std::string& command,
+			const std::string& image,
+			const std::vector<std::string>& extra_environment,
+			const std::string& output_path,
+			double timeout);
+
+/*
+ * Verdicts on images that have been checked before, by a key made from
+ * the image's hash and the checker command, kept in a file so that later
+ * runs can use them too.  Each verdict is appended to the file as soon as
+ * it's known.  Timeouts aren't remembered, since the next run might be
+ * more patient.  Threads can share a cache.
+ */
+struct verdict_cache {
+	typedef std::unordered_map<std::uint64_t, check_result> verdict_map;
+
+	/*
+	 * Load the verdicts in the file at path, which is created if it
+	 * doesn't exist, and append new ones to it.
+	 */
+	explicit verdict_cache(const std::string& path);
+
+	/*
+	 * The key for an image with the given hash, checked by command.
+	 */
+	static std::uint64_t key(std::uint64_t image_hash, const std::string& command);
+
+	bool find(std::uint64_t key, check_result& result);
+	void insert(std::uint64_t key, const check_result& result);
+
+	/*
+	 * A copy of everything we know, for a forked process that mustn't
+	 * take our lock.
+	 */
+	verdict_map snapshot();
+
+private:
+	std::string path;
+	std::mutex lock;
+	verdict_map verdicts;
+	std::ofstream out;
+};
+
+#endif
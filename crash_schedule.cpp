@@ -0,0 +1,40 @@
+#include "crash_schedule.hpp"
+
+#include <cstdlib>
+
+bool
+crash_schedule::boundary(const operation& op, int operations) const
+{
+	switch (kind) {
+	case EVERY:
+		return operations % every == 0;
+	case FSYNC:
+		return op.op == operation::OP_FSYNC;
+	case CREATE:
+		return op.op == operation::OP_CREATE && op.path == path;
+	default:
+		return false;
+	}
+}
+
+bool
+parse_crash_schedule(const std::string& spec, crash_schedule& out)
+{
+	if (spec == "fsync") {
+		out.kind = crash_schedule::FSYNC;
+	} else if (spec.compare(0, 7, "create:") == 0 && spec.size() > 7) {
+		out.kind = crash_schedule::CREATE;
+		out.path = spec.substr(7);
+	} else if (spec == "every") {
+		out.kind = crash_schedule::EVERY;
+		out.every = 1;
+	} else if (spec.compare(0, 6, "every:") == 0) {
+		out.kind = crash_schedule::EVERY;
+		out.every = atoi(spec.c_str() + 6);
+		if (out.every == 0)
+			return false;
+	} else {
+		return false;
+	}
+	return true;
+}
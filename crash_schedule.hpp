@@ -0,0 +1,36 @@
+#ifndef CRASH_SCHEDULE_HPP
+#define CRASH_SCHEDULE_HPP
+
+#include "operation.hpp"
+
+#include <cstddef>
+#include <string>
+
+/*
+ * Which points in a log are interesting places to crash: after every Nth
+ * operation, or just before each fsync or each creation of a sentinel
+ * path.
+ */
+struct crash_schedule {
+	crash_schedule() : kind(NONE), every(0) {}
+
+	bool active() const { return kind != NONE; }
+
+	/*
+	 * Is the moment before replaying op, with operations replayed so
+	 * far, a crash point?
+	 */
+	bool boundary(const operation& op, int operations) const;
+
+	enum { NONE, EVERY, FSYNC, CREATE } kind;
+	std::size_t every;
+	std::string path;
+};
+
+/*
+ * Parse every:N, every, fsync or create:PATH.
+ */
+bool
+parse_crash_schedule(const std::string& spec, crash_schedule& out);
+
+#endif
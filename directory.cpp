@@ -1,36 +1,320 @@
 #include "directory.hpp"
+#include "operation.hpp"
 
+#include <cerrno>
+#include <cstring>
+#include <istream>
+#include <ostream>
 #include <stdexcept>
 
+#include <sys/stat.h>
+
+const char pinned_directory[] = "/.dsfs-pinned";
+
+pinned_files::pinned_files(target& tree) :
+	tree(tree),
+	next(1)
+{
+}
+
+std::string
+pinned_files::path(std::uint64_t pin) const
+{
+	return std::string(pinned_directory) + "/" + std::to_string(pin);
+}
+
+std::uint64_t
+pinned_files::pin(std::string_view from)
+{
+	std::uint64_t pin = next++;
+
+	if (live.empty() && tree.mkdir(pinned_directory, 0700) < 0 && errno != EEXIST) {
+		std::string error = std::strerror(errno);
+		throw std::runtime_error("could not create " + std::string(pinned_directory) +
+								 ": " + error);
+	}
+	if (tree.link(from, path(pin)) < 0) {
+		std::string error = std::strerror(errno);
+		throw std::runtime_error("could not pin " + std::string(from) + ": " + error);
+	}
+	live.insert(pin);
+
+	return pin;
+}
+
+void
+pinned_files::restore(std::uint64_t pin, std::string_view to)
+{
+	// If something is in the way, the change that put it there must have
+	// been committed.
+	tree.link(path(pin), to);
+}
+
+void
+pinned_files::release(std::uint64_t pin)
+{
+	if (live.erase(pin) > 0)
+		tree.unlink(path(pin));
+}
+
+void
+pinned_files::adopt(std::uint64_t pin)
+{
+	live.insert(pin);
+}
+
+void
+pinned_files::clear()
+{
+	struct stat stat_data;
+
+	for (std::uint64_t pin : live)
+		tree.unlink(path(pin));
+	live.clear();
+	if (tree.lstat(pinned_directory, &stat_data) == 0)
+		tree.rmdir(pinned_directory);
+}
+
+directory::directory(target& tree, pinned_files& pins, std::string_view path) :
+	tree(tree),
+	pins(pins),
+	directory_path(path),
+	generation(1)
+{
+}
+
+void
+directory::set_path(std::string_view path)
+{
+	if (directory_path != path)
+		directory_path = path;
+}
+
+std::string
+directory::entry_path(const std::string& name) const
+{
+	if (directory_path == "/")
+		return "/" + name;
+	return directory_path + "/" + name;
+}
+
+directory::original *
+directory::find(const std::string& name)
+{
+	auto it = originals.find(name);
+
+	if (it == originals.end() || it->second.generation != generation)
+		return nullptr;
+	return &it->second;
+}
+
+bool
+directory::changed(const std::string& name) const
+{
+	return const_cast<directory *>(this)->find(name) != nullptr;
+}
+
+/*
+ * Start remembering name, whose original state was held by pin.
+ */
 void
-directory::write(int fd, const char *data, std::size_t size, off_t offset)
+directory::record(const std::string& name, std::uint64_t pin)
 {
-	throw std::runtime_error("cannot write to directory");
+	// Dead entries are reused if the same name comes up again, but
+	// workloads that keep inventing new names would pile them up, so
+	// throw them out once they outnumber the live ones.
+	if (originals.size() >= 2 * journal.size() + 1024)
+		purge();
+
+	auto& entry = *originals.try_emplace(name).first;
+	entry.second.generation = generation;
+	entry.second.position = journal.size();
+	entry.second.pin = pin;
+	journal.push_back(&entry);
+	if (pin != 0)
+		held.push_back(pin);
+}
+
+/*
+ * Forget a live entry, releasing its pin.
+ */
+void
+directory::drop(original_map::value_type *entry)
+{
+	std::size_t position = entry->second.position;
+
+	if (entry->second.pin != 0)
+		pins.release(entry->second.pin);
+	journal[position] = journal.back();
+	journal[position]->second.position = position;
+	journal.pop_back();
+	originals.erase(originals.find(entry->first));
+}
+
+void
+directory::purge()
+{
+	for (auto it = originals.begin(); it != originals.end();) {
+		if (it->second.generation != generation)
+			it = originals.erase(it);
+		else
+			++it;
+	}
+}
+
+void
+directory::changing(const std::string& name)
+{
+	struct stat stat_data;
+	std::string path;
+
+	if (find(name))
+		return;
+
+	path = entry_path(name);
+	if (tree.lstat(path, &stat_data) < 0)
+		record(name, 0);
+	else if (!S_ISDIR(stat_data.st_mode))
+		record(name, pins.pin(path));
+}
+
+void
+directory::added(const std::string& name)
+{
+	if (!find(name))
+		record(name, 0);
 }
 
 void
-directory::truncate(int fd, std::size_t size)
+directory::removed(const std::string& name)
 {
-	throw std::runtime_error("cannot truncate a directory");
+	original *entry = find(name);
+
+	// Something created since the last fsync has gone again, so there's
+	// nothing to undo.
+	if (entry && entry->pin == 0)
+		drop(journal[entry->position]);
 }
 
 void
-directory::synchronize(int fd)
+directory::commit(const std::string& name)
 {
-	// Forget about our undo log, as all changes are now committed.
-	undo_log.clear();
+	if (original *entry = find(name))
+		drop(journal[entry->position]);
+}
+
+void
+directory::undo_additions()
+{
+	struct stat stat_data;
+
+	if (tree.lstat(directory_path, &stat_data) < 0 || !S_ISDIR(stat_data.st_mode))
+		return;
+	for (const auto *entry : journal) {
+		std::string path = entry_path(entry->first);
+
+		if (tree.lstat(path, &stat_data) < 0)
+			continue;
+		// A directory created since the last fsync has already been
+		// emptied, since deeper directories go first.
+		if (S_ISDIR(stat_data.st_mode))
+			tree.rmdir(path);
+		else
+			tree.unlink(path);
+	}
+}
+
+void
+directory::undo_removals()
+{
+	struct stat stat_data;
+
+	if (tree.lstat(directory_path, &stat_data) < 0 || !S_ISDIR(stat_data.st_mode))
+		return;
+	for (const auto *entry : journal) {
+		if (entry->second.pin != 0)
+			pins.restore(entry->second.pin, entry_path(entry->first));
+	}
+}
+
+void
+directory::synchronize()
+{
+	// All changes are now committed.  Moving on to a new generation
+	// kills the entries without visiting them.
+	for (std::uint64_t pin : held)
+		pins.release(pin);
+	held.clear();
+	journal.clear();
+	++generation;
 }
 
 void
 directory::lose_power()
 {
-	// It's all fun and games until somebody loses and inode
+	// The pins are all released together by the replayer.
+	held.clear();
+	journal.clear();
+	++generation;
+}
 
-	// XXX Apply some of our undo log to simulate those changes not
-	// having hit the disk.
+void
+directory::save(std::ostream& out) const
+{
+	out << "changes " << journal.size() << "\n";
+	for (const auto *entry : journal) {
+		write_string_literal(out, entry->first);
+		out << " " << entry->second.pin << "\n";
+	}
 }
 
 void
-directory::rename(const std::string& from, const std::string& to)
+directory::load(std::istream& in)
+{
+	std::string word;
+	std::size_t count;
+
+	journal.clear();
+	held.clear();
+	originals.clear();
+	if (!(in >> word >> count) || word != "changes")
+		throw std::runtime_error("bad directory changes in checkpoint");
+	while (count-- > 0) {
+		std::string name;
+		std::uint64_t pin;
+
+		if (!(in >> std::ws) || !read_string_literal(in, name) || !(in >> pin) ||
+			find(name))
+			throw std::runtime_error("bad directory change in checkpoint");
+		record(name, pin);
+		if (pin != 0)
+			pins.adopt(pin);
+	}
+}
+
+std::string
+stringify(directory_writeback_mode mode)
+{
+	switch (mode) {
+	case DIRECTORY_WRITEBACK_ALL:
+		return "all";
+	case DIRECTORY_WRITEBACK_NONE:
+		return "none";
+	default:
+		return "<unknown>";
+	}
+}
+
+bool
+parse_directory_writeback_mode(const std::string& name,
+							   directory_writeback_mode& out)
 {
+	for (int i = DIRECTORY_WRITEBACK_ALL; i <= DIRECTORY_WRITEBACK_NONE; ++i) {
+		directory_writeback_mode mode = static_cast<directory_writeback_mode>(i);
+		if (stringify(mode) == name) {
+			out = mode;
+			return true;
+		}
+	}
+	return false;
 }
@@ -1,36 +1,173 @@
 #ifndef DIRECTORY_HPP
 #define DIRECTORY_HPP
 
-#include "inode.hpp"
+#include "target.hpp"
 
 #include <cstddef>
+#include <cstdint>
+#include <iosfwd>
 #include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
 #include <vector>
 
 #include <sys/types.h>
 
-struct directory_change {
-	enum { UNLINK, LINK, RENAME } type;
-	std::string name;
-	std::string name2;
+enum directory_writeback_mode {
+	DIRECTORY_WRITEBACK_ALL,
+	DIRECTORY_WRITEBACK_NONE
 };
 
-struct directory : inode {
-	directory(const std::string& path) : path(path) {}
+/*
+ * The hidden directory that pinned files live in.
+ */
+extern const char pinned_directory[];
 
-	void link(ino_t inode_number, const std::string& name);
-	void unlink(const std::string& name);
-	void rename(const std::string& old_name,
-				const std::string& new_name);
+/*
+ * Files that a directory would have to put back if power were lost, kept
+ * alive by hard links in a hidden directory at the root of the target.
+ * Pins are numbered from 1, and 0 means no pin.
+ */
+struct pinned_files {
+	explicit pinned_files(target& tree);
 
-	void write(int fd, const char *data, std::size_t size, off_t offset) override;
-	void truncate(int fd, std::size_t size) override;
-	void synchronize(int fd) override;
-	void lose_power() override;
+	/*
+	 * Link the file at path into the hidden directory.
+	 */
+	std::uint64_t pin(std::string_view path);
+
+	/*
+	 * Link a pinned file back in at path, which must be free.
+	 */
+	void restore(std::uint64_t pin, std::string_view path);
+
+	void release(std::uint64_t pin);
+
+	/*
+	 * Take over a pin that a checkpoint left in the hidden directory.
+	 */
+	void adopt(std::uint64_t pin);
+
+	/*
+	 * Release everything, and remove the hidden directory.
+	 */
+	void clear();
+
+	std::uint64_t next_pin() const { return next; }
+	void set_next_pin(std::uint64_t pin) { next = pin; }
 
 private:
-	std::string path;
-	std::vector<directory_change> undo_log;
+	std::string path(std::uint64_t pin) const;
+
+	target& tree;
+	std::uint64_t next;
+	std::unordered_set<std::uint64_t> live;
 };
 
+/*
+ * A directory remembers what each of its entries was at the last fsync,
+ * if it has been changed since, so that losing power can put it back.
+ * Changes to the same name collapse into one: only the first since the
+ * fsync is remembered, and a name that was created and then removed again
+ * is forgotten.  The replayer tells us about each change, and makes sure
+ * we know our current path.
+ */
+struct directory {
+	directory(target& tree, pinned_files& pins, std::string_view path);
+
+	/*
+	 * Call before changing or removing the entry name, to remember what
+	 * it is now if that's what it was at the last fsync.
+	 */
+	void changing(const std::string& name);
+
+	/*
+	 * Call after creating the entry name where there was nothing.
+	 */
+	void added(const std::string& name);
+
+	/*
+	 * Call after removing the entry name.
+	 */
+	void removed(const std::string& name);
+
+	/*
+	 * Treat the change to name as having reached the disk already.
+	 */
+	void commit(const std::string& name);
+
+	/*
+	 * Whether name has changed since the last fsync.
+	 */
+	bool changed(const std::string& name) const;
+
+	bool pending() const { return !journal.empty(); }
+
+	const std::string& path() const { return directory_path; }
+	void set_path(std::string_view path);
+
+	/*
+	 * Losing power happens in two passes over every directory with
+	 * pending changes: first remove whatever has appeared in place of
+	 * the entries we remember, deepest directories first, and then put
+	 * back the files that were there.  lose_power() then forgets the
+	 * changes.
+	 */
+	void undo_additions();
+	void undo_removals();
+
+	void synchronize();
+	void lose_power();
+
+	/*
+	 * Write out, and read back in, the changes we'd undo.  Used for
+	 * checkpoints.
+	 */
+	void save(std::ostream& out) const;
+	void load(std::istream& in);
+
+private:
+	/*
+	 * What an entry was at the last fsync: nothing, or the file held by
+	 * pin.  Directories that were there are never changed without
+	 * committing, so they don't need to be remembered.  Entries from
+	 * before the last fsync have an older generation and are dead, but
+	 * are left in place for reuse, so that fsync needn't visit them.
+	 */
+	struct original {
+		std::uint64_t generation;
+		std::size_t position;
+		std::uint64_t pin;
+	};
+	typedef std::unordered_map<std::string, original> original_map;
+
+	std::string entry_path(const std::string& name) const;
+	original *find(const std::string& name);
+	void record(const std::string& name, std::uint64_t pin);
+	void drop(original_map::value_type *entry);
+	void purge();
+
+	target& tree;
+	pinned_files& pins;
+	std::string directory_path;
+	std::uint64_t generation;
+	original_map originals;
+
+	/*
+	 * The live entries, in no particular order, and every pin taken
+	 * since the last fsync.
+	 */
+	std::vector<original_map::value_type *> journal;
+	std::vector<std::uint64_t> held;
+};
+
+std::string
+stringify(directory_writeback_mode mode);
+
+bool
+parse_directory_writeback_mode(const std::string& name,
+							   directory_writeback_mode& out);
+
 #endif
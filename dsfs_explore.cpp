@@ -0,0 +1,605 @@
+#include "checker.hpp"
+#include "crash_schedule.hpp"
+#include "image_hash.hpp"
+#include "memory_target.hpp"
+#include "operation.hpp"
+#include "replayer.hpp"
+#include "target.hpp"
+#include "tree.hpp"
+#include "work_stealing.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * How many operations to read at a time.
+ */
+static const std::size_t batch_size = 1024;
+
+static int
+usage(const char *program_name)
+{
+	std::cerr << "usage: " << program_name << " --log PATH --checker COMMAND\n"
+			  << "  [ --points WHEN ]        : where to crash (default fsync)\n"
+			  << "  [ --writeback MODES ]    : comma-separated modes (default all)\n"
+			  << "  [ --seed N ]             : first seed for random (default 0)...\n"
+			  << "  [ --seeds N ]            : ...and how many to try (default 1)\n"
+			  << "  [ --sector-size bytes ]  : simulated sector size\n"
+			  << "  [ --directory-writeback MODE ]\n"
+			  << "                           : all, or none to undo unsynced directory changes\n"
+			  << "  [ --workers N ]          : run N jobs at a time\n"
+			  << "  [ --timeout SECONDS ]    : kill checkers after this long (0: never)\n"
+			  << "  [ --scratch DIR ]        : build images in DIR (default dsfs_explore.scratch)\n"
+			  << "  [ --keep-failed ]        : keep images that didn't pass in DIR/failed\n"
+			  << "  [ --memory ]             : model each target in memory\n"
+			  << "  [ --direct ]             : bypass the page cache with O_DIRECT\n"
+			  << "  [ --buffer-limit MB ]    : keep at most MB of unsynced sectors in memory\n"
+			  << "                             per worker, and spill the rest to scratch\n"
+			  << "  [ --lose-up-to K ]       : check every way of losing up to K\n"
+			  << "                             unsynced sectors at each point\n"
+			  << "  [ --verdict-cache PATH ] : don't check images that hash the same as\n"
+			  << "                             ones already checked, here or in an\n"
+			  << "                             earlier run with the same PATH\n"
+			  << "where WHEN is one of:\n"
+			  << "  every:N, fsync, create:PATH\n"
+			  << "where MODES are from:\n"
+			  << "  all, none, odd, even, random\n"
+			  << "COMMAND is run by /bin/sh with the image as $1, and DSFS_IMAGE,\n"
+			  << "DSFS_POINT, DSFS_WRITEBACK and DSFS_SEED in its environment.  It passes if it\n"
+			  << "exits with status 0.\n";
+	return EXIT_FAILURE;
+}
+
+/*
+ * The verdict on one image, which sectors were lost to make it if we're
+ * enumerating losses, and whether it came from the verdict cache.
+ */
+struct outcome {
+	std::string lost;
+	check_result result;
+	bool cached;
+};
+
+/*
+ * Crash images to build and check: what --take point would leave behind
+ * with the given writeback mode, or with --lose-up-to, each distinct
+ * image that losing some of the unsynced sectors there would leave.
+ */
+struct job {
+	int point;
+	file_writeback_mode mode;
+	std::uint64_t seed;
+	std::vector<outcome> outcomes;
+
+	/*
+	 * The mode, and the seed too if it makes a difference.
+	 */
+	std::string pattern() const
+	{
+		if (mode == FILE_WRITEBACK_RANDOM)
+			return stringify(mode) + ":" + std::to_string(seed);
+		return stringify(mode);
+	}
+};
+
+struct explore_options {
+	std::string log_path;
+	std::string command;
+	std::string scratch;
+	off_t sector_size;
+	double timeout;
+	bool keep_failed;
+	bool memory;
+	bool direct;
+	std::size_t buffer_limit;
+	int max_lost;
+	directory_writeback_mode directory_mode;
+	verdict_cache *verdicts;
+};
+
+static void
+make_directory(const std::string& path, bool may_exist = false)
+{
+	if (::mkdir(path.c_str(), 0777) < 0 && !(may_exist && errno == EEXIST)) {
+		std::string error = std::strerror(errno);
+		throw std::runtime_error("could not create " + path + ": " + error);
+	}
+}
+
+/*
+ * Read the whole log once, to find its crash points and the number of
+ * operations in it.  The end of the log is always a crash point.
+ */
+static std::vector<int>
+find_points(const std::string& log_path, const crash_schedule& when)
+{
+	std::ifstream log(log_path, std::ios_base::binary);
+	operation_reader reader;
+	operation_batch batch;
+	std::vector<int> points;
+	int operations = 0;
+
+	if (!log)
+		throw std::runtime_error("could not open log " + log_path);
+	do {
+		batch.clear();
+		reader.read_batch(log, batch, batch_size);
+		for (const operation& op : batch.operations) {
+			if (when.boundary(op, operations) &&
+				(points.empty() || points.back() != operations))
+				points.push_back(operations);
+			++operations;
+		}
+	} while (!batch.stop);
+	if (points.empty() || points.back() != operations)
+		points.push_back(operations);
+
+	return points;
+}
+
+/*
+ * A worker's replay in progress.  Its jobs usually come in ascending
+ * order for one writeback mode and seed, so it carries on from where the
+ * last job left off, and only starts again from the beginning of the log
+ * when it has to go backwards or change mode or seed.
+ */
+struct explore_worker {
+	explore_worker(const explore_options& options, std::size_t id) :
+		options(options),
+		directory(options.scratch + "/" + std::to_string(id)),
+		operations(0),
+		next(0)
+	{
+		remove_tree(directory);
+		make_directory(directory);
+	}
+
+	void run(job& j)
+	{
+		if (!fs || j.mode != mode || j.seed != seed || operations > j.point)
+			restart(j.mode, j.seed);
+		advance(j.point);
+
+		std::string name = std::to_string(j.point) + "." + j.pattern();
+		std::string replay_output = directory + "/replay.out";
+		int fd = ::open(replay_output.c_str(),
+						O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+		if (fd < 0) {
+			std::string error = std::strerror(errno);
+			throw std::runtime_error("could not create " + replay_output +
+									 ": " + error);
+		}
+		try {
+			if (options.max_lost < 0)
+				crash(j, name, fd);
+			else
+				enumerate(j, name, fd);
+		} catch (...) {
+			::close(fd);
+			throw;
+		}
+		::close(fd);
+
+		bool passed = std::all_of(j.outcomes.begin(), j.outcomes.end(),
+								  [](const outcome& o) {
+			return o.result.verdict == check_result::PASSED;
+		});
+		if (!passed && options.keep_failed) {
+			std::string kept = options.scratch + "/failed/" + name + ".replay";
+			if (::rename(replay_output.c_str(), kept.c_str()) < 0) {
+				std::string error = std::strerror(errno);
+				throw std::runtime_error("could not keep " + kept + ": " + error);
+			}
+		}
+	}
+
+private:
+	/*
+	 * Check the image that crashing at the job's point leaves.  With a
+	 * verdict cache, we hash it first, without building it if we can.
+	 */
+	void crash(job& j, const std::string& name, int output_fd)
+	{
+		std::string image = directory + "/image";
+		std::uint64_t key = 0;
+		bool built = false;
+		check_result result;
+
+		if (options.verdicts) {
+			std::uint64_t hash;
+
+			if (!fs->crash_image_hash(hash)) {
+				build(image, output_fd);
+				built = true;
+				hash = hash_tree(image);
+			}
+			key = verdict_cache::key(hash, options.command);
+			if (options.verdicts->find(key, result)) {
+				if (built)
+					remove_tree(image);
+				j.outcomes.push_back(outcome{ "", result, true });
+				return;
+			}
+		}
+		if (!built)
+			build(image, output_fd);
+		result = check(image, j, name);
+		if (options.verdicts)
+			options.verdicts->insert(key, result);
+		j.outcomes.push_back(outcome{ "", result, false });
+	}
+
+	void build(const std::string& image, int output_fd)
+	{
+		remove_tree(image);
+		make_directory(image);
+		fs->crash_image(image, output_fd);
+	}
+
+	/*
+	 * Run the checker on an image, and then either remove it, or keep it
+	 * and the checker's output as failed/name if it didn't pass.
+	 */
+	check_result check(const std::string& image, const job& j, const std::string& name)
+	{
+		std::string check_output = directory + "/check.out";
+		check_result result = run_checker(options.command,
+										  image,
+										  { "DSFS_IMAGE=" + image,
+											"DSFS_POINT=" + std::to_string(j.point),
+											"DSFS_WRITEBACK=" + stringify(j.mode),
+											"DSFS_SEED=" + std::to_string(j.seed) },
+										  check_output,
+										  options.timeout);
+
+		if (result.verdict != check_result::PASSED && options.keep_failed) {
+			std::string kept = options.scratch + "/failed/" + name;
+			remove_tree(kept);
+			if (::rename(image.c_str(), kept.c_str()) < 0 ||
+				::rename(check_output.c_str(), (kept + ".check").c_str()) < 0) {
+				std::string error = std::strerror(errno);
+				throw std::runtime_error("could not keep " + kept + ": " + error);
+			}
+		} else {
+			remove_tree(image);
+		}
+		return result;
+	}
+
+	/*
+	 * Check each distinct image that losing up to max_lost unsynced
+	 * sectors could leave.  The images are built and checked in a forked
+	 * copy of the replay, which reports back through a file.  The copy
+	 * looks verdicts up in a snapshot of the cache, since it can't share
+	 * the cache's lock, and we add its new ones when it's done.
+	 */
+	void enumerate(job& j, const std::string& name, int output_fd)
+	{
+		std::string images = directory + "/images";
+		std::string results_path = directory + "/results";
+		std::ofstream results(results_path);
+		std::size_t n = 0;
+		verdict_cache::verdict_map known;
+
+		if (options.verdicts)
+			known = options.verdicts->snapshot();
+		remove_tree(images);
+		make_directory(images);
+		fs->enumerate_crash_images(images,
+								   options.max_lost,
+								   [&](const std::string& image,
+									   const std::string& lost) {
+			std::string image_name = name + "." + std::to_string(n++);
+			std::uint64_t key = 0;
+			check_result result;
+			bool cached = false;
+
+			if (options.verdicts) {
+				key = verdict_cache::key(hash_tree(image), options.command);
+				auto found = known.find(key);
+				if (found != known.end()) {
+					result = found->second;
+					cached = true;
+					remove_tree(image);
+				}
+			}
+			if (!cached)
+				result = check(image, j, image_name);
+			results << result.verdict << " " << result.status << " "
+					<< result.seconds << " " << cached << " " << key << " "
+					<< lost << "\n";
+			if (!results.flush())
+				throw std::runtime_error("could not write " + results_path);
+		}, output_fd);
+
+		std::ifstream in(results_path);
+		outcome o;
+		int verdict;
+		std::uint64_t key;
+		while (in >> verdict >> o.result.status >> o.result.seconds >> o.cached >>
+			   key && in.ignore(1) && std::getline(in, o.lost)) {
+			o.result.verdict = check_result::verdict_type(verdict);
+			if (options.verdicts && !o.cached)
+				options.verdicts->insert(key, o.result);
+			j.outcomes.push_back(o);
+		}
+		remove_tree(images);
+	}
+
+	void restart(file_writeback_mode new_mode, std::uint64_t new_seed)
+	{
+		std::string live = directory + "/live";
+		std::unique_ptr<target> tree;
+
+		fs.reset();
+		remove_tree(live);
+		make_directory(live);
+		if (options.memory)
+			tree = std::make_unique<memory_target>(live);
+		else if (options.direct)
+			tree = std::make_unique<posix_target>(live,
+												  std::make_unique<direct_io>(),
+												  true);
+		else
+			tree = std::make_unique<posix_target>(live, nullptr);
+		fs = std::make_unique<replayer>(std::move(tree),
+										options.sector_size,
+										new_mode,
+										new_seed,
+										options.directory_mode);
+		if (options.buffer_limit > 0)
+			fs->limit_buffering(options.buffer_limit, directory);
+		mode = new_mode;
+		seed = new_seed;
+
+		log.close();
+		log.clear();
+		log.open(options.log_path, std::ios_base::binary);
+		if (!log)
+			throw std::runtime_error("could not open log " + options.log_path);
+		batch.clear();
+		operations = 0;
+		next = 0;
+	}
+
+	void advance(int point)
+	{
+		while (operations < point) {
+			if (next == batch.operations.size()) {
+				if (batch.stop)
+					throw std::runtime_error("log " + options.log_path +
+											 " ended early");
+				batch.clear();
+				reader.read_batch(log, batch, batch_size);
+				next = 0;
+				continue;
+			}
+
+			std::size_t n = std::min(batch.operations.size() - next,
+									 std::size_t(point - operations));
+			fs->replay_batch(operation_span(batch.operations.data() + next, n));
+			next += n;
+			operations += n;
+		}
+	}
+
+	const explore_options& options;
+	std::string directory;
+	std::unique_ptr<replayer> fs;
+	file_writeback_mode mode;
+	std::uint64_t seed;
+	std::ifstream log;
+	operation_reader reader;
+	operation_batch batch;
+	int operations;
+	std::size_t next;
+};
+
+static bool
+parse_modes(const std::string& spec, std::vector<file_writeback_mode>& out)
+{
+	std::istringstream in(spec);
+	std::string name;
+
+	out.clear();
+	while (std::getline(in, name, ',')) {
+		file_writeback_mode mode;
+		if (!parse_writeback_mode(name, mode))
+			return false;
+		if (std::find(out.begin(), out.end(), mode) == out.end())
+			out.push_back(mode);
+	}
+	return !out.empty();
+}
+
+int
+main(int argc, const char *argv[])
+{
+	explore_options options;
+	std::string cache_path;
+	crash_schedule when;
+	std::vector<file_writeback_mode> modes = { FILE_WRITEBACK_ALL };
+	std::uint64_t first_seed = 0;
+	std::uint64_t seeds = 1;
+	std::size_t workers = std::max(1u, std::thread::hardware_concurrency());
+
+	options.scratch = "dsfs_explore.scratch";
+	options.sector_size = 512;
+	options.timeout = 300;
+	options.keep_failed = false;
+	options.memory = false;
+	options.direct = false;
+	options.buffer_limit = 0;
+	options.max_lost = -1;
+	options.directory_mode = DIRECTORY_WRITEBACK_ALL;
+	options.verdicts = nullptr;
+	when.kind = crash_schedule::FSYNC;
+
+	for (int i = 1; i < argc; ++i) {
+		std::string opt = argv[i];
+		bool more = i + 1 < argc;
+		if (opt == "--log" && more) {
+			options.log_path = argv[++i];
+		} else if (opt == "--checker" && more) {
+			options.command = argv[++i];
+		} else if (opt == "--points" && more) {
+			if (!parse_crash_schedule(argv[++i], when))
+				return usage(argv[0]);
+		} else if (opt == "--writeback" && more) {
+			if (!parse_modes(argv[++i], modes))
+				return usage(argv[0]);
+		} else if (opt == "--seed" && more) {
+			first_seed = std::strtoull(argv[++i], nullptr, 0);
+		} else if (opt == "--seeds" && more) {
+			seeds = std::strtoull(argv[++i], nullptr, 0);
+			if (seeds == 0)
+				return usage(argv[0]);
+		} else if (opt == "--sector-size" && more) {
+			options.sector_size = atoi(argv[++i]);
+		} else if (opt == "--directory-writeback" && more) {
+			if (!parse_directory_writeback_mode(argv[++i], options.directory_mode))
+				return usage(argv[0]);
+		} else if (opt == "--workers" && more) {
+			workers = atoi(argv[++i]);
+			if (workers == 0)
+				return usage(argv[0]);
+		} else if (opt == "--timeout" && more) {
+			options.timeout = atof(argv[++i]);
+		} else if (opt == "--scratch" && more) {
+			options.scratch = argv[++i];
+		} else if (opt == "--keep-failed") {
+			options.keep_failed = true;
+		} else if (opt == "--memory") {
+			options.memory = true;
+		} else if (opt == "--direct") {
+			options.direct = true;
+		} else if (opt == "--buffer-limit" && more) {
+			options.buffer_limit = std::strtoull(argv[++i], nullptr, 0) * 1024 * 1024;
+			if (options.buffer_limit == 0)
+				return usage(argv[0]);
+		} else if (opt == "--lose-up-to" && more) {
+			options.max_lost = atoi(argv[++i]);
+			if (options.max_lost < 0)
+				return usage(argv[0]);
+		} else if (opt == "--verdict-cache" && more) {
+			cache_path = argv[++i];
+		} else {
+			return usage(argv[0]);
+		}
+	}
+	if (options.log_path.empty() || options.command.empty() ||
+		(options.memory && options.direct))
+		return usage(argv[0]);
+
+	try {
+		std::vector<int> points = find_points(options.log_path, when);
+		std::vector<job> jobs;
+		std::unique_ptr<verdict_cache> verdicts;
+
+		if (!cache_path.empty()) {
+			verdicts = std::make_unique<verdict_cache>(cache_path);
+			options.verdicts = verdicts.get();
+		}
+
+		// Mode and seed first, then ascending crash points, so that
+		// handing each worker a contiguous share lets it build its images
+		// in one pass over the log.  Only random writeback cares about
+		// the seed.
+		for (file_writeback_mode mode : modes) {
+			std::uint64_t n = mode == FILE_WRITEBACK_RANDOM ? seeds : 1;
+			for (std::uint64_t seed = first_seed; seed < first_seed + n; ++seed) {
+				for (int point : points)
+					jobs.push_back(job{ point, mode, seed, {} });
+			}
+		}
+		workers = std::min(workers, jobs.size());
+
+		make_directory(options.scratch, true);
+		if (options.keep_failed)
+			make_directory(options.scratch + "/failed", true);
+
+		work_stealing_queues<job *> queues(workers);
+		for (std::size_t i = 0; i < jobs.size(); ++i)
+			queues.push(i * workers / jobs.size(), &jobs[i]);
+
+		std::vector<std::exception_ptr> errors(workers);
+		std::atomic<bool> failed(false);
+		std::vector<std::thread> threads;
+		for (std::size_t id = 0; id < workers; ++id) {
+			threads.emplace_back([&, id]() {
+				try {
+					explore_worker worker(options, id);
+					job *j;
+
+					while (!failed.load() && queues.pop(id, j))
+						worker.run(*j);
+				} catch (...) {
+					errors[id] = std::current_exception();
+					failed.store(true);
+				}
+			});
+		}
+		for (std::thread& thread : threads)
+			thread.join();
+		for (std::exception_ptr& error : errors) {
+			if (error)
+				std::rethrow_exception(error);
+		}
+
+		std::size_t totals[3] = {};
+		std::size_t cached = 0;
+		std::sort(jobs.begin(), jobs.end(), [](const job& a, const job& b) {
+			if (a.point != b.point)
+				return a.point < b.point;
+			return a.mode != b.mode ? a.mode < b.mode : a.seed < b.seed;
+		});
+		for (const job& j : jobs) {
+			for (const outcome& o : j.outcomes) {
+				std::cout << j.point << " " << j.pattern() << " "
+						  << stringify(o.result.verdict) << " "
+						  << o.result.status << " "
+						  << std::fixed << std::setprecision(3) << o.result.seconds;
+				if (o.cached)
+					std::cout << " cached";
+				if (!o.lost.empty())
+					std::cout << " lost " << o.lost;
+				std::cout << "\n";
+				++totals[o.result.verdict];
+				cached += o.cached;
+			}
+		}
+		std::cout << "passed " << totals[check_result::PASSED] << "\n"
+				  << "failed " << totals[check_result::FAILED] << "\n"
+				  << "timed-out " << totals[check_result::TIMED_OUT] << "\n";
+		if (verdicts)
+			std::cout << "cached " << cached << "\n";
+
+		for (std::size_t id = 0; id < workers; ++id)
+			remove_tree(options.scratch + "/" + std::to_string(id));
+
+		if (totals[check_result::FAILED] + totals[check_result::TIMED_OUT] > 0)
+			return EXIT_FAILURE;
+	} catch (const std::exception& e) {
+		std::cerr << e.what() << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,81 @@
+#include "log_index.hpp"
+#include "operation.hpp"
+
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+
+static int
+usage(const char *program_name)
+{
+	std::cerr << "usage: " << program_name << " log_path\n"
+			  << "  [ --interval N ]         : index every Nth record (default 1024)\n"
+			  << "  [ --output PATH ]        : index path (default log_path.index)\n"
+			  << "  [ --summary ]            : print operation counts from an existing index\n";
+	return EXIT_FAILURE;
+}
+
+int
+main(int argc, const char *argv[])
+{
+	std::string log_path;
+	std::string index_path;
+	std::size_t interval = 1024;
+	bool summary = false;
+
+	if (argc < 2)
+		return usage(argv[0]);
+
+	log_path = argv[1];
+	for (int i = 2; i < argc; ++i) {
+		std::string opt = argv[i];
+		bool more = i + 1 < argc;
+		if (opt == "--interval" && more) {
+			interval = atoi(argv[++i]);
+			if (interval < 1)
+				return usage(argv[0]);
+		} else if (opt == "--output" && more) {
+			index_path = argv[++i];
+		} else if (opt == "--summary") {
+			summary = true;
+		} else {
+			return usage(argv[0]);
+		}
+	}
+	if (index_path.empty())
+		index_path = log_index_path(log_path);
+
+	try {
+		log_index index;
+
+		if (summary) {
+			std::ifstream index_file(index_path);
+			if (!index_file)
+				throw std::runtime_error("could not open index " + index_path);
+			index.load(index_file);
+
+			const log_index_entry& end = index.end();
+			std::cout << "records " << end.record << "\n";
+			for (int i = 0; i < operation_type_count; ++i)
+				std::cout << stringify(static_cast<operation::op_type>(i))
+						  << " " << end.counts[i] << "\n";
+		} else {
+			std::ifstream log_file(log_path, std::ios_base::binary);
+			if (!log_file)
+				throw std::runtime_error("could not open log " + log_path);
+			index.build(log_file, interval);
+
+			std::ofstream index_file(index_path);
+			if (!index_file)
+				throw std::runtime_error("could not create index " + index_path);
+			index.save(index_file);
+			if (!index_file.flush())
+				throw std::runtime_error("could not write index " + index_path);
+		}
+	} catch (const std::exception& e) {
+		std::cerr << e.what() << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
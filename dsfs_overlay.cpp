@@ -0,0 +1,57 @@
+#include "overlay.hpp"
+#include "tree.hpp"
+
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+
+static int
+usage(const char *program_name)
+{
+	std::cerr << "usage: " << program_name << " make BASE IMAGE OVERLAY\n"
+			  << "       " << program_name << " apply BASE OVERLAY DIR\n"
+			  << "  make                     : write the changes from BASE to IMAGE to OVERLAY\n"
+			  << "  apply                    : copy BASE into DIR, which should be empty,\n"
+			  << "                             and apply OVERLAY to it\n"
+			  << "where BASE is a tree or a checkpoint\n";
+	return EXIT_FAILURE;
+}
+
+int
+main(int argc, const char *argv[])
+{
+	if (argc != 5)
+		return usage(argv[0]);
+
+	std::string command = argv[1];
+	std::string base = overlay_base_tree(argv[2]);
+
+	try {
+		if (command == "make") {
+			std::string overlay_path = argv[4];
+			std::ofstream overlay(overlay_path, std::ios_base::binary);
+
+			if (!overlay)
+				throw std::runtime_error("could not create " + overlay_path);
+			write_overlay(base, argv[3], overlay);
+			if (!overlay.flush())
+				throw std::runtime_error("could not write " + overlay_path);
+		} else if (command == "apply") {
+			std::string overlay_path = argv[3];
+			std::ifstream overlay(overlay_path, std::ios_base::binary);
+
+			if (!overlay)
+				throw std::runtime_error("could not open " + overlay_path);
+			copy_tree(base, argv[4]);
+			apply_overlay(overlay, argv[4]);
+		} else {
+			return usage(argv[0]);
+		}
+	} catch (const std::exception& e) {
+		std::cerr << e.what() << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -553,6 +553,20 @@ dsfs_fsync(const char *path, int isdatasync, struct fuse_file_info *fi)
 	return 0;
 }
 
+static int
+dsfs_fsyncdir(const char *path, int isdatasync, struct fuse_file_info *fi)
+{
+	// Directories don't get file handles of their own, so this is logged
+	// as an fsync by path.
+	dsfs_log_begin("fsync");
+	dsfs_log_string(path);
+	dsfs_log_number(isdatasync);
+	dsfs_log_number(-1);
+	dsfs_log_end();
+
+	return 0;
+}
+
 #ifdef HAVE_POSIX_FALLOCATE
 static int
 dsfs_fallocate(const char *path, int mode,
@@ -628,6 +642,7 @@ static struct fuse_operations dsfs_operations = {
 	.release		= dsfs_release,
 	.fsync			= dsfs_fsync,
 	.readdir		= dsfs_readdir,
+	.fsyncdir		= dsfs_fsyncdir,
 	.access			= dsfs_access,
 	.create			= dsfs_create,
 	.ftruncate		= dsfs_ftruncate,
@@ -1,14 +1,49 @@
+#include "crash_schedule.hpp"
+#include "log_index.hpp"
+#include "memory_target.hpp"
 #include "operation.hpp"
+#include "overlay.hpp"
+#include "parallel_parser.hpp"
+#include "pipeline.hpp"
+#include "replay_stats.hpp"
 #include "replayer.hpp"
+#include "target.hpp"
+#include "tree.hpp"
+#include "uring_io.hpp"
 
+#include <algorithm>
+#include <cerrno>
 #include <climits>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
 #include <iostream>
+#include <limits>
+#include <memory>
+#include <sstream>
+
+#include <sys/stat.h>
+
+/*
+ * How many operations to read at a time when parsing on this thread.
+ */
+static const std::size_t batch_size = 1024;
 
 static int
 usage(const char *program_name)
 {
 	std::cerr << "usage: " << program_name << " target_path\n"
 			  << "  [ --sector-size bytes ]  : simulated sector size\n"
+			  << "  [ --log PATH ]           : read log from PATH instead of stdin\n"
+			  << "  [ --index PATH ]         : seek using an index built by dsfs_index\n"
+			  << "  [ --parse-threads N ]    : parse --log on N background threads\n"
+			  << "  [ --pipeline ]           : parse and write on separate threads\n"
+			  << "  [ --io-uring ]           : batch writes through io_uring (Linux)\n"
+			  << "  [ --memory ]             : model the target in memory, write it at the end\n"
+			  << "  [ --direct ]             : bypass the page cache with O_DIRECT\n"
+			  << "  [ --buffer-limit MB ]    : keep at most MB of unsynced sectors in memory...\n"
+			  << "  [ --spill-dir DIR ]      : ...and spill the rest to a file in DIR (default $TMPDIR)\n"
 			  << "  [ --skip N ]             : skip first N ops\n"
 			  << "  [ --take N ]             : only replay N ops\n"
 			  << "  [ --start-before-OP N ]  : skip up until Nth OP\n"
@@ -17,29 +52,278 @@ usage(const char *program_name)
 			  << "  [ --stop-after-OP N ]    : up to and including Nth OP\n"
 			  << "  [ --stop-touch PATH ]    : stop after PATH is created\n"
 			  << "  [ --start-touch PATH ]   : start after PATH is created\n"
+			  << "  [ --fast-forward ]       : build the state at the start point in memory\n"
 			  << "  [ --writeback MODE ]     : which sectors to write before fsync\n"
+			  << "  [ --seed N ]             : seed for --writeback random\n"
+			  << "  [ --directory-writeback MODE ]\n"
+			  << "                           : all, or none to undo unsynced directory changes\n"
+			  << "  [ --checkpoint-every N ] : save a checkpoint every N ops...\n"
+			  << "  [ --checkpoint-dir DIR ] : ...in DIR/<ops replayed so far>\n"
+			  << "  [ --resume-from PATH ]   : carry on from a checkpoint (needs --log)\n"
+			  << "  [ --sweep WHEN ]         : save a crash image at each boundary...\n"
+			  << "  [ --sweep-dir DIR ]      : ...in DIR/<ops replayed so far>\n"
+			  << "  [ --lose-up-to K ]       : at the end, save an image for each way...\n"
+			  << "  [ --lose-dir DIR ]       : ...of losing up to K unsynced sectors in DIR\n"
+			  << "  [ --overlay-base PATH ]  : save images as overlays on PATH or its checkpoint\n"
+			  << "  [ --stats[=json] ]       : report counts and timings on stderr at the end\n"
 			  << "where OP is one of:\n"
 			  << "  create, open, write, release, fsync, link unlink, rename, mkdir, rmdir\n"
 			  << "where MODE is one of:\n"
-			  << "  all, none, odd, even, random\n";
+			  << "  all, none, odd, even, random\n"
+			  << "where WHEN is one of:\n"
+			  << "  every:N, fsync, create:PATH\n";
 	return EXIT_FAILURE;
 }
 
+/*
+ * A --start-before-OP style trigger, which fires when we see the Nth
+ * operation of a given type.
+ */
+struct trigger {
+	trigger() : active(false), op(operation::OP_MKDIR), n(0), after(false) {}
+	bool active;
+	operation::op_type op;
+	std::size_t n;
+	bool after;
+};
+
+/*
+ * Parse options of the form --start-before-fsync N.
+ */
+static bool
+parse_trigger(const std::string& opt,
+			  const char *prefix,
+			  const char *value,
+			  trigger& out)
+{
+	std::string rest;
+	std::size_t prefix_length = std::strlen(prefix);
+
+	if (opt.compare(0, prefix_length, prefix) != 0)
+		return false;
+	rest = opt.substr(prefix_length);
+	if (rest.compare(0, 7, "before-") == 0) {
+		out.after = false;
+		rest = rest.substr(7);
+	} else if (rest.compare(0, 6, "after-") == 0) {
+		out.after = true;
+		rest = rest.substr(6);
+	} else {
+		return false;
+	}
+	if (!parse_op_type(rest, out.op))
+		return false;
+	out.n = atoi(value);
+	out.active = out.n > 0;
+	return true;
+}
+
+/*
+ * Where a checkpoint was taken, so that we can carry on reading the log
+ * from there.  We can only seek to the start of a batch, so we also
+ * record how many records to skip after seeking.
+ */
+struct log_position {
+	std::size_t record;
+	off_t seek_offset;
+	std::size_t seek_record;
+	int operations;
+	std::size_t counts[operation_type_count];
+};
+
+static void
+save_position(const std::string& path, const log_position& position)
+{
+	std::ofstream out(path);
+
+	out << "dsfs-position 1\n"
+		<< "record " << position.record << "\n"
+		<< "operations " << position.operations << "\n"
+		<< "seek " << position.seek_offset << " " << position.seek_record << "\n";
+	for (int i = 0; i < operation_type_count; ++i)
+		out << "count " << stringify(operation::op_type(i)) << " "
+			<< position.counts[i] << "\n";
+	out << "end\n";
+	if (!out.flush())
+		throw std::runtime_error("could not write " + path);
+}
+
+static void
+load_position(const std::string& path, log_position& position)
+{
+	std::ifstream in(path);
+	std::string word;
+	int version;
+
+	if (!in)
+		throw std::runtime_error("could not open " + path);
+	if (!(in >> word >> version) || word != "dsfs-position" || version != 1 ||
+		!(in >> word >> position.record) || word != "record" ||
+		!(in >> word >> position.operations) || word != "operations" ||
+		!(in >> word >> position.seek_offset >> position.seek_record) ||
+		word != "seek" || position.seek_record > position.record)
+		throw std::runtime_error("bad log position in " + path);
+	std::fill(std::begin(position.counts), std::end(position.counts), 0);
+	while (in >> word && word == "count") {
+		std::string name;
+		operation::op_type op;
+		std::size_t count;
+
+		if (!(in >> name >> count) || !parse_op_type(name, op))
+			throw std::runtime_error("bad operation count in " + path);
+		position.counts[op] = count;
+	}
+	if (word != "end")
+		throw std::runtime_error("truncated log position in " + path);
+}
+
+/*
+ * Save a checkpoint as checkpoint_dir/N, where N is the number of
+ * operations replayed so far.  It's built under a temporary name and
+ * renamed into place, so a checkpoint that exists is complete.
+ */
+static void
+take_checkpoint(replayer& fs,
+				const std::string& checkpoint_dir,
+				const log_position& position)
+{
+	std::string path = checkpoint_dir + "/" + std::to_string(position.operations);
+	std::string temporary = path + ".tmp";
+
+	remove_tree(temporary);
+	if (::mkdir(temporary.c_str(), 0777) < 0) {
+		std::string error = std::strerror(errno);
+		throw std::runtime_error("could not create " + temporary + ": " + error);
+	}
+	fs.save_checkpoint(temporary);
+	save_position(temporary + "/position", position);
+	remove_tree(path);
+	if (::rename(temporary.c_str(), path.c_str()) < 0) {
+		std::string error = std::strerror(errno);
+		throw std::runtime_error("could not rename " + temporary + ": " + error);
+	}
+}
+
+/*
+ * Where --sweep takes crash images.  There's always an image of the final
+ * state too.
+ */
+struct sweep_schedule {
+	sweep_schedule() : last_image(-1) {}
+
+	bool active() const { return when.active(); }
+
+	/*
+	 * Should we take an image before replaying op?
+	 */
+	bool boundary(const operation& op, int operations) const
+	{
+		return operations != last_image && when.boundary(op, operations);
+	}
+
+	/*
+	 * Save an image as dir/N, where N is the number of operations
+	 * replayed so far, so that it matches what --take N would leave.  With
+	 * an overlay base, the image is then replaced by an overlay.
+	 */
+	void take_image(replayer& fs, int operations)
+	{
+		std::string image = dir + "/" + std::to_string(operations);
+
+		remove_tree(image);
+		if (::mkdir(image.c_str(), 0777) < 0) {
+			std::string error = std::strerror(errno);
+			throw std::runtime_error("could not create " + image + ": " + error);
+		}
+		fs.crash_image(image);
+		if (!overlay_base.empty())
+			replace_with_overlay(overlay_base, image);
+		last_image = operations;
+	}
+
+	crash_schedule when;
+	std::string dir;
+	std::string overlay_base;
+	int last_image;
+};
+
+/*
+ * Write out the tree that prefix built while fast-forwarding, and carry
+ * on from there in fs.  An in-memory target has to read it back in from a
+ * temporary directory in scratch_dir.
+ */
+static void
+fast_forward(replayer& prefix,
+			 replayer& fs,
+			 const std::string& target_path,
+			 bool memory,
+			 const std::string& scratch_dir)
+{
+	std::stringstream state;
+
+	if (!memory) {
+		prefix.hand_over(target_path, state);
+		fs.take_over(state);
+		return;
+	}
+
+	std::string scratch = scratch_dir + "/dsfs_fast_forward.XXXXXX";
+	if (!::mkdtemp(&scratch[0])) {
+		std::string error = std::strerror(errno);
+		throw std::runtime_error("could not create " + scratch + ": " + error);
+	}
+	try {
+		prefix.hand_over(scratch, state);
+		fs.take_over(state, scratch);
+	} catch (...) {
+		remove_tree(scratch);
+		throw;
+	}
+	remove_tree(scratch);
+}
+
 int
 main(int argc, const char *argv[])
 {
 	std::string target_path;
-	operation op;
-	int line_number;
+	std::string log_path;
+	std::string index_path;
+	std::string checkpoint_dir;
+	std::string resume_path;
+	std::size_t checkpoint_every = 0;
+	std::string lose_dir;
+	int lose_up_to = -1;
+	std::string overlay_base;
+	sweep_schedule sweep;
+	std::size_t line_number;
+	std::size_t counts[operation_type_count] = {};
 	bool skip_until_start_trigger = false;
 
 	std::string start_touch;
 	std::string stop_touch;
+	trigger start;
+	trigger stop;
 	off_t sector_size = 512;
 	int take = std::numeric_limits<int>::max();
-	int skip = 0;
+	std::size_t skip = 0;
 	int operations = 0;
+	int parse_threads = 0;
+	bool pipeline = false;
+	bool io_uring = false;
+	bool memory = false;
+	bool direct = false;
+	bool fast_forwarding = false;
+	std::size_t buffer_limit = 0;
+	std::string spill_dir = std::getenv("TMPDIR") ? std::getenv("TMPDIR") : "/tmp";
 	file_writeback_mode writeback_mode = FILE_WRITEBACK_ALL;
+	directory_writeback_mode directory_mode = DIRECTORY_WRITEBACK_ALL;
+	std::uint64_t seed = 0;
+	bool stats = false;
+	bool stats_json = false;
+	replay_stats::clock::time_point start_time = replay_stats::clock::now();
+	replay_stats::clock::duration parse_time(0);
+	replay_stats::clock::duration apply_time(0);
+	replay_stats::clock::duration image_time(0);
 
 	if (argc < 2)
 		return usage(argv[0]);
@@ -50,58 +334,431 @@ main(int argc, const char *argv[])
 		bool more = i + 1 < argc;
 		if (opt == "--sector-size" && more) {
 			sector_size = atoi(argv[++i]);
+		} else if (opt == "--log" && more) {
+			log_path = argv[++i];
+		} else if (opt == "--index" && more) {
+			index_path = argv[++i];
+		} else if (opt == "--parse-threads" && more) {
+			parse_threads = atoi(argv[++i]);
+		} else if (opt == "--pipeline") {
+			pipeline = true;
+		} else if (opt == "--io-uring") {
+			io_uring = true;
+		} else if (opt == "--memory") {
+			memory = true;
+		} else if (opt == "--direct") {
+			direct = true;
+		} else if (opt == "--buffer-limit" && more) {
+			buffer_limit = std::strtoull(argv[++i], nullptr, 0) * 1024 * 1024;
+			if (buffer_limit == 0)
+				return usage(argv[0]);
+		} else if (opt == "--spill-dir" && more) {
+			spill_dir = argv[++i];
 		} else if (opt == "--take" && more) {
 			take = atoi(argv[++i]);
 		} else if (opt == "--skip" && more) {
 			skip = atoi(argv[++i]);
 		} else if (opt == "--writeback" && more) {
-			std::string mode = argv[++i];
-			if (mode == "all")
-				writeback_mode = FILE_WRITEBACK_ALL;
-			else if (mode == "none")
-				writeback_mode = FILE_WRITEBACK_NONE;
-			else if (mode == "odd")
-				writeback_mode = FILE_WRITEBACK_ODD;
-			else if (mode == "even")
-				writeback_mode = FILE_WRITEBACK_EVEN;
-			else if (mode == "random")
-				writeback_mode = FILE_WRITEBACK_RANDOM;
-			else
+			if (!parse_writeback_mode(argv[++i], writeback_mode))
+				return usage(argv[0]);
+		} else if (opt == "--seed" && more) {
+			seed = std::strtoull(argv[++i], nullptr, 0);
+		} else if (opt == "--directory-writeback" && more) {
+			if (!parse_directory_writeback_mode(argv[++i], directory_mode))
 				return usage(argv[0]);
+		} else if (opt == "--checkpoint-every" && more) {
+			checkpoint_every = atoi(argv[++i]);
+		} else if (opt == "--checkpoint-dir" && more) {
+			checkpoint_dir = argv[++i];
+		} else if (opt == "--resume-from" && more) {
+			resume_path = argv[++i];
+		} else if (opt == "--sweep" && more) {
+			if (!parse_crash_schedule(argv[++i], sweep.when))
+				return usage(argv[0]);
+		} else if (opt == "--sweep-dir" && more) {
+			sweep.dir = argv[++i];
+		} else if (opt == "--lose-up-to" && more) {
+			lose_up_to = atoi(argv[++i]);
+		} else if (opt == "--lose-dir" && more) {
+			lose_dir = argv[++i];
+		} else if (opt == "--overlay-base" && more) {
+			overlay_base = argv[++i];
+		} else if (opt == "--stats" || opt == "--stats=json") {
+			stats = true;
+			stats_json = opt == "--stats=json";
 		} else if (opt == "--stop-touch" && more) {
 			stop_touch = argv[++i];
 		} else if (opt == "--start-touch" && more) {
 			start_touch = argv[++i];
 			skip_until_start_trigger = true;
+		} else if (opt == "--fast-forward") {
+			fast_forwarding = true;
+		} else if (more && parse_trigger(opt, "--start-", argv[i + 1], start)) {
+			++i;
+		} else if (more && parse_trigger(opt, "--stop-", argv[i + 1], stop)) {
+			++i;
 		} else {
 			return usage(argv[0]);
 		}
 	}
+	if ((!index_path.empty() || parse_threads > 0 || !resume_path.empty()) &&
+		log_path.empty())
+		return usage(argv[0]);
+	if ((checkpoint_every > 0) != !checkpoint_dir.empty())
+		return usage(argv[0]);
+	if (sweep.active() == sweep.dir.empty())
+		return usage(argv[0]);
+	if ((lose_up_to >= 0) == lose_dir.empty())
+		return usage(argv[0]);
+	if (direct && (memory || io_uring))
+		return usage(argv[0]);
+	if (!overlay_base.empty() && !sweep.active() && lose_dir.empty())
+		return usage(argv[0]);
+	if (fast_forwarding && !resume_path.empty())
+		return usage(argv[0]);
 
+	line_number = 0;
 	try {
-		replayer fs(target_path, sector_size, writeback_mode);
-		line_number = 0;
-		while (operations < take && !!(std::cin >> op)) {
-			++line_number;
-
-			if (skip > 0) {
-				skip--;
-				continue;
+		std::ifstream log_file;
+		std::istream *log = &std::cin;
+		std::unique_ptr<parallel_parser> parser;
+		operation_reader reader;
+		operation_batch batch;
+
+		if (!log_path.empty()) {
+			log_file.open(log_path, std::ios_base::binary);
+			if (!log_file)
+				throw std::runtime_error("could not open log " + log_path);
+			log = &log_file;
+		}
+
+		// When resuming, go back to where the checkpoint was taken.  It
+		// was taken after we started replaying, so skip and start
+		// triggers have already been dealt with.
+		log_position resume_position;
+		if (!resume_path.empty()) {
+			operation op;
+			arena scratch;
+
+			load_position(resume_path + "/position", resume_position);
+			if (!log_file.seekg(resume_position.seek_offset))
+				throw std::runtime_error("could not seek in log " + log_path);
+			for (std::size_t i = resume_position.seek_record;
+				 i < resume_position.record;
+				 ++i) {
+				if (!reader.read(log_file, op, scratch))
+					throw std::runtime_error("log " + log_path +
+											 " ends before checkpoint " +
+											 resume_path);
+				scratch.reset();
+			}
+			line_number = resume_position.record;
+			operations = resume_position.operations;
+			std::copy(std::begin(resume_position.counts),
+					  std::end(resume_position.counts),
+					  std::begin(counts));
+			skip = 0;
+			start.active = false;
+			skip_until_start_trigger = false;
+		}
+
+		// If we have an index, we can jump over records that we'd
+		// otherwise have to parse and throw away, unless we're going to
+		// fast-forward through them.
+		if (resume_path.empty() && !index_path.empty() && !fast_forwarding &&
+			(skip > 0 || start.active)) {
+			log_index index;
+			std::ifstream index_file(index_path);
+
+			if (!index_file)
+				throw std::runtime_error("could not open index " + index_path);
+			index.load(index_file);
+
+			const log_index_entry *entry = &index.find_record(skip);
+			if (start.active) {
+				const log_index_entry& candidate =
+					index.find_operation(start.op, start.n);
+				if (candidate.record < entry->record)
+					entry = &candidate;
+			}
+			if (!log_file.seekg(entry->offset))
+				throw std::runtime_error("could not seek in log " + log_path);
+			line_number = entry->record;
+			skip -= std::min(skip, entry->record);
+			std::copy(std::begin(entry->counts),
+					  std::end(entry->counts),
+					  std::begin(counts));
+		}
+
+		if (parse_threads > 0)
+			parser = std::make_unique<parallel_parser>(log_path,
+													   log_file.tellg(),
+													   parse_threads);
+
+		// Fetch the next batch of operations, either by parsing the stream
+		// on this thread or from batches parsed by background threads.
+		bool log_ended = false;
+		batch_prefetcher::source_type read_batch = [&](operation_batch& batch) {
+			if (parser)
+				return parser->next(batch);
+			if (log_ended)
+				return false;
+			batch.clear();
+			batch.offset = log->tellg();
+			reader.read_batch(*log, batch, batch_size);
+			log_ended = batch.stop;
+			return !batch.operations.empty();
+		};
+
+		// In pipeline mode, parse ahead on another thread (the parallel
+		// parser already does that), and perform writes on another
+		// thread too, unless io_uring is taking care of that.
+		std::unique_ptr<batch_prefetcher> prefetcher;
+		std::unique_ptr<io_backend> io;
+		if (pipeline) {
+			if (!parser)
+				prefetcher = std::make_unique<batch_prefetcher>(read_batch);
+			if (!io_uring && !direct)
+				io = std::make_unique<threaded_io>();
+		}
+		if (io_uring)
+			io = std::make_unique<uring_io>();
+		if (direct)
+			io = std::make_unique<direct_io>();
+		auto next_batch = [&]() {
+			replay_stats::clock::time_point start = replay_stats::clock::now();
+			bool more = prefetcher ? prefetcher->next(batch) : read_batch(batch);
+
+			parse_time += replay_stats::clock::now() - start;
+			return more;
+		};
+
+		// An in-memory target does its own I/O, so there's no point in
+		// handing writes to another thread.
+		std::unique_ptr<target> tree;
+		if (memory)
+			tree = std::make_unique<memory_target>(target_path);
+		else
+			tree = std::make_unique<posix_target>(target_path, std::move(io), direct);
+
+		replayer fs(std::move(tree), sector_size, writeback_mode, seed, directory_mode);
+		if (buffer_limit > 0)
+			fs.limit_buffering(buffer_limit, spill_dir);
+		fs.time_operations(stats);
+
+		// With --fast-forward, the operations before the start point are
+		// replayed in memory rather than skipped, as if everything reached
+		// the disk, and the result is written out when we get there.
+		std::unique_ptr<replayer> prefix;
+		if (fast_forwarding && (skip > 0 || start.active || skip_until_start_trigger))
+			prefix = std::make_unique<replayer>(std::make_unique<memory_target>(target_path),
+												sector_size,
+												FILE_WRITEBACK_ALL,
+												seed,
+												DIRECTORY_WRITEBACK_ALL);
+		if (!resume_path.empty())
+			fs.load_checkpoint(resume_path);
+		if (!overlay_base.empty()) {
+			overlay_base = overlay_base_tree(overlay_base);
+			sweep.overlay_base = overlay_base;
+		}
+		for (const std::string& dir : { checkpoint_dir, sweep.dir, lose_dir }) {
+			if (!dir.empty() && ::mkdir(dir.c_str(), 0777) < 0 &&
+				errno != EEXIST) {
+				std::string error = std::strerror(errno);
+				throw std::runtime_error("could not create " + dir + ": " + error);
 			}
+		}
 
-			if (op.op == operation::OP_CREATE) {
-				if (!stop_touch.empty() && op.path == stop_touch)
+		bool done = false;
+		while (!done && operations < take && next_batch()) {
+			std::size_t batch_line_number = line_number;
+			std::size_t first = batch.operations.size();
+			std::size_t last = batch.operations.size();
+
+			// Work out which of these operations to replay.  Once we
+			// start we carry on until something tells us to stop, so
+			// it's always a contiguous run.
+			for (std::size_t i = 0; i < batch.operations.size(); ++i) {
+				const operation& op = batch.operations[i];
+
+				if (first < i && operations + (i - first) >= std::size_t(take)) {
+					last = i;
+					done = true;
 					break;
-				else if (skip_until_start_trigger &&
-						 !start_touch.empty() &&
-						 op.path == start_touch)
-					skip_until_start_trigger = false;
+				}
+
+				++line_number;
+				++counts[op.op];
+
+				if (skip > 0) {
+					skip--;
+					continue;
+				}
+
+				if (start.active) {
+					if (op.op != start.op || counts[op.op] != start.n)
+						continue;
+					start.active = false;
+					if (start.after)
+						continue;
+				}
+
+				if (skip_until_start_trigger) {
+					if (op.op == operation::OP_CREATE && op.path == start_touch)
+						skip_until_start_trigger = false;
+					continue;
+				}
+
+				if (stop.active && op.op == stop.op &&
+					counts[op.op] == stop.n && !stop.after) {
+					last = i;
+					done = true;
+					break;
+				}
+
+				if (op.op == operation::OP_CREATE &&
+					!stop_touch.empty() && op.path == stop_touch) {
+					last = i;
+					done = true;
+					break;
+				}
+
+				if (first == batch.operations.size())
+					first = i;
+
+				if (stop.active && op.op == stop.op && counts[op.op] == stop.n) {
+					last = i + 1;
+					done = true;
+					break;
+				}
 			}
+			// Everything before the run is the fast-forward's, and if the
+			// run has started, or we've stopped before it, it's time to
+			// write out what that built.
+			if (prefix) {
+				replay_stats::clock::time_point start = replay_stats::clock::now();
+				std::size_t replayed_before = prefix->operations_replayed();
+
+				try {
+					prefix->replay_batch(operation_span(batch.operations.data(),
+														std::min(first, last)));
+				} catch (...) {
+					line_number = batch_line_number + 1 +
+						(prefix->operations_replayed() - replayed_before);
+					throw;
+				}
+				if (first < batch.operations.size() || done) {
+					fast_forward(*prefix, fs, target_path, memory, spill_dir);
+					prefix.reset();
+				}
+				apply_time += replay_stats::clock::now() - start;
+			}
+
+			// Replay the run in pieces, stopping for a crash image at
+			// each sweep boundary, and for a checkpoint whenever the
+			// number of operations replayed reaches a multiple of
+			// checkpoint_every.
+			while (first < last) {
+				replay_stats::clock::time_point start = replay_stats::clock::now();
 
-			fs.replay(op);
-			++operations;
+				if (sweep.boundary(batch.operations[first], operations)) {
+					sweep.take_image(fs, operations);
+					image_time += replay_stats::clock::now() - start;
+					start = replay_stats::clock::now();
+				}
+
+				std::size_t n = 1;
+				while (first + n < last &&
+					   !sweep.boundary(batch.operations[first + n],
+									   operations + n))
+					++n;
+				if (checkpoint_every > 0)
+					n = std::min(n, checkpoint_every - operations % checkpoint_every);
+
+				std::size_t replayed_before = fs.operations_replayed();
+				try {
+					fs.replay_batch(operation_span(batch.operations.data() + first,
+												   n));
+				} catch (...) {
+					line_number = batch_line_number + first + 1 +
+						(fs.operations_replayed() - replayed_before);
+					throw;
+				}
+				operations += n;
+				first += n;
+				apply_time += replay_stats::clock::now() - start;
+
+				if (checkpoint_every > 0 && operations % checkpoint_every == 0) {
+					log_position position;
+
+					// We've counted operations up to line_number, but
+					// the checkpoint comes before batch[first].
+					position.record = batch_line_number + first;
+					position.operations = operations;
+					std::copy(std::begin(counts), std::end(counts),
+							  std::begin(position.counts));
+					for (std::size_t i = first;
+						 i < line_number - batch_line_number;
+						 ++i)
+						--position.counts[batch.operations[i].op];
+					if (batch.offset >= 0) {
+						position.seek_offset = batch.offset;
+						position.seek_record = batch_line_number;
+					} else {
+						position.seek_offset = 0;
+						position.seek_record = 0;
+					}
+					start = replay_stats::clock::now();
+					take_checkpoint(fs, checkpoint_dir, position);
+					image_time += replay_stats::clock::now() - start;
+				}
+			}
+		}
+		// If the log ended before the start point, there's still what
+		// the fast-forward built.
+		if (prefix) {
+			fast_forward(*prefix, fs, target_path, memory, spill_dir);
+			prefix.reset();
 		}
+
+		replay_stats::clock::time_point start = replay_stats::clock::now();
+		if (sweep.active() && sweep.last_image != operations)
+			sweep.take_image(fs, operations);
+		if (!lose_dir.empty()) {
+			// The images are made in a forked copy, which writes the
+			// index as it goes.
+			std::ofstream index(lose_dir + "/index");
+			fs.enumerate_crash_images(lose_dir,
+									  lose_up_to,
+									  [&](const std::string& image,
+										  const std::string& lost) {
+				if (!overlay_base.empty())
+					replace_with_overlay(overlay_base, image);
+				index << image.substr(lose_dir.size() + 1) << " " << lost << "\n";
+				if (!index.flush())
+					throw std::runtime_error("could not write " + lose_dir +
+											 "/index");
+			});
+		}
+		image_time += replay_stats::clock::now() - start;
+		start = replay_stats::clock::now();
 		fs.lose_power();
+		fs.flush();
+		apply_time += replay_stats::clock::now() - start;
+
+		if (stats) {
+			replay_stats& report = fs.statistics();
+
+			report.parse_time = parse_time;
+			report.apply_time = apply_time;
+			report.image_time = image_time;
+			report.total_time = replay_stats::clock::now() - start_time;
+			if (stats_json)
+				print_stats_json(std::cerr, report);
+			else
+				print_stats(std::cerr, report);
+		}
 	} catch (const std::exception& e) {
 		std::cerr << "while processing line " << line_number << ": "
 				  << e.what() << std::endl;
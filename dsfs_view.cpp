@@ -0,0 +1,291 @@
+/*
+ * Deathstation 9000 file system viewer.
+ *
+ * This replays a log up to a given operation into an in-memory target, and
+ * then serves that target as a read-only file system using the high level
+ * FUSE API, so that a checker can look at a crash image without it being
+ * written to disk first.  Nothing is read from the log after the mount.
+ */
+
+#define _FILE_OFFSET_BITS 64
+#define FUSE_USE_VERSION 26
+
+#include <fuse/fuse.h>
+
+#include "directory.hpp"
+#include "file.hpp"
+#include "memory_target.hpp"
+#include "operation.hpp"
+#include "replayer.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+
+static const std::size_t batch_size = 1024;
+
+/*
+ * The replayer must outlive the mount, since it owns the target.
+ */
+static std::unique_ptr<replayer> view_fs;
+static memory_target *view_tree;
+
+static int
+usage(const char *program_name)
+{
+	std::cerr << "usage: " << program_name << " mount_point --log PATH\n"
+			  << "  [ --take N ]             : show the target after N ops (default all)\n"
+			  << "  [ --sector-size bytes ]  : simulated sector size\n"
+			  << "  [ --writeback MODE ]     : which sectors to write before fsync\n"
+			  << "  [ --seed N ]             : seed for --writeback random\n"
+			  << "  [ --directory-writeback MODE ]\n"
+			  << "                           : all, or none to undo unsynced directory changes\n"
+			  << "  [ --crash ]              : show what's left after losing power\n"
+			  << "  [ --foreground ]         : don't detach from the terminal\n"
+			  << "where MODE is one of:\n"
+			  << "  all, none, odd, even, random\n";
+	return EXIT_FAILURE;
+}
+
+/*
+ * Pinned files are the replayer's business, not the viewer's.
+ */
+static bool
+dsfs_hidden(const char *path)
+{
+	std::size_t length = std::strlen(pinned_directory);
+
+	return std::strncmp(path, pinned_directory, length) == 0 &&
+		(path[length] == '\0' || path[length] == '/');
+}
+
+extern "C" {
+
+static int
+dsfs_getattr(const char *path, struct stat *stbuf)
+{
+	if (dsfs_hidden(path))
+		return -ENOENT;
+
+	try {
+		if (view_tree->lstat(path, stbuf) < 0)
+			return -errno;
+	} catch (const std::exception&) {
+		return -ENOENT;
+	}
+
+	return 0;
+}
+
+static int
+dsfs_readlink(const char *path, char *buf, std::size_t size)
+{
+	std::string contents;
+
+	if (dsfs_hidden(path))
+		return -ENOENT;
+
+	try {
+		if (view_tree->readlink(path, contents) < 0)
+			return -errno;
+	} catch (const std::exception&) {
+		return -ENOENT;
+	}
+
+	size = std::min(size - 1, contents.size());
+	std::memcpy(buf, contents.data(), size);
+	buf[size] = '\0';
+	return 0;
+}
+
+static int
+dsfs_open(const char *path, struct fuse_file_info *fi)
+{
+	int fd;
+
+	if ((fi->flags & O_ACCMODE) != O_RDONLY)
+		return -EROFS;
+	if (dsfs_hidden(path))
+		return -ENOENT;
+
+	try {
+		fd = view_tree->open(path, O_RDONLY, 0);
+		if (fd < 0)
+			return -errno;
+	} catch (const std::exception&) {
+		return -ENOENT;
+	}
+
+	fi->fh = fd;
+
+	return 0;
+}
+
+static int
+dsfs_read(const char *path, char *buf, std::size_t size, off_t offset,
+		  struct fuse_file_info *fi)
+{
+	try {
+		return view_tree->read(fi->fh, buf, std::min<std::size_t>(size, INT_MAX), offset);
+	} catch (const std::exception&) {
+		return -EIO;
+	}
+}
+
+static int
+dsfs_release(const char *path, struct fuse_file_info *fi)
+{
+	view_tree->close(fi->fh);
+
+	return 0;
+}
+
+static int
+dsfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+			 off_t offset, struct fuse_file_info *fi)
+{
+	std::vector<std::string> names;
+
+	if (dsfs_hidden(path))
+		return -ENOENT;
+
+	try {
+		if (view_tree->readdir(path, names) < 0)
+			return -errno;
+		std::sort(names.begin(), names.end());
+
+		filler(buf, ".", NULL, 0);
+		filler(buf, "..", NULL, 0);
+		for (const std::string& name : names) {
+			std::string child = std::strcmp(path, "/") == 0 ?
+				"/" + name : std::string(path) + "/" + name;
+			struct stat st;
+
+			if (dsfs_hidden(child.c_str()) || view_tree->lstat(child, &st) < 0)
+				continue;
+			if (filler(buf, name.c_str(), &st, 0))
+				break;
+		}
+	} catch (const std::exception&) {
+		return -ENOENT;
+	}
+
+	return 0;
+}
+
+} // extern "C"
+
+static struct fuse_operations dsfs_operations = {
+	.getattr		= dsfs_getattr,
+	.readlink		= dsfs_readlink,
+	.open			= dsfs_open,
+	.read			= dsfs_read,
+	.release		= dsfs_release,
+	.readdir		= dsfs_readdir
+};
+
+int
+main(int argc, char *argv[])
+{
+	std::string mount_point;
+	std::string log_path;
+	std::size_t take = std::numeric_limits<std::size_t>::max();
+	off_t sector_size = 512;
+	file_writeback_mode writeback_mode = FILE_WRITEBACK_ALL;
+	directory_writeback_mode directory_mode = DIRECTORY_WRITEBACK_ALL;
+	std::uint64_t seed = 0;
+	bool crash = false;
+	bool foreground = false;
+
+	if (argc < 2)
+		return usage(argv[0]);
+
+	mount_point = argv[1];
+	for (int i = 2; i < argc; ++i) {
+		std::string opt = argv[i];
+		bool more = i + 1 < argc;
+		if (opt == "--log" && more) {
+			log_path = argv[++i];
+		} else if (opt == "--take" && more) {
+			take = std::strtoull(argv[++i], nullptr, 0);
+		} else if (opt == "--sector-size" && more) {
+			sector_size = atoi(argv[++i]);
+		} else if (opt == "--writeback" && more) {
+			if (!parse_writeback_mode(argv[++i], writeback_mode))
+				return usage(argv[0]);
+		} else if (opt == "--seed" && more) {
+			seed = std::strtoull(argv[++i], nullptr, 0);
+		} else if (opt == "--directory-writeback" && more) {
+			if (!parse_directory_writeback_mode(argv[++i], directory_mode))
+				return usage(argv[0]);
+		} else if (opt == "--crash") {
+			crash = true;
+		} else if (opt == "--foreground") {
+			foreground = true;
+		} else {
+			return usage(argv[0]);
+		}
+	}
+	if (log_path.empty() || sector_size < 1)
+		return usage(argv[0]);
+
+	try {
+		std::ifstream log(log_path, std::ios_base::binary);
+		operation_reader reader;
+		operation_batch batch;
+		std::size_t operations = 0;
+
+		if (!log)
+			throw std::runtime_error("could not open log " + log_path);
+
+		// The target is never flushed, so its output path doesn't matter.
+		auto tree = std::make_unique<memory_target>(mount_point);
+		view_tree = tree.get();
+		view_fs = std::make_unique<replayer>(std::move(tree),
+											 sector_size,
+											 writeback_mode,
+											 seed,
+											 directory_mode);
+		while (operations < take) {
+			batch.clear();
+			reader.read_batch(log, batch, batch_size);
+
+			std::size_t n = std::min(batch.operations.size(), take - operations);
+			view_fs->replay_batch(operation_span(batch.operations.data(), n));
+			operations += n;
+			if (batch.stop)
+				break;
+		}
+		if (crash)
+			view_fs->lose_power();
+	} catch (const std::exception& e) {
+		std::cerr << e.what() << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	// Serve requests one at a time, since the target isn't thread-safe.
+	char serial_please[] = "-s";
+	char foreground_please[] = "-f";
+	char read_only_please[] = "-oro";
+	char *fuse_argv[5];
+	int fuse_argc = 0;
+
+	fuse_argv[fuse_argc++] = argv[0];
+	fuse_argv[fuse_argc++] = serial_please;
+	fuse_argv[fuse_argc++] = read_only_please;
+	if (foreground)
+		fuse_argv[fuse_argc++] = foreground_please;
+	fuse_argv[fuse_argc++] = argv[1];
+
+	return fuse_main(fuse_argc, fuse_argv, &dsfs_operations, NULL);
+}
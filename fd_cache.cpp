@@ -0,0 +1,128 @@
+#include "fd_cache.hpp"
+
+#include <cstring>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+void
+split_path(std::string_view path, std::string_view& parent, std::string_view& name)
+{
+	if (path.empty() || path[0] != '/')
+		throw std::runtime_error("unexpected relative path " + std::string(path));
+
+	std::size_t slash = path.find_last_of('/');
+	name = path.substr(slash + 1);
+	parent = slash == 0 ? path.substr(0, 1) : path.substr(0, slash);
+}
+
+directory_fd_cache::directory_fd_cache(const std::string& target_path,
+									   std::size_t capacity) :
+	capacity(capacity)
+{
+	root_fd = ::open(target_path.c_str(), O_RDONLY | O_DIRECTORY);
+	if (root_fd < 0) {
+		std::string error = std::strerror(errno);
+		throw std::runtime_error("could not open target directory " +
+								 target_path + ": " + error);
+	}
+}
+
+void
+directory_fd_cache::reopen(const std::string& target_path)
+{
+	int fd = ::open(target_path.c_str(), O_RDONLY | O_DIRECTORY);
+	if (fd < 0) {
+		std::string error = std::strerror(errno);
+		throw std::runtime_error("could not open target directory " +
+								 target_path + ": " + error);
+	}
+	clear();
+	::close(root_fd);
+	root_fd = fd;
+}
+
+directory_fd_cache::~directory_fd_cache()
+{
+	clear();
+	::close(root_fd);
+}
+
+int
+directory_fd_cache::get(std::string_view path)
+{
+	std::string_view parent;
+	std::string_view name;
+
+	if (path == "/")
+		return root_fd;
+
+	key.assign(path);
+	auto it = fds.find(key);
+	if (it != fds.end())
+		return it->second;
+
+	// Rather than evicting individual entries, which would break the
+	// rule that parents of cached directories are cached, start again.
+	if (fds.size() >= capacity)
+		clear();
+
+	split_path(path, parent, name);
+	int parent_fd = get(parent);
+	std::string child(name);
+	int fd = ::openat(parent_fd, child.c_str(), O_RDONLY | O_DIRECTORY);
+	if (fd < 0) {
+		std::string error = std::strerror(errno);
+		throw std::runtime_error("could not open directory " +
+								 std::string(path) + ": " + error);
+	}
+	fds.emplace(std::string(path), fd);
+
+	return fd;
+}
+
+int
+directory_fd_cache::get_parent(std::string_view path, std::string& name)
+{
+	std::string_view parent;
+	std::string_view child;
+
+	split_path(path, parent, child);
+	name.assign(child);
+
+	return get(parent);
+}
+
+bool
+directory_fd_cache::invalidate(std::string_view path)
+{
+	key.assign(path);
+	auto it = fds.find(key);
+	if (it == fds.end())
+		return false;
+	::close(it->second);
+	fds.erase(it);
+
+	for (auto it = fds.begin(); it != fds.end();) {
+		const std::string& entry_path = it->first;
+		if (entry_path.size() > path.size() &&
+			entry_path.compare(0, path.size(), path) == 0 &&
+			entry_path[path.size()] == '/') {
+			::close(it->second);
+			it = fds.erase(it);
+		} else {
+			++it;
+		}
+	}
+
+	return true;
+}
+
+void
+directory_fd_cache::clear()
+{
+	for (auto& [path, fd] : fds)
+		::close(fd);
+	fds.clear();
+}
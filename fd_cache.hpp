@@ -0,0 +1,154 @@
+#ifndef FD_CACHE_HPP
+#define FD_CACHE_HPP
+
+#include <cstddef>
+#include <list>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+/*
+ * Split a log path like "/a/b/c" into its parent directory "/a/b" and
+ * final component "c".  The parent of a top level name is "/".
+ */
+void
+split_path(std::string_view path, std::string_view& parent, std::string_view& name);
+
+/*
+ * Open file descriptors for directories in the target, keyed by log
+ * path, so that path-based operations can use *at() system calls
+ * relative to the parent directory instead of resolving an absolute
+ * path from the root every time.
+ *
+ * A directory is only ever cached if its parent is too, so if a path
+ * isn't cached, nothing beneath it is either.
+ */
+struct directory_fd_cache {
+	directory_fd_cache(const std::string& target_path,
+					   std::size_t capacity = 1024);
+	~directory_fd_cache();
+
+	/*
+	 * Get an fd for the directory at a log path, opening it (and its
+	 * ancestors) if necessary.  Throws on failure.
+	 */
+	int get(std::string_view path);
+
+	/*
+	 * Get an fd for the parent directory of a log path, and the final
+	 * component to use with it.
+	 */
+	int get_parent(std::string_view path, std::string& name);
+
+	/*
+	 * Forget a directory and everything beneath it, after it has been
+	 * renamed or removed.  Returns true if it was cached.
+	 */
+	bool invalidate(std::string_view path);
+
+	void clear();
+
+	/*
+	 * Forget everything and start again with a different target.
+	 */
+	void reopen(const std::string& target_path);
+
+private:
+	std::size_t capacity;
+	int root_fd;
+	std::unordered_map<std::string, int> fds;
+	std::string key;
+};
+
+/*
+ * A bounded least-recently-used set of open file descriptors for regular
+ * files, keyed by log path, for operations that name a file by path
+ * rather than by a handle that the log opened earlier.
+ */
+template <typename Value>
+struct file_fd_cache {
+	explicit file_fd_cache(std::size_t capacity = 64) : capacity(capacity) {}
+
+	/*
+	 * Look up a path, returning NULL if it isn't cached.
+	 */
+	Value *find(std::string_view path)
+	{
+		key.assign(path);
+		auto it = index.find(key);
+		if (it == index.end())
+			return nullptr;
+		entries.splice(entries.begin(), entries, it->second);
+		return &it->second->second;
+	}
+
+	/*
+	 * Insert a new entry, returning the value that was evicted to make
+	 * room for it if any, so that the caller can close it.
+	 */
+	bool insert(std::string_view path, const Value& value, Value& evicted)
+	{
+		bool result = false;
+
+		if (entries.size() >= capacity) {
+			evicted = entries.back().second;
+			index.erase(entries.back().first);
+			entries.pop_back();
+			result = true;
+		}
+		entries.emplace_front(std::string(path), value);
+		index[entries.front().first] = entries.begin();
+
+		return result;
+	}
+
+	/*
+	 * Remove a path, or with prefix set, everything beneath it too.
+	 * Calls a function for each removed value.
+	 */
+	template <typename F>
+	void invalidate(std::string_view path, bool prefix, F&& f)
+	{
+		key.assign(path);
+		auto found = index.find(key);
+		if (found != index.end()) {
+			f(found->second->second);
+			entries.erase(found->second);
+			index.erase(found);
+		}
+		if (!prefix)
+			return;
+
+		for (auto it = entries.begin(); it != entries.end();) {
+			std::string_view entry_path = it->first;
+			if (entry_path.size() > path.size() &&
+				entry_path.compare(0, path.size(), path) == 0 &&
+				entry_path[path.size()] == '/') {
+				f(it->second);
+				index.erase(it->first);
+				it = entries.erase(it);
+			} else {
+				++it;
+			}
+		}
+	}
+
+	template <typename F>
+	void clear(F&& f)
+	{
+		for (auto& entry : entries)
+			f(entry.second);
+		entries.clear();
+		index.clear();
+	}
+
+private:
+	typedef std::list<std::pair<std::string, Value>> list_type;
+
+	std::size_t capacity;
+	list_type entries;
+	std::unordered_map<std::string, typename list_type::iterator> index;
+	std::string key;
+};
+
+#endif
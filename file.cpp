@@ -1,63 +1,277 @@
 #include "file.hpp"
+#include "operation.hpp"
 
 #include <cstdlib>
 #include <cstring>
 #include <iostream>
+#include <limits>
 #include <stdexcept>
 #include <string>
 
-#include <unistd.h>
+/*
+ * SplitMix64's finalizer, which is enough to make neighbouring inputs
+ * look unrelated.
+ */
+static std::uint64_t
+mix(std::uint64_t x)
+{
+	x += 0x9e3779b97f4a7c15ULL;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	return x ^ (x >> 31);
+}
+
+bool
+random_writeback_p(std::uint64_t seed,
+				   std::uint64_t file_id,
+				   std::uint64_t sector_number,
+				   std::uint64_t epoch)
+{
+	return mix(mix(mix(mix(seed) ^ file_id) ^ sector_number) ^ epoch) & 1;
+}
+
+file::file(sector_pool& pool,
+		   file_writeback_mode writeback_mode,
+		   io_backend& io,
+		   std::uint64_t seed,
+		   std::uint64_t id,
+		   file_counters& counters) :
+	sector_size(pool.sector_size()),
+	writeback_mode(writeback_mode),
+	io(io),
+	seed(seed),
+	id(id),
+	epoch(0),
+	counters(counters),
+	pool(pool),
+	truncate_size(-1),
+	truncate_low(-1),
+	disk_size(-1),
+	tracking(false)
+{
+}
+
+file::~file()
+{
+	forget_sectors();
+	forget_clean_sectors();
+}
 
 /*
- * Like pwrite(), but with retry and exceptions.
+ * Drop all buffered sectors, giving their slots back to the pool.
  */
-static void
-write_all(int fd, const char *data, std::size_t size, off_t offset)
-{
-	std::size_t written_so_far = 0;
-
-	do {
-		ssize_t written = ::pwrite(fd,
-								   data + written_so_far,
-								   size - written_so_far,
-								   offset + written_so_far);
-		if (written < 0) {
-			std::string error = std::strerror(errno);
-			throw std::runtime_error("could not write: " + error);
-		}
-		written_so_far += written;
-	} while (written_so_far < size);
+void
+file::forget_sectors()
+{
+	for (const sector_map::entry& entry : unwritten_sectors.sorted())
+		pool.release(entry.slot);
+	unwritten_sectors.clear();
+	unwritten_extents.clear();
+}
+
+void
+file::forget_clean_sectors()
+{
+	for (const sector_map::entry& entry : clean_sectors.sorted())
+		pool.release(entry.slot);
+	clean_sectors.clear();
 }
 
 /*
- * Like pread(), but with retry and exceptions.
+ * How much of a clean sector is in the file.  Once we know the size of
+ * the file, it tells us about zeroes that appeared when it was extended
+ * past the end of a sector we copied.
  */
-static std::size_t
-read_all(int fd, char *data, std::size_t size, off_t offset)
-{
-	std::size_t read_so_far = 0;
-
-	do {
-		ssize_t read = ::pread(fd,
-							   data + read_so_far,
-							   size - read_so_far,
-							   offset + read_so_far);
-		if (read < 0) {
-			std::string error = std::strerror(errno);
-			throw std::runtime_error("could not read: " + error);
-		} else if (read == 0) {
-			break;
-		}
-		read_so_far += read;
-	} while (read_so_far < size);
+std::size_t
+file::clean_length(const sector_map::entry& entry) const
+{
+	off_t begin = off_t(entry.sector) * sector_size;
 
-	return read_so_far;
+	if (disk_size < 0)
+		return entry.length;
+	if (disk_size <= begin)
+		return 0;
+	return std::min(off_t(sector_size), disk_size - begin);
 }
 
-file::file(std::size_t sector_size, file_writeback_mode writeback_mode) :
-	sector_size(sector_size),
-	writeback_mode(writeback_mode)
+/*
+ * Make room for a copy of a sector as it is on disk, and return it for
+ * the caller to fill in, or nullptr if the pool is out of memory.  When
+ * the cache is full, we start again rather than keeping track of which
+ * sectors were used recently.
+ */
+char *
+file::cache_clean_sector(std::uint64_t sector_number, std::size_t length)
 {
+	bool inserted;
+
+	if (!clean_sectors.find(sector_number)) {
+		if (clean_sectors.size() >= max_clean_sectors)
+			forget_clean_sectors();
+		if (pool.full())
+			return nullptr;
+	}
+	sector_map::entry& entry = clean_sectors.insert(sector_number, inserted);
+	if (inserted)
+		entry.slot = pool.allocate();
+	entry.length = length;
+	return pool.data(entry.slot);
+}
+
+/*
+ * Get what's on disk for a sector, from the cache if we have it.
+ */
+const char *
+file::read_clean_sector(int fd, std::uint64_t sector_number, std::size_t& length)
+{
+	if (sector_map::entry *entry = clean_sectors.find(sector_number)) {
+		length = clean_length(*entry);
+		return pool.data(entry->slot);
+	}
+
+	off_t begin = off_t(sector_number) * sector_size;
+	char *sector = cache_clean_sector(sector_number, 0);
+
+	if (!sector) {
+		read_buffer.resize(sector_size);
+		sector = read_buffer.data();
+	}
+	length = io.read(fd, sector, sector_size, begin);
+	std::memset(sector + length, 0, sector_size - length);
+	if (sector_map::entry *entry = clean_sectors.find(sector_number))
+		entry->length = length;
+	if (length < sector_size)
+		disk_size = begin + length;
+	return sector;
+}
+
+/*
+ * Keep the cache in step with data written straight to disk.  A whole
+ * sector can be remembered as it is, but part of one is only any use if
+ * we already have the rest.
+ */
+void
+file::wrote_through(std::uint64_t sector_number,
+					std::size_t offset_in_sector,
+					const char *data,
+					std::size_t size)
+{
+	off_t end = off_t(sector_number) * sector_size + offset_in_sector + size;
+
+	if (disk_size >= 0)
+		disk_size = std::max(disk_size, end);
+
+	// Nothing is ever read back if nothing is buffered.
+	if (writeback_mode == FILE_WRITEBACK_ALL)
+		return;
+
+	if (size == sector_size) {
+		if (char *copy = cache_clean_sector(sector_number, size))
+			std::memcpy(copy, data, size);
+	} else if (sector_map::entry *entry = clean_sectors.find(sector_number)) {
+		std::memcpy(pool.data(entry->slot) + offset_in_sector, data, size);
+		entry->length = std::max(clean_length(*entry), offset_in_sector + size);
+	}
+}
+
+/*
+ * Whether we'd have to read a sector from disk to buffer part of it.
+ */
+bool
+file::needs_read(std::uint64_t sector_number, bool partial)
+{
+	return partial &&
+		!writeback_p(sector_number) &&
+		!unwritten_sectors.find(sector_number) &&
+		!clean_sectors.find(sector_number);
+}
+
+/*
+ * The buffered sectors in order of sector number.
+ */
+std::vector<sector_map::entry>
+file::ordered_sectors() const
+{
+	std::vector<sector_map::entry> result;
+
+	result.reserve(unwritten_sectors.size());
+	for (const auto& [first, last] : unwritten_extents.runs()) {
+		for (std::uint64_t sector_number = first; sector_number < last; ++sector_number)
+			result.push_back(*unwritten_sectors.find(sector_number));
+	}
+	return result;
+}
+
+/*
+ * Adjust a sector as read from disk, and the length of it that's in the
+ * file, for a truncate that hasn't reached the disk yet.
+ */
+std::size_t
+file::truncated(std::uint64_t sector_number, char *sector, std::size_t length) const
+{
+	off_t begin = off_t(sector_number) * sector_size;
+	std::size_t kept = std::clamp(truncate_low - begin, off_t(0), off_t(sector_size));
+	std::size_t size = std::clamp(truncate_size - begin, off_t(0), off_t(sector_size));
+
+	std::memset(sector + kept, 0, sector_size - kept);
+	return std::max(std::min(length, kept), size);
+}
+
+/*
+ * Send a pending truncate to disk.  If the file was cut down further on
+ * the way to its final size, that has to happen first, so that the
+ * difference reads as zeroes.
+ */
+void
+file::apply_truncate(int fd)
+{
+	if (truncate_size < 0)
+		return;
+	io.truncate(fd, truncate_low);
+	if (truncate_size != truncate_low)
+		io.truncate(fd, truncate_size);
+	changed(truncate_low, std::numeric_limits<off_t>::max());
+	forget_clean_sectors();
+	disk_size = truncate_size;
+	truncate_size = -1;
+	truncate_low = -1;
+}
+
+/*
+ * A write that begins and ends part way through sectors we're going to
+ * buffer needs both of them from disk.  If they aren't far apart, it's
+ * cheaper to read them with one call, and the sectors in between along
+ * with them.
+ */
+void
+file::read_ends(int fd, std::size_t size, off_t offset)
+{
+	std::uint64_t first = offset / sector_size;
+	std::uint64_t last = (offset + size - 1) / sector_size;
+	std::size_t range = (last - first + 1) * sector_size;
+	off_t begin = off_t(first) * sector_size;
+
+	if (first == last || range > max_batched_read || pool.full() ||
+		!needs_read(first, offset % sector_size != 0) ||
+		!needs_read(last, (offset + size) % sector_size != 0))
+		return;
+
+	read_buffer.resize(range);
+	std::size_t read_size = io.read(fd, read_buffer.data(), range, begin);
+	if (read_size < range)
+		disk_size = begin + read_size;
+
+	for (std::uint64_t sector_number : { first, last }) {
+		std::size_t skip = (sector_number - first) * sector_size;
+		std::size_t length = read_size > skip ?
+			std::min(read_size - skip, sector_size) : 0;
+		char *sector = cache_clean_sector(sector_number, length);
+
+		if (!sector)
+			break;
+		std::memcpy(sector, read_buffer.data() + skip, length);
+		std::memset(sector + length, 0, sector_size - length);
+	}
 }
 
 bool
@@ -73,7 +287,7 @@ file::writeback_p(int sector_number)
 	case FILE_WRITEBACK_EVEN:
 		return sector_number % 2 == 0;
 	case FILE_WRITEBACK_RANDOM:
-		return std::rand() % 2 == 0;
+		return random_writeback_p(seed, id, sector_number, epoch);
 	default:
 		throw std::runtime_error("unexpected file writeback mode");
 	}
@@ -82,75 +296,355 @@ file::writeback_p(int sector_number)
 void
 file::write(int fd, const char *data, std::size_t size, off_t offset)
 {
+	// Consecutive sectors written straight through go to disk together.
+	const char *run_data = data;
+	off_t run_offset = offset;
+	std::size_t run_size = 0;
+
+	if (size > 0)
+		read_ends(fd, size, offset);
+
 	while (size > 0) {
 		int sector_number = offset / sector_size;
 		std::size_t offset_in_sector = offset % sector_size;
 		std::size_t bytes_in_sector = std::min(size, sector_size - offset_in_sector);
-		off_t sector_begin = offset - offset_in_sector;
 
 		if (writeback_p(sector_number)) {
+			sector_map::entry removed;
+
 			// Dump this one straight into the underlying file system,
 			// and drop it from our sector cache if we had it.
-			write_all(fd, data, bytes_in_sector, offset);
-			unwritten_sectors.erase(sector_begin);
+			if (run_size == 0) {
+				run_data = data;
+				run_offset = offset;
+			}
+			run_size += bytes_in_sector;
+			counters.bytes_written_through += bytes_in_sector;
+			if (unwritten_sectors.erase(sector_number, removed)) {
+				pool.release(removed.slot);
+				unwritten_extents.remove(sector_number);
+			}
+			wrote_through(sector_number, offset_in_sector, data, bytes_in_sector);
 		} else {
 			// Buffer this one until fsync(), so we can risk losing
-			// it.
-			std::vector<char>& sector = unwritten_sectors[sector_begin];
+			// it.  Anything before it that's going straight through
+			// goes now, in case we need to read.
+			bool inserted;
+
+			if (run_size > 0) {
+				apply_truncate(fd);
+				io.write(fd, run_data, run_size, run_offset);
+				changed(run_offset, run_offset + run_size);
+				run_size = 0;
+			}
+			sector_map::entry& entry = unwritten_sectors.insert(sector_number,
+																inserted);
+			if (inserted) {
+				entry.slot = pool.allocate();
+				entry.length = 0;
+				unwritten_extents.add(sector_number);
+			}
+			// Sectors that have spilled out of memory are worked on
+			// in a buffer, and put back afterwards.
+			bool spilled = pool.spilled(entry.slot);
+			char *sector;
+
+			if (spilled) {
+				sector_buffer.resize(sector_size);
+				sector = sector_buffer.data();
+				if (!inserted)
+					pool.read(entry.slot, sector, entry.length);
+			} else {
+				sector = pool.data(entry.slot);
+			}
 
-			if (sector.empty() &&
+			if (inserted &&
 				(offset_in_sector != 0 || bytes_in_sector != sector_size)) {
 				// This is a sector we didn't previously have cached,
 				// and we're not entirely filling it with new data.
-				// So we'll need to read it from the underlying file
-				// system before partially updating it.
-				sector.resize(sector_size);
-				std::size_t read_size = read_all(fd,
-												 sector.data(),
-												 sector_size,
-												 sector_begin);
-				sector.resize(std::max(read_size,
-									   offset_in_sector + bytes_in_sector));
+				// So we'll need what the underlying file system has
+				// before partially updating it.
+				std::size_t read_size;
+				const char *clean = read_clean_sector(fd,
+													  sector_number,
+													  read_size);
+				std::memcpy(sector, clean, sector_size);
+				if (truncate_size >= 0)
+					read_size = truncated(sector_number, sector, read_size);
+				entry.length = std::max(read_size,
+										offset_in_sector + bytes_in_sector);
 			} else {
-				// Write covers whole sector, so no need to read
-				// first.
-				sector.resize(sector_size);
+				// Write covers whole sector, or we already have it,
+				// so no need to read first.
+				std::memset(sector + entry.length, 0, sector_size - entry.length);
+				entry.length = std::max(std::size_t(entry.length),
+										offset_in_sector + bytes_in_sector);
 			}
-			std::memcpy(sector.data() + offset_in_sector,
-						data,
-						bytes_in_sector);
+			std::memcpy(sector + offset_in_sector, data, bytes_in_sector);
+			if (spilled)
+				pool.write(entry.slot, sector, entry.length);
+			counters.bytes_buffered += bytes_in_sector;
 		}
 		data += bytes_in_sector;
 		size -= bytes_in_sector;
 		offset += bytes_in_sector;
 	}
+	if (run_size > 0) {
+		apply_truncate(fd);
+		io.write(fd, run_data, run_size, run_offset);
+		changed(run_offset, run_offset + run_size);
+	}
 }
 
 void
 file::truncate(int fd, std::size_t size)
 {
-	// XXX TODO
+	std::uint64_t end_sector = size / sector_size;
+	std::size_t end_in_sector = size % sector_size;
+
+	// Buffered sectors wholly past the new end are gone, and the one it
+	// falls in is cut short.
+	for (const auto& [first, last] : unwritten_extents.cut(end_sector +
+														   (end_in_sector > 0))) {
+		for (std::uint64_t sector_number = first; sector_number < last; ++sector_number) {
+			sector_map::entry removed;
+
+			unwritten_sectors.erase(sector_number, removed);
+			pool.release(removed.slot);
+		}
+	}
+	if (end_in_sector > 0) {
+		sector_map::entry *entry = unwritten_sectors.find(end_sector);
+
+		if (entry && entry->length > end_in_sector) {
+			if (!pool.spilled(entry->slot))
+				std::memset(pool.data(entry->slot) + end_in_sector,
+							0,
+							entry->length - end_in_sector);
+			entry->length = end_in_sector;
+		}
+	}
+
+	// The truncate itself is delayed like a write to the sector the new
+	// end falls in.
+	truncate_low = truncate_size < 0 ? size : std::min(truncate_low, off_t(size));
+	truncate_size = size;
+	if (writeback_p(end_sector))
+		apply_truncate(fd);
 }
 
 void
 file::synchronize(int fd)
 {
-	// XXX what to do if there was a truncate since we wrote?
+	std::vector<sector_map::entry> sectors = ordered_sectors();
+
+	apply_truncate(fd);
+
+	// Write out each run of contiguous sectors with one call.
+	for (std::size_t i = 0; i < sectors.size();) {
+		off_t begin = off_t(sectors[i].sector) * sector_size;
+		std::size_t size = 0;
+		std::size_t end = i;
+		std::size_t spilled = 0;
 
-	for (const auto& [offset, sector] : unwritten_sectors)
-		write_all(fd, sector.data(), sector.size(), offset);
+		do {
+			size += sectors[end].length;
+			if (pool.spilled(sectors[end].slot))
+				++spilled;
+			++end;
+		} while (end < sectors.size() &&
+				 sectors[end].sector == sectors[end - 1].sector + 1 &&
+				 sectors[end - 1].length == sector_size &&
+				 size < max_coalesced_write);
 
+		// Spilled sectors have to be read back in first.
+		read_buffer.resize(spilled * sector_size);
+		char *staged = read_buffer.data();
+		write_buffers.clear();
+		for (; i < end; ++i) {
+			char *data;
+
+			if (pool.spilled(sectors[i].slot)) {
+				data = staged;
+				pool.read(sectors[i].slot, data, sectors[i].length);
+				staged += sector_size;
+			} else {
+				data = pool.data(sectors[i].slot);
+			}
+			write_buffers.push_back(iovec{ data, sectors[i].length });
+		}
+		io.writev(fd, write_buffers.data(), write_buffers.size(), begin);
+		changed(begin, begin + size);
+		if (disk_size >= 0)
+			disk_size = std::max(disk_size, begin + off_t(size));
+	}
+
+	// The sectors we wrote out are now what's on disk, so they move to
+	// the clean cache rather than being copied or read again later.
+	for (const sector_map::entry& entry : sectors) {
+		sector_map::entry removed;
+
+		if (clean_sectors.erase(entry.sector, removed))
+			pool.release(removed.slot);
+		if (writeback_mode == FILE_WRITEBACK_ALL ||
+			pool.spilled(entry.slot) ||
+			(entry.length < sector_size && disk_size < 0) ||
+			clean_sectors.size() >= max_clean_sectors) {
+			pool.release(entry.slot);
+		} else {
+			bool inserted;
+			clean_sectors.insert(entry.sector, inserted) = entry;
+		}
+	}
+
+	counters.sectors_flushed += sectors.size();
 	unwritten_sectors.clear();
+	unwritten_extents.clear();
+	++epoch;
 }
 
-void
+std::size_t
 file::lose_power()
 {
-	if (!unwritten_sectors.empty()) {
-		std::cout << "inode X "
-				  << "forgot " << unwritten_sectors.size()
-				  << " sectors due to power loss\n";
+	std::size_t lost = unwritten_sectors.size();
+
+	forget_sectors();
+	truncate_size = -1;
+	truncate_low = -1;
+	counters.sectors_lost += lost;
+
+	return lost;
+}
+
+/*
+ * Remember that [begin, end) has changed on disk, if anyone wants to
+ * know.  Runs of writes that follow on from each other, as appending to
+ * a file or writing it out in order does, are remembered as one.
+ */
+void
+file::changed(off_t begin, off_t end)
+{
+	if (!tracking)
+		return;
+	if (!changes.empty() && changes.back().second >= begin &&
+		changes.back().first <= end) {
+		changes.back().first = std::min(changes.back().first, begin);
+		changes.back().second = std::max(changes.back().second, end);
+	} else if (changes.size() < max_changes) {
+		changes.emplace_back(begin, end);
+	} else {
+		for (const auto& [first, last] : changes) {
+			begin = std::min(begin, first);
+			end = std::max(end, last);
+		}
+		changes.assign(1, { begin, end });
 	}
+}
 
-	unwritten_sectors.clear();
+bool
+file::take_changes(change_list& changes)
+{
+	changes.clear();
+	changes.swap(this->changes);
+	return tracking;
+}
+
+void
+file::unsynced(const unsynced_visitor& visit) const
+{
+	std::vector<char> buffer(sector_size);
+
+	for (const sector_map::entry& entry : ordered_sectors()) {
+		const char *data;
+
+		if (pool.spilled(entry.slot)) {
+			pool.read(entry.slot, buffer.data(), entry.length);
+			data = buffer.data();
+		} else {
+			data = pool.data(entry.slot);
+		}
+		visit(off_t(entry.sector) * sector_size,
+			  std::string_view(data, entry.length));
+	}
+}
+
+void
+file::save(std::ostream& out) const
+{
+	out << "id " << id << " epoch " << epoch << "\n"
+		<< "truncate " << truncate_size << " " << truncate_low << "\n"
+		<< "sectors " << unwritten_sectors.size() << "\n";
+	unsynced([&](off_t offset, std::string_view sector) {
+		out << offset << " ";
+		write_string_literal(out, sector);
+		out << "\n";
+	});
+}
+
+void
+file::load(std::istream& in)
+{
+	std::string word;
+	std::string data;
+	std::size_t count;
+
+	forget_sectors();
+	forget_clean_sectors();
+	disk_size = -1;
+	if (!(in >> word >> id) || word != "id" ||
+		!(in >> word >> epoch) || word != "epoch")
+		throw std::runtime_error("bad file id in checkpoint");
+	if (!(in >> word >> truncate_size >> truncate_low) || word != "truncate")
+		throw std::runtime_error("bad truncate in checkpoint");
+	if (!(in >> word >> count) || word != "sectors")
+		throw std::runtime_error("bad sector list in checkpoint");
+	while (count-- > 0) {
+		off_t offset;
+
+		if (!(in >> offset) || !read_string_literal(in, data) ||
+			offset % sector_size != 0 || data.size() > sector_size)
+			throw std::runtime_error("bad sector in checkpoint");
+
+		bool inserted;
+		sector_map::entry& entry = unwritten_sectors.insert(offset / sector_size,
+															inserted);
+		if (inserted) {
+			entry.slot = pool.allocate();
+			unwritten_extents.add(offset / sector_size);
+		}
+		entry.length = data.size();
+		pool.write(entry.slot, data.data(), data.size());
+	}
+}
+
+std::string
+stringify(file_writeback_mode mode)
+{
+	switch (mode) {
+	case FILE_WRITEBACK_ALL:
+		return "all";
+	case FILE_WRITEBACK_NONE:
+		return "none";
+	case FILE_WRITEBACK_ODD:
+		return "odd";
+	case FILE_WRITEBACK_EVEN:
+		return "even";
+	case FILE_WRITEBACK_RANDOM:
+		return "random";
+	default:
+		return "<unknown>";
+	}
+}
+
+bool
+parse_writeback_mode(const std::string& name, file_writeback_mode& out)
+{
+	for (int i = FILE_WRITEBACK_ALL; i <= FILE_WRITEBACK_RANDOM; ++i) {
+		file_writeback_mode mode = static_cast<file_writeback_mode>(i);
+		if (stringify(mode) == name) {
+			out = mode;
+			return true;
+		}
+	}
+	return false;
 }
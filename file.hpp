@@ -1,10 +1,16 @@
 #ifndef FILE_HPP
 #define FILE_HPP
 
-#include "inode.hpp"
+#include "image_hash.hpp"
+#include "io_backend.hpp"
+#include "sector_pool.hpp"
 
 #include <cstddef>
-#include <map>
+#include <cstdint>
+#include <functional>
+#include <iosfwd>
+#include <string>
+#include <string_view>
 #include <vector>
 
 #include <sys/types.h>
@@ -17,20 +23,165 @@ enum file_writeback_mode {
 	FILE_WRITEBACK_RANDOM
 };
 
-struct file : inode {
-	file(std::size_t sector_size, file_writeback_mode writeback_mode);
-	void write(int fd, const char *data, std::size_t size, off_t offset) override;
-	void truncate(int fd, std::size_t size) override;
-	void synchronize(int fd) override;
-	void lose_power() override;
+/*
+ * With FILE_WRITEBACK_RANDOM, whether a sector is written straight
+ * through is a pure function of the seed, the file, the sector number and
+ * how many times the file has been synced, so any replay with the same
+ * seed makes the same choices, whatever order it makes them in.
+ */
+bool
+random_writeback_p(std::uint64_t seed,
+				   std::uint64_t file_id,
+				   std::uint64_t sector_number,
+				   std::uint64_t epoch);
+
+/*
+ * Running totals for all the files that share them.
+ */
+struct file_counters {
+	file_counters() :
+		bytes_written_through(0),
+		bytes_buffered(0),
+		sectors_flushed(0),
+		sectors_lost(0)
+	{
+	}
+	std::uint64_t bytes_written_through;
+	std::uint64_t bytes_buffered;
+	std::uint64_t sectors_flushed;
+	std::uint64_t sectors_lost;
+};
+
+struct file {
+	/*
+	 * Sectors waiting for fsync are kept in the pool, which sets the
+	 * sector size.  The id tells files apart for random writeback, and
+	 * should be the same every time the log is replayed.
+	 */
+	file(sector_pool& pool,
+		 file_writeback_mode writeback_mode,
+		 io_backend& io,
+		 std::uint64_t seed,
+		 std::uint64_t id,
+		 file_counters& counters);
+	~file();
+	void write(int fd, const char *data, std::size_t size, off_t offset);
+	void truncate(int fd, std::size_t size);
+	void synchronize(int fd);
+
+	/*
+	 * Forget the sectors that haven't been synced, returning how many
+	 * there were.
+	 */
+	std::size_t lose_power();
+
+	/*
+	 * Write out, and read back in, whatever we know that isn't yet
+	 * reflected in the target directory.  Used for checkpoints.
+	 */
+	void save(std::ostream& out) const;
+	void load(std::istream& in);
+
+	/*
+	 * Visit the sectors written since the last fsync that the disk
+	 * doesn't have yet, with their offsets, in order.  The data is only
+	 * good until the visitor returns.
+	 */
+	typedef std::function<void(off_t offset, std::string_view data)>
+		unsynced_visitor;
+	void unsynced(const unsynced_visitor& visit) const;
+
+	/*
+	 * Start keeping track of which bytes of the file on disk change,
+	 * for image_hasher, and hand them over, forgetting them.  Returns
+	 * false if we weren't keeping track.
+	 */
+	void track_changes() { tracking = true; }
+	bool take_changes(change_list& changes);
 
 private:
+	/*
+	 * How many sectors of what's on disk to remember for each file, so
+	 * that partial writes to them needn't read them back.
+	 */
+	static const std::size_t max_clean_sectors = 128;
+
+	/*
+	 * The most we'll read in one go to fetch the sectors at both ends
+	 * of a write.
+	 */
+	static const std::size_t max_batched_read = 64 * 1024;
+
+	/*
+	 * The most fsync will write in one go, when buffered sectors are
+	 * contiguous.
+	 */
+	static const std::size_t max_coalesced_write = 1024 * 1024;
+
+	/*
+	 * How many separate changes to remember before we give up and
+	 * remember one covering them all.
+	 */
+	static const std::size_t max_changes = 1024;
+
 	bool writeback_p(int sector_number);
+	void forget_sectors();
+	void forget_clean_sectors();
+	std::size_t clean_length(const sector_map::entry& entry) const;
+	char *cache_clean_sector(std::uint64_t sector_number, std::size_t length);
+	const char *read_clean_sector(int fd,
+								  std::uint64_t sector_number,
+								  std::size_t& length);
+	void wrote_through(std::uint64_t sector_number,
+					   std::size_t offset_in_sector,
+					   const char *data,
+					   std::size_t size);
+	bool needs_read(std::uint64_t sector_number, bool partial);
+	void read_ends(int fd, std::size_t size, off_t offset);
+	std::vector<sector_map::entry> ordered_sectors() const;
+	std::size_t truncated(std::uint64_t sector_number,
+						  char *sector,
+						  std::size_t length) const;
+	void apply_truncate(int fd);
+	void changed(off_t begin, off_t end);
 
-	std::size_t size;
 	std::size_t sector_size;
 	int writeback_mode;
-	std::map<off_t, std::vector<char>> unwritten_sectors;
+	io_backend& io;
+	std::uint64_t seed;
+	std::uint64_t id;
+	std::uint64_t epoch;
+	file_counters& counters;
+	sector_pool& pool;
+	sector_map unwritten_sectors;
+	sector_extents unwritten_extents;
+
+	/*
+	 * A truncate that hasn't reached the disk yet: the size asked for
+	 * last, and the smallest size asked for since the disk was last
+	 * truncated, below which the disk's data survives.  -1 if none.
+	 */
+	off_t truncate_size;
+	off_t truncate_low;
+
+	/*
+	 * Copies of sectors as they are on disk, padded with zeroes, and the
+	 * size of the file on disk if we've seen where it ends, or -1.
+	 */
+	sector_map clean_sectors;
+	off_t disk_size;
+	std::vector<char> read_buffer;
+	std::vector<char> sector_buffer;
+	std::vector<struct iovec> write_buffers;
+
+	bool tracking;
+	change_list changes;
 };
 
+std::string
+stringify(file_writeback_mode mode);
+
+bool
+parse_writeback_mode(const std::string& name, file_writeback_mode& out);
+
 #endif
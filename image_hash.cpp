@@ -0,0 +1,224 @@
+#include "image_hash.hpp"
+#include "directory.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+
+const std::uint64_t hash_seed = 14695981039346656037ULL;
+
+std::uint64_t
+hash_bytes(std::uint64_t hash, const char *data, std::size_t size)
+{
+	for (std::size_t i = 0; i < size; ++i) {
+		hash ^= static_cast<unsigned char>(data[i]);
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+std::uint64_t
+hash_zeros(std::uint64_t hash, std::size_t size)
+{
+	for (std::size_t i = 0; i < size; ++i)
+		hash *= 1099511628211ULL;
+	return hash;
+}
+
+std::uint64_t
+hash_value(std::uint64_t hash, std::uint64_t value)
+{
+	return hash_bytes(hash, reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+static void
+fail(const std::string& what, const std::string& path)
+{
+	std::string error = std::strerror(errno);
+	throw std::runtime_error("could not " + what + " " + path + " to hash it: " + error);
+}
+
+image_hasher::image_hasher() :
+	walks(0)
+{
+}
+
+std::uint64_t
+image_hasher::hash(target& tree, const change_function *changed)
+{
+	tree.io().drain();
+	++walks;
+	return hash_directory(tree, "/", changed);
+}
+
+std::uint64_t
+image_hasher::hash_directory(target& tree,
+							 const std::string& path,
+							 const change_function *changed)
+{
+	std::vector<std::string> names;
+	std::uint64_t hash = hash_seed;
+
+	if (tree.readdir(path, names) < 0)
+		fail("read directory", path);
+	std::sort(names.begin(), names.end());
+	for (const std::string& name : names) {
+		std::string child = path == "/" ? "/" + name : path + "/" + name;
+		struct stat stat_data;
+		std::uint64_t child_hash;
+
+		// Pinned files are gone after a crash.
+		if (child == pinned_directory)
+			continue;
+		if (tree.lstat(child, &stat_data) < 0)
+			fail("stat", child);
+
+		if (S_ISDIR(stat_data.st_mode)) {
+			child_hash = hash_directory(tree, child, changed);
+		} else if (S_ISREG(stat_data.st_mode)) {
+			child_hash = hash_file(tree, child, stat_data, changed);
+		} else if (S_ISLNK(stat_data.st_mode)) {
+			std::string contents;
+
+			if (tree.readlink(child, contents) < 0)
+				fail("read symlink", child);
+			child_hash = hash_bytes(hash_seed, contents.data(), contents.size());
+		} else {
+			throw std::runtime_error("unsupported file type at " + child);
+		}
+
+		// Names are hashed with their terminators, so that they can't run
+		// into what follows.
+		hash = hash_bytes(hash, name.c_str(), name.size() + 1);
+		hash = hash_value(hash, stat_data.st_mode & (S_IFMT | 07777));
+		hash = hash_value(hash, child_hash);
+	}
+	return hash;
+}
+
+std::uint64_t
+image_hasher::hash_file(target& tree,
+						const std::string& path,
+						const struct stat& stat_data,
+						const change_function *changed)
+{
+	std::size_t blocks = (stat_data.st_size + block_size - 1) / block_size;
+	file_hash scratch = {};
+	file_hash *entry = &scratch;
+	change_list changes;
+
+	if (changed) {
+		auto found = files.find(stat_data.st_ino);
+
+		// Another link to a file we've already seen this time.
+		if (found != files.end() && found->second.walk == walks)
+			return found->second.hash;
+
+		// Ask even if we're going to read everything anyway, so that
+		// the changes we'd be told about next time start from here.
+		bool known = (*changed)(stat_data.st_ino, changes);
+		if (found != files.end() && known) {
+			entry = &found->second;
+		} else {
+			entry = &files[stat_data.st_ino];
+			entry->size = 0;
+			entry->blocks.clear();
+			changes.assign(1, { 0, stat_data.st_size });
+		}
+		entry->walk = walks;
+	} else {
+		changes.assign(1, { 0, stat_data.st_size });
+	}
+
+	// If the size has changed, so has the block the smaller size ends
+	// in, and anything past the old end if it has grown.
+	if (entry->size != stat_data.st_size)
+		changes.emplace_back(std::min(entry->size, stat_data.st_size) /
+							 block_size * block_size,
+							 stat_data.st_size);
+	entry->size = stat_data.st_size;
+	entry->blocks.resize(blocks);
+
+	// Read each run of changed blocks once.
+	std::vector<std::pair<std::size_t, std::size_t>> runs;
+	for (const auto& [begin, end] : changes) {
+		std::size_t first = std::max(begin, off_t(0)) / block_size;
+		std::size_t last = std::min<off_t>((std::max(end, off_t(0)) + block_size - 1) /
+										   block_size,
+										   blocks);
+		if (first < last)
+			runs.emplace_back(first, last);
+	}
+	std::sort(runs.begin(), runs.end());
+	for (std::size_t i = 0; i < runs.size();) {
+		std::size_t first = runs[i].first;
+		std::size_t last = runs[i].second;
+
+		for (++i; i < runs.size() && runs[i].first <= last; ++i)
+			last = std::max(last, runs[i].second);
+		hash_blocks(tree, path, *entry, first, last);
+	}
+
+	std::uint64_t hash = hash_value(hash_seed, entry->size);
+	for (std::uint64_t block : entry->blocks)
+		hash = hash_value(hash, block);
+	entry->hash = hash;
+
+	return hash;
+}
+
+/*
+ * Hash blocks [first, last) of a file, reading a few at a time.
+ */
+void
+image_hasher::hash_blocks(target& tree,
+						  const std::string& path,
+						  file_hash& entry,
+						  std::size_t first,
+						  std::size_t last)
+{
+	static const std::size_t blocks_per_read = 64;
+	int fd = tree.open(path, O_RDONLY);
+
+	if (fd < 0)
+		fail("open", path);
+	try {
+		buffer.resize(blocks_per_read * block_size);
+		while (first < last) {
+			off_t offset = off_t(first) * block_size;
+			std::size_t count = std::min(last - first, blocks_per_read);
+			std::size_t wanted = std::min<off_t>(count * block_size, entry.size - offset);
+			std::size_t size = tree.io().read(fd, buffer.data(), wanted, offset);
+
+			// A short read means the file is shorter than lstat() said,
+			// so the rest reads as zeroes.
+			std::memset(buffer.data() + size, 0, wanted - size);
+			for (std::size_t i = 0; i < count; ++i) {
+				std::size_t begin = i * block_size;
+				std::size_t length = std::min(wanted - begin, std::size_t(block_size));
+
+				entry.blocks[first + i] = hash_bytes(hash_seed,
+													 buffer.data() + begin,
+													 length);
+			}
+			first += count;
+		}
+	} catch (...) {
+		tree.close(fd);
+		throw;
+	}
+	tree.close(fd);
+}
+
+std::uint64_t
+hash_tree(const std::string& path)
+{
+	posix_target tree(path, nullptr);
+	image_hasher hasher;
+
+	return hasher.hash(tree);
+}
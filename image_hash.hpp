@@ -0,0 +1,107 @@
+#ifndef IMAGE_HASH_HPP
+#define IMAGE_HASH_HPP
+
+#include "target.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <sys/types.h>
+
+/*
+ * 64 bit FNV-1a, which can be carried on from one call to the next, so
+ * that equal byte sequences hash equally however they were assembled.
+ */
+extern const std::uint64_t hash_seed;
+
+std::uint64_t
+hash_bytes(std::uint64_t hash, const char *data, std::size_t size);
+
+std::uint64_t
+hash_zeros(std::uint64_t hash, std::size_t size);
+
+std::uint64_t
+hash_value(std::uint64_t hash, std::uint64_t value);
+
+/*
+ * Byte ranges [begin, end) of a file that have changed.
+ */
+typedef std::vector<std::pair<off_t, off_t>> change_list;
+
+/*
+ * Asked about each regular file when hashing a tree again.  Returns
+ * false if it can't say what has changed in the inode since it was last
+ * asked, and otherwise fills in changes, which may run past the end of
+ * the file.
+ */
+typedef std::function<bool(ino_t inode_number, change_list& changes)>
+	change_function;
+
+/*
+ * A Merkle-style hash of everything a crash image holds: each file's
+ * hash covers its size and the hash of each block of its contents, and
+ * each directory's covers the names, types, permissions and hashes of
+ * its entries, in order of name.  Timestamps, ownership and hard links
+ * aren't covered, since a replay sets times to when it ran, so images
+ * with the same hash are only the same as far as a checker reading the
+ * files and directories can tell.
+ *
+ * The hashes of a tree's files are remembered by inode number, so that
+ * the next time round only the blocks that have changed are read again.
+ */
+struct image_hasher {
+	image_hasher();
+
+	/*
+	 * Hash the tree in a target.  With changed, files we've hashed
+	 * before are only read where it says they've changed, and the same
+	 * file being found again under another name costs nothing;
+	 * without it, everything is read.
+	 */
+	std::uint64_t hash(target& tree, const change_function *changed = nullptr);
+
+	/*
+	 * Forget a file whose inode number has been given to a new one.
+	 */
+	void forget(ino_t inode_number) { files.erase(inode_number); }
+
+private:
+	static const std::size_t block_size = 4096;
+
+	struct file_hash {
+		off_t size;
+		std::uint64_t walk;
+		std::uint64_t hash;
+		std::vector<std::uint64_t> blocks;
+	};
+
+	std::uint64_t hash_directory(target& tree,
+								 const std::string& path,
+								 const change_function *changed);
+	std::uint64_t hash_file(target& tree,
+							const std::string& path,
+							const struct stat& stat_data,
+							const change_function *changed);
+	void hash_blocks(target& tree,
+					 const std::string& path,
+					 file_hash& entry,
+					 std::size_t first,
+					 std::size_t last);
+
+	std::unordered_map<ino_t, file_hash> files;
+	std::uint64_t walks;
+	std::vector<char> buffer;
+};
+
+/*
+ * The hash of the tree in a directory on disk.
+ */
+std::uint64_t
+hash_tree(const std::string& path);
+
+#endif
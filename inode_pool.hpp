@@ -0,0 +1,60 @@
+#ifndef INODE_POOL_HPP
+#define INODE_POOL_HPP
+
+#include <cstdint>
+#include <deque>
+#include <optional>
+#include <utility>
+#include <vector>
+
+/*
+ * Objects of one type, packed together in blocks so that they never move
+ * once made, with a free list so that slots are reused.  The replayer
+ * keeps its files and directories in two of these, rather than behind
+ * pointers to a common base class.
+ */
+template <typename T>
+struct inode_pool {
+	template <typename... Args>
+	std::uint32_t make(Args&&... args)
+	{
+		std::uint32_t slot;
+
+		if (!free_slots.empty()) {
+			slot = free_slots.back();
+			free_slots.pop_back();
+		} else {
+			slot = slots.size();
+			slots.emplace_back();
+		}
+		slots[slot].emplace(std::forward<Args>(args)...);
+
+		return slot;
+	}
+
+	void destroy(std::uint32_t slot)
+	{
+		slots[slot].reset();
+		free_slots.push_back(slot);
+	}
+
+	T& operator[](std::uint32_t slot) { return *slots[slot]; }
+
+	/*
+	 * Visit every live object, in slot order.
+	 */
+	template <typename Visitor>
+	void for_each(Visitor visit)
+	{
+		for (std::optional<T>& slot : slots) {
+			if (slot)
+				visit(*slot);
+		}
+	}
+
+private:
+	std::deque<std::optional<T>> slots;
+	std::vector<std::uint32_t> free_slots;
+};
+
+#endif
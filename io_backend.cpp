@@ -0,0 +1,363 @@
+#include "io_backend.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <unistd.h>
+
+void
+write_all(int fd, const char *data, std::size_t size, off_t offset)
+{
+	std::size_t written_so_far = 0;
+
+	do {
+		ssize_t written = ::pwrite(fd,
+								   data + written_so_far,
+								   size - written_so_far,
+								   offset + written_so_far);
+		if (written < 0) {
+			std::string error = std::strerror(errno);
+			throw std::runtime_error("could not write: " + error);
+		}
+		written_so_far += written;
+	} while (written_so_far < size);
+}
+
+void
+writev_all(int fd, const struct iovec *iov, int count, off_t offset)
+{
+	std::vector<struct iovec> remaining(iov, iov + count);
+	std::size_t done = 0;
+
+	while (done < remaining.size()) {
+		ssize_t written = ::pwritev(fd,
+									&remaining[done],
+									std::min(remaining.size() - done,
+											 std::size_t(IOV_MAX)),
+									offset);
+		if (written < 0) {
+			std::string error = std::strerror(errno);
+			throw std::runtime_error("could not write: " + error);
+		}
+		offset += written;
+
+		// Skip what was written, which may end part way through a
+		// buffer.
+		while (done < remaining.size() &&
+			   std::size_t(written) >= remaining[done].iov_len) {
+			written -= remaining[done].iov_len;
+			++done;
+		}
+		if (written > 0) {
+			remaining[done].iov_base =
+				static_cast<char *>(remaining[done].iov_base) + written;
+			remaining[done].iov_len -= written;
+		}
+	}
+}
+
+std::size_t
+read_all(int fd, char *data, std::size_t size, off_t offset)
+{
+	std::size_t read_so_far = 0;
+
+	do {
+		ssize_t read = ::pread(fd,
+							   data + read_so_far,
+							   size - read_so_far,
+							   offset + read_so_far);
+		if (read < 0) {
+			std::string error = std::strerror(errno);
+			throw std::runtime_error("could not read: " + error);
+		} else if (read == 0) {
+			break;
+		}
+		read_so_far += read;
+	} while (read_so_far < size);
+
+	return read_so_far;
+}
+
+char *
+allocate_aligned(std::size_t size)
+{
+	void *data;
+	int rc = ::posix_memalign(&data, direct_alignment, size);
+
+	if (rc != 0) {
+		std::string error = std::strerror(rc);
+		throw std::runtime_error("could not allocate aligned memory: " + error);
+	}
+	return static_cast<char *>(data);
+}
+
+std::size_t
+read_direct(int fd, char *data, std::size_t size, off_t offset)
+{
+	ssize_t read = ::pread(fd, data, size, offset);
+
+	if (read < 0) {
+		std::string error = std::strerror(errno);
+		throw std::runtime_error("could not read: " + error);
+	}
+	return read;
+}
+
+int
+open_direct(int dir_fd, const char *name, int flags, mode_t mode)
+{
+#ifdef O_DIRECT
+	int fd = ::openat(dir_fd, name, flags | O_DIRECT, mode);
+
+	// A file system that can't do O_DIRECT only says so after creating
+	// the file, so it's ours even if we asked for O_EXCL.
+	if (fd >= 0 || errno != EINVAL)
+		return fd;
+	flags &= ~O_EXCL;
+#endif
+	return ::openat(dir_fd, name, flags, mode);
+}
+
+void
+io_backend::writev(int fd, const struct iovec *iov, int count, off_t offset)
+{
+	for (int i = 0; i < count; ++i) {
+		write(fd, static_cast<const char *>(iov[i].iov_base), iov[i].iov_len, offset);
+		offset += iov[i].iov_len;
+	}
+}
+
+void
+io_backend::truncate(int fd, off_t size)
+{
+	drain();
+	if (::ftruncate(fd, size) < 0) {
+		std::string error = std::strerror(errno);
+		throw std::runtime_error("could not truncate: " + error);
+	}
+}
+
+void
+blocking_io::write(int fd, const char *data, std::size_t size, off_t offset)
+{
+	write_all(fd, data, size, offset);
+}
+
+void
+blocking_io::writev(int fd, const struct iovec *iov, int count, off_t offset)
+{
+	writev_all(fd, iov, count, offset);
+}
+
+std::size_t
+blocking_io::read(int fd, char *data, std::size_t size, off_t offset)
+{
+	return read_all(fd, data, size, offset);
+}
+
+direct_io::direct_io() :
+	bounce_size(0)
+{
+}
+
+/*
+ * Our aligned buffer, with room for at least size bytes.
+ */
+char *
+direct_io::buffer(std::size_t size)
+{
+	if (size > bounce_size) {
+		bounce_size = std::max(size, bounce_size * 2);
+		bounce.reset(allocate_aligned(bounce_size));
+	}
+	return bounce.get();
+}
+
+static bool
+aligned_p(const void *data, std::size_t size, off_t offset)
+{
+	return reinterpret_cast<uintptr_t>(data) % direct_alignment == 0 &&
+		size % direct_alignment == 0 &&
+		offset % direct_alignment == 0;
+}
+
+void
+direct_io::write(int fd, const char *data, std::size_t size, off_t offset)
+{
+	struct iovec iov = { const_cast<char *>(data), size };
+
+	writev(fd, &iov, 1, offset);
+}
+
+void
+direct_io::writev(int fd, const struct iovec *iov, int count, off_t offset)
+{
+	std::size_t size = 0;
+	bool aligned = true;
+
+	for (int i = 0; i < count; ++i) {
+		size += iov[i].iov_len;
+		aligned = aligned && aligned_p(iov[i].iov_base, iov[i].iov_len, offset);
+	}
+	if (aligned) {
+		writev_all(fd, iov, count, offset);
+		return;
+	}
+
+	off_t end = offset + size;
+	off_t first_block = offset - offset % direct_alignment;
+	off_t last_block = (end - 1) - (end - 1) % direct_alignment;
+	off_t block_end = last_block + direct_alignment;
+	char *data = buffer(block_end - first_block);
+	off_t file_end = -1;
+
+	// Fill in the rest of the blocks we're only writing part of, and
+	// find out whether the file ends in the last one.
+	auto fill = [&](off_t block) {
+		char *copy = data + (block - first_block);
+		std::size_t length = read_direct(fd, copy, direct_alignment, block);
+
+		std::memset(copy + length, 0, direct_alignment - length);
+		if (block == last_block && length < direct_alignment)
+			file_end = block + length;
+	};
+	if (offset != first_block)
+		fill(first_block);
+	if (end != block_end && (last_block != first_block || offset == first_block))
+		fill(last_block);
+
+	char *position = data + (offset - first_block);
+	for (int i = 0; i < count; ++i) {
+		std::memcpy(position, iov[i].iov_base, iov[i].iov_len);
+		position += iov[i].iov_len;
+	}
+	write_all(fd, data, block_end - first_block, first_block);
+
+	// Writing the whole of the last block may have made the file longer
+	// than it should be.
+	if (file_end >= 0 && std::max(file_end, end) < block_end &&
+		::ftruncate(fd, std::max(file_end, end)) < 0) {
+		std::string error = std::strerror(errno);
+		throw std::runtime_error("could not truncate: " + error);
+	}
+}
+
+std::size_t
+direct_io::read(int fd, char *data, std::size_t size, off_t offset)
+{
+	if (size == 0)
+		return 0;
+	if (aligned_p(data, size, offset))
+		return read_direct(fd, data, size, offset);
+
+	off_t first_block = offset - offset % direct_alignment;
+	off_t end = offset + size;
+	off_t block_end = end + (direct_alignment - end % direct_alignment) % direct_alignment;
+	char *copy = buffer(block_end - first_block);
+	std::size_t length = read_direct(fd, copy, block_end - first_block, first_block);
+	std::size_t skip = offset - first_block;
+
+	if (length <= skip)
+		return 0;
+	length = std::min(length - skip, size);
+	std::memcpy(data, copy + skip, length);
+	return length;
+}
+
+threaded_io::threaded_io(std::size_t depth) :
+	requests(depth),
+	recycled(depth + 1),
+	completed(0),
+	submitted(0),
+	failed(false),
+	worker(&threaded_io::work, this)
+{
+}
+
+threaded_io::~threaded_io()
+{
+	// An empty request with no fd tells the worker to exit.
+	requests.push(request());
+	worker.join();
+}
+
+void
+threaded_io::work()
+{
+	request r;
+
+	for (;;) {
+		requests.pop(r);
+		if (r.fd == -1)
+			break;
+		if (!failed.load(std::memory_order_relaxed)) {
+			try {
+				write_all(r.fd, r.data.data(), r.data.size(), r.offset);
+			} catch (...) {
+				error = std::current_exception();
+				failed.store(true, std::memory_order_release);
+			}
+		}
+		// Hand the buffer back for reuse, or drop it if the replay
+		// thread hasn't been collecting them.
+		recycled.try_push(std::move(r.data));
+		r.data = std::vector<char>();
+		completed.fetch_add(1, std::memory_order_release);
+	}
+}
+
+void
+threaded_io::check_error()
+{
+	if (failed.load(std::memory_order_acquire))
+		std::rethrow_exception(error);
+}
+
+void
+threaded_io::write(int fd, const char *data, std::size_t size, off_t offset)
+{
+	struct iovec iov = { const_cast<char *>(data), size };
+
+	writev(fd, &iov, 1, offset);
+}
+
+void
+threaded_io::writev(int fd, const struct iovec *iov, int count, off_t offset)
+{
+	request r;
+
+	check_error();
+	recycled.try_pop(r.data);
+	r.fd = fd;
+	r.offset = offset;
+	r.data.clear();
+	for (int i = 0; i < count; ++i) {
+		const char *data = static_cast<const char *>(iov[i].iov_base);
+		r.data.insert(r.data.end(), data, data + iov[i].iov_len);
+	}
+	requests.push(std::move(r));
+	++submitted;
+}
+
+std::size_t
+threaded_io::read(int fd, char *data, std::size_t size, off_t offset)
+{
+	drain();
+	return read_all(fd, data, size, offset);
+}
+
+void
+threaded_io::drain()
+{
+	for (int attempt = 0;
+		 completed.load(std::memory_order_acquire) != submitted;
+		 ++attempt)
+		spsc_queue<request>::backoff(attempt);
+	check_error();
+}
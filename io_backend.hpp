@@ -0,0 +1,160 @@
+#ifndef IO_BACKEND_HPP
+#define IO_BACKEND_HPP
+
+#include "spsc_queue.hpp"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdlib>
+#include <exception>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/*
+ * The interface through which file contents reach the target directory.
+ * Writes may be performed asynchronously, but a backend must apply them
+ * in the order they were issued, and a read must see every write issued
+ * before it.  drain() waits until everything issued so far has been
+ * handed to the kernel, and must be called before doing anything else
+ * to a file descriptor that has writes in flight (closing or truncating
+ * it, for example).  Errors from asynchronous writes are reported by
+ * the next call.
+ */
+struct io_backend {
+	virtual ~io_backend() {}
+	virtual void write(int fd, const char *data, std::size_t size, off_t offset) = 0;
+	virtual std::size_t read(int fd, char *data, std::size_t size, off_t offset) = 0;
+	virtual void drain() = 0;
+
+	/*
+	 * Write the buffers one after another from offset, as if by a single
+	 * write().  By default they are written separately.
+	 */
+	virtual void writev(int fd, const struct iovec *iov, int count, off_t offset);
+
+	/*
+	 * Set the size of a file, after the writes issued before.  By default
+	 * this drains and calls ftruncate().
+	 */
+	virtual void truncate(int fd, off_t size);
+};
+
+/*
+ * Plain blocking pwrite() and pread(), performed immediately.  This is
+ * the default and the reference behaviour for the others.
+ */
+struct blocking_io : io_backend {
+	void write(int fd, const char *data, std::size_t size, off_t offset) override;
+	std::size_t read(int fd, char *data, std::size_t size, off_t offset) override;
+	void drain() override {}
+	void writev(int fd, const struct iovec *iov, int count, off_t offset) override;
+};
+
+/*
+ * The alignment that O_DIRECT needs for buffers, offsets and sizes.  The
+ * real requirement is the device's logical block size, which is never
+ * more than this in practice.
+ */
+static const std::size_t direct_alignment = 4096;
+
+/*
+ * Memory aligned for O_DIRECT, to be released with free().
+ */
+char *
+allocate_aligned(std::size_t size);
+
+struct aligned_free {
+	void operator()(char *data) const { std::free(data); }
+};
+typedef std::unique_ptr<char[], aligned_free> aligned_memory;
+
+/*
+ * Like blocking_io, but for descriptors opened with O_DIRECT, which can
+ * only transfer whole blocks between aligned buffers and offsets.  Calls
+ * that are already aligned go straight through.  Anything else goes
+ * through a buffer of our own, reading in the blocks at either end
+ * first and cutting the file back afterwards if writing the last block
+ * made it too long.  Descriptors that aren't O_DIRECT are fine too.
+ */
+struct direct_io : io_backend {
+	direct_io();
+
+	void write(int fd, const char *data, std::size_t size, off_t offset) override;
+	std::size_t read(int fd, char *data, std::size_t size, off_t offset) override;
+	void drain() override {}
+	void writev(int fd, const struct iovec *iov, int count, off_t offset) override;
+
+private:
+	char *buffer(std::size_t size);
+
+	aligned_memory bounce;
+	std::size_t bounce_size;
+};
+
+/*
+ * Writes are copied into a queue and performed in order by a dedicated
+ * I/O thread, so that the replay thread can carry on simulating.  Reads
+ * drain the queue and then happen on the calling thread.
+ */
+struct threaded_io : io_backend {
+	explicit threaded_io(std::size_t depth = 256);
+	~threaded_io();
+
+	void write(int fd, const char *data, std::size_t size, off_t offset) override;
+	std::size_t read(int fd, char *data, std::size_t size, off_t offset) override;
+	void drain() override;
+	void writev(int fd, const struct iovec *iov, int count, off_t offset) override;
+
+private:
+	struct request {
+		request() : fd(-1), offset(0) {}
+		int fd;
+		off_t offset;
+		std::vector<char> data;
+	};
+
+	void work();
+	void check_error();
+
+	spsc_queue<request> requests;
+	spsc_queue<std::vector<char>> recycled;
+	std::atomic<std::size_t> completed;
+	std::size_t submitted;
+	std::atomic<bool> failed;
+	std::exception_ptr error;
+	std::thread worker;
+};
+
+/*
+ * Like pwrite() and pread(), but with retry and exceptions.  read_all()
+ * returns less than size only at end of file.
+ */
+void
+write_all(int fd, const char *data, std::size_t size, off_t offset);
+
+void
+writev_all(int fd, const struct iovec *iov, int count, off_t offset);
+
+std::size_t
+read_all(int fd, char *data, std::size_t size, off_t offset);
+
+/*
+ * Like read_all(), but for a descriptor that may be O_DIRECT, where a
+ * short read means the end of the file, and the offset of the next read
+ * wouldn't be aligned.
+ */
+std::size_t
+read_direct(int fd, char *data, std::size_t size, off_t offset);
+
+/*
+ * openat() with O_DIRECT, or without it if the file system doesn't
+ * support it.
+ */
+int
+open_direct(int dir_fd, const char *name, int flags, mode_t mode = 0);
+
+#endif
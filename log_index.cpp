@@ -0,0 +1,152 @@
+#include "log_index.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <istream>
+#include <ostream>
+#include <stdexcept>
+
+static const char *log_index_magic = "dsfs-index";
+static const int log_index_version = 1;
+
+std::string
+log_index_path(const std::string& log_path)
+{
+	return log_path + ".index";
+}
+
+void
+log_index::build(std::istream& log, std::size_t interval)
+{
+	log_index_entry current;
+	operation_reader reader;
+	arena storage;
+	operation op;
+
+	if (interval == 0)
+		throw std::runtime_error("index interval must be at least 1");
+
+	this->interval = interval;
+	entries.clear();
+	std::memset(&current, 0, sizeof(current));
+
+	for (;;) {
+		// Remember where every Nth record begins.  Leading whitespace
+		// is skipped by the parser, so this is as good as the offset
+		// of the opening parenthesis.
+		if (current.record % interval == 0) {
+			current.offset = log.tellg();
+			if (current.offset < 0)
+				throw std::runtime_error("log file is not seekable");
+			entries.push_back(current);
+		}
+		storage.reset();
+		if (!reader.read(log, op, storage))
+			break;
+		++current.record;
+		++current.counts[op.op];
+	}
+	if (log.bad())
+		throw std::runtime_error("could not parse record " +
+								 std::to_string(current.record + 1));
+
+	// The end of the log is always the final entry.  If the last thing
+	// we did was push an entry for the end, it's already there.
+	log.clear();
+	log.seekg(0, std::ios_base::end);
+	current.offset = log.tellg();
+	if (entries.back().record == current.record)
+		entries.back() = current;
+	else
+		entries.push_back(current);
+}
+
+void
+log_index::save(std::ostream& stream) const
+{
+	stream << log_index_magic << ' ' << log_index_version << ' '
+		   << interval << ' ' << operation_type_count;
+	for (int i = 0; i < operation_type_count; ++i)
+		stream << ' ' << stringify(static_cast<operation::op_type>(i));
+	stream << '\n';
+
+	for (const auto& entry : entries) {
+		stream << entry.record << ' ' << entry.offset;
+		for (int i = 0; i < operation_type_count; ++i)
+			stream << ' ' << entry.counts[i];
+		stream << '\n';
+	}
+}
+
+void
+log_index::load(std::istream& stream)
+{
+	std::string magic;
+	int version;
+	int columns;
+	std::vector<int> column_types;
+
+	if (!(stream >> magic >> version >> interval >> columns) ||
+		magic != log_index_magic)
+		throw std::runtime_error("not a dsfs index file");
+	if (version != log_index_version)
+		throw std::runtime_error("unsupported dsfs index version");
+
+	// Map the columns in the file to our op_type numbering.
+	for (int i = 0; i < columns; ++i) {
+		std::string name;
+		operation::op_type op;
+
+		if (!(stream >> name))
+			throw std::runtime_error("truncated dsfs index header");
+		if (!parse_op_type(name, op))
+			throw std::runtime_error("unknown operation type in index: " + name);
+		column_types.push_back(op);
+	}
+
+	entries.clear();
+	for (;;) {
+		log_index_entry entry;
+
+		std::memset(&entry, 0, sizeof(entry));
+		if (!(stream >> entry.record))
+			break;
+		if (!(stream >> entry.offset))
+			throw std::runtime_error("truncated dsfs index entry");
+		for (int type : column_types) {
+			if (!(stream >> entry.counts[type]))
+				throw std::runtime_error("truncated dsfs index entry");
+		}
+		entries.push_back(entry);
+	}
+	if (entries.empty())
+		throw std::runtime_error("dsfs index has no entries");
+}
+
+const log_index_entry&
+log_index::find_record(std::size_t record) const
+{
+	auto it = std::partition_point(entries.begin(),
+								   entries.end(),
+								   [&](const log_index_entry& entry) {
+									   return entry.record <= record;
+								   });
+	if (it == entries.begin())
+		throw std::runtime_error("dsfs index has no entry for record " +
+								 std::to_string(record));
+	return *--it;
+}
+
+const log_index_entry&
+log_index::find_operation(operation::op_type op, std::size_t n) const
+{
+	auto it = std::partition_point(entries.begin(),
+								   entries.end(),
+								   [&](const log_index_entry& entry) {
+									   return entry.counts[op] < n;
+								   });
+	if (it == entries.begin())
+		throw std::runtime_error("dsfs index has no entry before " +
+								 stringify(op) + " " + std::to_string(n));
+	return *--it;
+}
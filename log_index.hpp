@@ -0,0 +1,72 @@
+#ifndef LOG_INDEX_HPP
+#define LOG_INDEX_HPP
+
+#include "operation.hpp"
+
+#include <cstddef>
+#include <iosfwd>
+#include <string>
+#include <vector>
+
+#include <sys/types.h>
+
+/*
+ * A point in a log file that we can seek to, along with the number of
+ * records and operations of each type that appear before it.
+ */
+struct log_index_entry {
+	std::size_t record;
+	off_t offset;
+	std::size_t counts[operation_type_count];
+};
+
+/*
+ * A sidecar file that records the byte offset of every Nth record in a
+ * log, so that dsfs_replay can jump to a start point without parsing
+ * everything before it.  The final entry describes the end of the log,
+ * so it also tells us how many operations of each type the log holds.
+ *
+ * The file is plain text.  The header names the operation types in the
+ * order that counts appear on each line, so that it doesn't depend on
+ * the numbering of operation::op_type.
+ */
+struct log_index {
+	log_index() : interval(0) {}
+
+	/*
+	 * Scan a log file and record an entry every interval records.
+	 * Throws if the log can't be parsed.
+	 */
+	void build(std::istream& log, std::size_t interval);
+
+	void load(std::istream& stream);
+	void save(std::ostream& stream) const;
+
+	/*
+	 * Find the last entry at or before a given record number.
+	 */
+	const log_index_entry& find_record(std::size_t record) const;
+
+	/*
+	 * Find the last entry that comes before the Nth operation of the
+	 * given type (counting from 1).
+	 */
+	const log_index_entry& find_operation(operation::op_type op,
+										  std::size_t n) const;
+
+	/*
+	 * Totals for the whole log.
+	 */
+	const log_index_entry& end() const { return entries.back(); }
+
+	std::size_t interval;
+	std::vector<log_index_entry> entries;
+};
+
+/*
+ * The conventional name of the index for a given log file.
+ */
+std::string
+log_index_path(const std::string& log_path);
+
+#endif
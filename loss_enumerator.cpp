@@ -0,0 +1,193 @@
+#include "loss_enumerator.hpp"
+#include "image_hash.hpp"
+#include "io_backend.hpp"
+#include "tree.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <numeric>
+#include <stdexcept>
+#include <unordered_set>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static void
+fail(const std::string& what, const std::string& path)
+{
+	std::string error = std::strerror(errno);
+	throw std::runtime_error("could not " + what + " " + path + ": " + error);
+}
+
+/*
+ * What we need to know about each sector to work out the contents of its
+ * part of the file, whether it was lost or not.
+ */
+struct sector_state {
+	off_t end;
+	std::uint64_t new_hash;
+	std::uint64_t old_hash;
+};
+
+/*
+ * The sectors [first, last) belong to this file.
+ */
+struct file_state {
+	std::string path;
+	off_t base_size;
+	std::size_t first;
+	std::size_t last;
+};
+
+std::size_t
+enumerate_losses(const std::string& base,
+				 std::vector<unsynced_sector> sectors,
+				 std::size_t max_lost,
+				 const std::string& dir,
+				 const loss_visitor& visit)
+{
+	std::vector<sector_state> states(sectors.size());
+	std::vector<file_state> files;
+
+	std::sort(sectors.begin(), sectors.end(),
+			  [](const unsynced_sector& a, const unsynced_sector& b) {
+				  return a.path != b.path ? a.path < b.path : a.offset < b.offset;
+			  });
+
+	// Hash each sector's new contents, and whatever was on disk in its
+	// place before.  If it's lost, that's what shows through, padded with
+	// zeroes if the file has grown past it.
+	for (std::size_t i = 0; i < sectors.size(); ++i) {
+		const unsynced_sector& sector = sectors[i];
+		sector_state& state = states[i];
+		std::string path = base + sector.path;
+
+		if (files.empty() || files.back().path != sector.path) {
+			struct stat stat_data;
+
+			if (::lstat(path.c_str(), &stat_data) < 0)
+				fail("stat", path);
+			files.push_back(file_state{ sector.path, stat_data.st_size, i, i });
+		}
+		file_state& file = files.back();
+		++file.last;
+
+		state.end = sector.offset + sector.data.size();
+		state.new_hash = hash_bytes(hash_seed, sector.data.data(), sector.data.size());
+		state.old_hash = hash_seed;
+		if (sector.offset < file.base_size) {
+			std::vector<char> old(std::min(state.end, file.base_size) - sector.offset);
+			int fd = ::open(path.c_str(), O_RDONLY);
+
+			if (fd < 0)
+				fail("open", path);
+			try {
+				read_all(fd, old.data(), old.size(), sector.offset);
+			} catch (...) {
+				::close(fd);
+				throw;
+			}
+			::close(fd);
+			state.old_hash = hash_bytes(state.old_hash, old.data(), old.size());
+		}
+	}
+
+	std::vector<bool> lost(sectors.size());
+	std::vector<std::size_t> chosen;
+	std::unordered_set<std::uint64_t> seen;
+	std::size_t images = 0;
+
+	// Visit each way of choosing m of the n sectors to lose, in
+	// lexicographic order, for m = 0 up to max_lost.
+	std::size_t n = sectors.size();
+	for (std::size_t m = 0; m <= std::min(max_lost, n); ++m) {
+		chosen.resize(m);
+		std::iota(chosen.begin(), chosen.end(), 0);
+		for (;;) {
+			for (std::size_t i : chosen)
+				lost[i] = true;
+
+			// Everything outside these sectors depends only on the
+			// size of the file.
+			std::uint64_t key = hash_seed;
+			for (const file_state& file : files) {
+				off_t size = file.base_size;
+
+				for (std::size_t i = file.first; i < file.last; ++i) {
+					if (!lost[i])
+						size = std::max(size, states[i].end);
+				}
+				key = hash_value(key, size);
+				for (std::size_t i = file.first; i < file.last; ++i) {
+					const sector_state& state = states[i];
+					std::uint64_t hash = state.new_hash;
+
+					if (lost[i]) {
+						off_t zeroes_begin = std::max(sectors[i].offset,
+													  file.base_size);
+						off_t zeroes_end = std::min(state.end, size);
+						hash = state.old_hash;
+						if (zeroes_end > zeroes_begin)
+							hash = hash_zeros(hash, zeroes_end - zeroes_begin);
+					}
+					key = hash_value(key, hash);
+				}
+			}
+
+			if (seen.insert(key).second) {
+				std::string image = dir + "/" + std::to_string(images++);
+				std::string description;
+
+				remove_tree(image);
+				if (::mkdir(image.c_str(), 0777) < 0)
+					fail("create", image);
+				copy_tree(base, image);
+				for (const file_state& file : files) {
+					std::string path = image + file.path;
+					int fd = ::open(path.c_str(), O_WRONLY);
+
+					if (fd < 0)
+						fail("open", path);
+					try {
+						for (std::size_t i = file.first; i < file.last; ++i) {
+							if (!lost[i])
+								write_all(fd,
+										  sectors[i].data.data(),
+										  sectors[i].data.size(),
+										  sectors[i].offset);
+						}
+					} catch (...) {
+						::close(fd);
+						throw;
+					}
+					::close(fd);
+				}
+				for (std::size_t i : chosen) {
+					if (!description.empty())
+						description += " ";
+					description += sectors[i].path + "@" +
+						std::to_string(sectors[i].offset);
+				}
+				visit(image, description.empty() ? "nothing" : description);
+			}
+
+			for (std::size_t i : chosen)
+				lost[i] = false;
+
+			// Advance to the next combination.
+			std::size_t i = m;
+			while (i > 0 && chosen[i - 1] == n - m + i - 1)
+				--i;
+			if (i == 0)
+				break;
+			++chosen[i - 1];
+			for (std::size_t j = i; j < m; ++j)
+				chosen[j] = chosen[j - 1] + 1;
+		}
+	}
+
+	return images;
+}
@@ -0,0 +1,43 @@
+#ifndef LOSS_ENUMERATOR_HPP
+#define LOSS_ENUMERATOR_HPP
+
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <sys/types.h>
+
+/*
+ * A sector that was written but not yet synced when the power went, and
+ * the path of its file in the image.
+ */
+struct unsynced_sector {
+	std::string path;
+	off_t offset;
+	std::vector<char> data;
+};
+
+/*
+ * Called with the path of each distinct image, and a list of the sectors
+ * that were lost to make it.  The visitor may move or remove the image.
+ */
+typedef std::function<void(const std::string& image, const std::string& lost)>
+	loss_visitor;
+
+/*
+ * Build images as dir/0, dir/1 and so on for every way of losing at most
+ * max_lost of the sectors, with the rest reaching the disk.  base holds
+ * what the disk looks like if they are all lost.  Subsets are generated
+ * one at a time, smallest first, and an image whose contents would match
+ * an earlier one is skipped without being built, judging by a 64 bit hash
+ * of the sectors and file sizes that vary.  Returns the number of images.
+ */
+std::size_t
+enumerate_losses(const std::string& base,
+				 std::vector<unsynced_sector> sectors,
+				 std::size_t max_lost,
+				 const std::string& dir,
+				 const loss_visitor& visit);
+
+#endif
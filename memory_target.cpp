@@ -0,0 +1,860 @@
+#include "memory_target.hpp"
+#include "tree.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+static struct timespec
+now()
+{
+	struct timespec result;
+
+	clock_gettime(CLOCK_REALTIME, &result);
+	return result;
+}
+
+static int
+fail(int error)
+{
+	errno = error;
+	return -1;
+}
+
+memory_target::memory_target(const std::string& output_path) :
+	output_path(output_path),
+	next_inode_number(1)
+{
+	// New files get the same permissions they would on disk.
+	creation_mask = ::umask(0);
+	::umask(creation_mask);
+
+	root = make_node(S_IFDIR | 0755);
+	nodes[root].parent = root;
+	nodes[root].nlink = 1;
+}
+
+ino_t
+memory_target::make_node(mode_t mode)
+{
+	ino_t inode_number = next_inode_number++;
+	node& n = nodes[inode_number];
+
+	n.mode = mode;
+	n.uid = ::getuid();
+	n.gid = ::getgid();
+	n.times[0] = n.times[1] = now();
+
+	return inode_number;
+}
+
+/*
+ * Forget an inode once it's neither linked nor open.
+ */
+void
+memory_target::release(ino_t inode_number)
+{
+	node& n = nodes[inode_number];
+
+	if (n.nlink == 0 && n.open_count == 0)
+		nodes.erase(inode_number);
+}
+
+/*
+ * Walk a path from a directory, returning 0 and setting errno if it
+ * can't be found.  Symlinks are followed, except at the end if follow is
+ * false.  Absolute symlinks are resolved from the root of the target.
+ */
+ino_t
+memory_target::resolve(ino_t directory, std::string_view path, bool follow, int depth)
+{
+	ino_t current = !path.empty() && path[0] == '/' ? root : directory;
+	std::size_t position = 0;
+
+	for (;;) {
+		while (position < path.size() && path[position] == '/')
+			++position;
+		if (position == path.size())
+			return current;
+
+		std::size_t end = std::min(path.find('/', position), path.size());
+		std::string_view component = path.substr(position, end - position);
+		bool last = path.find_first_not_of('/', end) == std::string_view::npos;
+		position = end;
+
+		node& n = nodes[current];
+		if (!S_ISDIR(n.mode)) {
+			errno = ENOTDIR;
+			return 0;
+		}
+		if (component == ".")
+			continue;
+		if (component == "..") {
+			current = n.parent;
+			continue;
+		}
+
+		auto it = n.entries.find(component);
+		if (it == n.entries.end()) {
+			errno = ENOENT;
+			return 0;
+		}
+		ino_t next = it->second;
+		const node& child = nodes[next];
+		if (S_ISLNK(child.mode) && (follow || !last)) {
+			if (depth >= 40) {
+				errno = ELOOP;
+				return 0;
+			}
+			next = resolve(current, child.symlink, true, depth + 1);
+			if (next == 0)
+				return 0;
+		}
+		current = next;
+	}
+}
+
+ino_t
+memory_target::lookup(std::string_view path, bool follow)
+{
+	return resolve(root, path, follow, 0);
+}
+
+/*
+ * Find the directory that a path's final component lives in, throwing
+ * if it doesn't exist just as posix_target does.  Returns 0 with errno
+ * set if there is no final component.
+ */
+ino_t
+memory_target::lookup_parent(std::string_view path, std::string_view& name)
+{
+	std::string_view parent;
+	ino_t inode_number;
+
+	split_path(path, parent, name);
+	inode_number = lookup(parent, true);
+	if (inode_number != 0 && !S_ISDIR(nodes[inode_number].mode)) {
+		errno = ENOTDIR;
+		inode_number = 0;
+	}
+	if (inode_number == 0) {
+		std::string error = std::strerror(errno);
+		throw std::runtime_error("could not open directory " +
+								 std::string(parent) + ": " + error);
+	}
+	if (name.empty()) {
+		errno = ENOENT;
+		return 0;
+	}
+
+	return inode_number;
+}
+
+int
+memory_target::mkdir(std::string_view path, mode_t mode)
+{
+	std::string_view name;
+	ino_t parent = lookup_parent(path, name);
+
+	if (parent == 0)
+		return -1;
+	if (nodes[parent].entries.count(name))
+		return fail(EEXIST);
+
+	ino_t inode_number = make_node(S_IFDIR | (mode & 07777 & ~creation_mask));
+	nodes[inode_number].parent = parent;
+	nodes[inode_number].nlink = 1;
+	nodes[parent].entries.emplace(name, inode_number);
+
+	return 0;
+}
+
+int
+memory_target::unlink(std::string_view path)
+{
+	std::string_view name;
+	ino_t parent = lookup_parent(path, name);
+
+	if (parent == 0)
+		return -1;
+
+	auto& entries = nodes[parent].entries;
+	auto it = entries.find(name);
+	if (it == entries.end())
+		return fail(ENOENT);
+	ino_t inode_number = it->second;
+	if (S_ISDIR(nodes[inode_number].mode))
+		return fail(EISDIR);
+
+	entries.erase(it);
+	--nodes[inode_number].nlink;
+	release(inode_number);
+
+	return 0;
+}
+
+int
+memory_target::rmdir(std::string_view path)
+{
+	std::string_view name;
+	ino_t parent = lookup_parent(path, name);
+
+	if (parent == 0)
+		return -1;
+
+	auto& entries = nodes[parent].entries;
+	auto it = entries.find(name);
+	if (it == entries.end())
+		return fail(ENOENT);
+	ino_t inode_number = it->second;
+	if (!S_ISDIR(nodes[inode_number].mode))
+		return fail(ENOTDIR);
+	if (!nodes[inode_number].entries.empty())
+		return fail(ENOTEMPTY);
+
+	entries.erase(it);
+	nodes[inode_number].nlink = 0;
+	release(inode_number);
+
+	return 0;
+}
+
+int
+memory_target::symlink(std::string_view contents, std::string_view path)
+{
+	std::string_view name;
+	ino_t parent = lookup_parent(path, name);
+
+	if (parent == 0)
+		return -1;
+	if (nodes[parent].entries.count(name))
+		return fail(EEXIST);
+
+	ino_t inode_number = make_node(S_IFLNK | 0777);
+	node& n = nodes[inode_number];
+	n.nlink = 1;
+	n.symlink.assign(contents);
+	n.size = contents.size();
+	nodes[parent].entries.emplace(name, inode_number);
+
+	return 0;
+}
+
+int
+memory_target::rename(std::string_view from, std::string_view to)
+{
+	std::string_view from_name;
+	std::string_view to_name;
+	ino_t from_parent = lookup_parent(from, from_name);
+	ino_t to_parent = lookup_parent(to, to_name);
+
+	if (from_parent == 0 || to_parent == 0)
+		return -1;
+
+	auto& from_entries = nodes[from_parent].entries;
+	auto& to_entries = nodes[to_parent].entries;
+	auto source = from_entries.find(from_name);
+	if (source == from_entries.end())
+		return fail(ENOENT);
+	ino_t inode_number = source->second;
+	bool is_dir = S_ISDIR(nodes[inode_number].mode);
+
+	auto existing = to_entries.find(to_name);
+	if (existing != to_entries.end()) {
+		const node& victim = nodes[existing->second];
+
+		if (existing->second == inode_number)
+			return 0;
+		if (is_dir && !S_ISDIR(victim.mode))
+			return fail(ENOTDIR);
+		if (is_dir && !victim.entries.empty())
+			return fail(ENOTEMPTY);
+		if (!is_dir && S_ISDIR(victim.mode))
+			return fail(EISDIR);
+	}
+
+	// A directory can't be moved beneath itself.
+	if (is_dir) {
+		for (ino_t i = to_parent; i != root; i = nodes[i].parent) {
+			if (i == inode_number)
+				return fail(EINVAL);
+		}
+	}
+
+	from_entries.erase(source);
+	if (existing != to_entries.end()) {
+		ino_t victim = existing->second;
+
+		existing->second = inode_number;
+		if (S_ISDIR(nodes[victim].mode))
+			nodes[victim].nlink = 0;
+		else
+			--nodes[victim].nlink;
+		release(victim);
+	} else {
+		to_entries.emplace(to_name, inode_number);
+	}
+	if (is_dir)
+		nodes[inode_number].parent = to_parent;
+
+	return 0;
+}
+
+int
+memory_target::link(std::string_view from, std::string_view to)
+{
+	std::string_view from_name;
+	std::string_view to_name;
+	ino_t from_parent = lookup_parent(from, from_name);
+	ino_t to_parent = lookup_parent(to, to_name);
+
+	if (from_parent == 0 || to_parent == 0)
+		return -1;
+
+	auto& from_entries = nodes[from_parent].entries;
+	auto source = from_entries.find(from_name);
+	if (source == from_entries.end())
+		return fail(ENOENT);
+	ino_t inode_number = source->second;
+	if (S_ISDIR(nodes[inode_number].mode))
+		return fail(EPERM);
+	if (nodes[to_parent].entries.count(to_name))
+		return fail(EEXIST);
+
+	nodes[to_parent].entries.emplace(to_name, inode_number);
+	++nodes[inode_number].nlink;
+
+	return 0;
+}
+
+int
+memory_target::chmod(std::string_view path, mode_t mode)
+{
+	ino_t inode_number = lookup(path, true);
+
+	if (inode_number == 0)
+		return -1;
+	node& n = nodes[inode_number];
+	n.mode = (n.mode & S_IFMT) | (mode & 07777);
+
+	return 0;
+}
+
+int
+memory_target::chown(std::string_view path, uid_t uid, gid_t gid)
+{
+	ino_t inode_number = lookup(path, true);
+
+	if (inode_number == 0)
+		return -1;
+	node& n = nodes[inode_number];
+	if (uid != uid_t(-1))
+		n.uid = uid;
+	if (gid != gid_t(-1))
+		n.gid = gid;
+
+	return 0;
+}
+
+int
+memory_target::utimens(std::string_view path, const struct timespec times[2])
+{
+	ino_t inode_number = lookup(path, true);
+
+	if (inode_number == 0)
+		return -1;
+	node& n = nodes[inode_number];
+	for (int i = 0; i < 2; ++i) {
+		if (times == nullptr || times[i].tv_nsec == UTIME_NOW)
+			n.times[i] = now();
+		else if (times[i].tv_nsec != UTIME_OMIT)
+			n.times[i] = times[i];
+	}
+
+	return 0;
+}
+
+void
+memory_target::fill_stat(ino_t inode_number, struct stat *stat_data)
+{
+	const node& n = nodes[inode_number];
+
+	std::memset(stat_data, 0, sizeof(*stat_data));
+	stat_data->st_ino = inode_number;
+	stat_data->st_mode = n.mode;
+	stat_data->st_nlink = n.nlink;
+	stat_data->st_uid = n.uid;
+	stat_data->st_gid = n.gid;
+	stat_data->st_size = n.size;
+	stat_data->st_blksize = extent_size;
+	stat_data->st_atim = n.times[0];
+	stat_data->st_mtim = n.times[1];
+}
+
+int
+memory_target::stat(std::string_view path, struct stat *stat_data)
+{
+	ino_t inode_number = lookup(path, true);
+
+	if (inode_number == 0)
+		return -1;
+	fill_stat(inode_number, stat_data);
+
+	return 0;
+}
+
+int
+memory_target::lstat(std::string_view path, struct stat *stat_data)
+{
+	ino_t inode_number = lookup(path, false);
+
+	if (inode_number == 0)
+		return -1;
+	fill_stat(inode_number, stat_data);
+
+	return 0;
+}
+
+int
+memory_target::readdir(std::string_view path, std::vector<std::string>& names)
+{
+	ino_t inode_number = lookup(path, true);
+
+	if (inode_number == 0)
+		return -1;
+	if (!S_ISDIR(nodes[inode_number].mode))
+		return fail(ENOTDIR);
+	names.clear();
+	for (const auto& entry : nodes[inode_number].entries)
+		names.push_back(entry.first);
+
+	return 0;
+}
+
+int
+memory_target::readlink(std::string_view path, std::string& contents)
+{
+	ino_t inode_number = lookup(path, false);
+
+	if (inode_number == 0)
+		return -1;
+	if (!S_ISLNK(nodes[inode_number].mode))
+		return fail(EINVAL);
+	contents = nodes[inode_number].symlink;
+
+	return 0;
+}
+
+int
+memory_target::open(std::string_view path, int flags, mode_t mode)
+{
+	std::string_view name;
+	ino_t parent = lookup_parent(path, name);
+	ino_t inode_number;
+
+	if (parent == 0)
+		return -1;
+
+	auto& entries = nodes[parent].entries;
+	auto it = entries.find(name);
+	if (it == entries.end()) {
+		if (!(flags & O_CREAT))
+			return fail(ENOENT);
+		inode_number = make_node(S_IFREG | (mode & 07777 & ~creation_mask));
+		nodes[inode_number].nlink = 1;
+		entries.emplace(name, inode_number);
+	} else {
+		if ((flags & O_CREAT) && (flags & O_EXCL))
+			return fail(EEXIST);
+		inode_number = it->second;
+		if (S_ISLNK(nodes[inode_number].mode)) {
+			inode_number = resolve(parent, nodes[inode_number].symlink, true, 1);
+			if (inode_number == 0)
+				return -1;
+		}
+		node& n = nodes[inode_number];
+		if (S_ISDIR(n.mode) && (flags & O_ACCMODE) != O_RDONLY)
+			return fail(EISDIR);
+		if ((flags & O_TRUNC) && S_ISREG(n.mode))
+			truncate(n, 0);
+	}
+
+	int fd;
+	if (free_fds.empty()) {
+		fd = fds.size();
+		fds.push_back(inode_number);
+	} else {
+		fd = free_fds.back();
+		free_fds.pop_back();
+		fds[fd] = inode_number;
+	}
+	++nodes[inode_number].open_count;
+
+	return fd;
+}
+
+memory_target::node *
+memory_target::get_fd(int fd)
+{
+	if (fd < 0 || std::size_t(fd) >= fds.size() || fds[fd] == 0) {
+		errno = EBADF;
+		return nullptr;
+	}
+	return &nodes[fds[fd]];
+}
+
+int
+memory_target::close(int fd)
+{
+	node *n = get_fd(fd);
+
+	if (!n)
+		return -1;
+	--n->open_count;
+	release(fds[fd]);
+	fds[fd] = 0;
+	free_fds.push_back(fd);
+
+	return 0;
+}
+
+void
+memory_target::truncate(node& n, off_t size)
+{
+	if (size < n.size) {
+		off_t first_whole = (size + extent_size - 1) / extent_size * extent_size;
+
+		n.extents.erase(n.extents.lower_bound(first_whole), n.extents.end());
+		// Zero the tail of the last extent, in case we grow again.
+		if (size < first_whole) {
+			auto it = n.extents.find(first_whole - extent_size);
+			if (it != n.extents.end())
+				std::fill(it->second.begin() + (size - it->first),
+						  it->second.end(),
+						  0);
+		}
+	}
+	n.size = size;
+	n.times[1] = now();
+}
+
+int
+memory_target::ftruncate(int fd, off_t size)
+{
+	node *n = get_fd(fd);
+
+	if (!n)
+		return -1;
+	if (!S_ISREG(n->mode))
+		return fail(EINVAL);
+	if (size < 0)
+		return fail(EINVAL);
+	truncate(*n, size);
+
+	return 0;
+}
+
+void
+memory_target::truncate(int fd, off_t size)
+{
+	if (ftruncate(fd, size) < 0) {
+		std::string error = std::strerror(errno);
+		throw std::runtime_error("could not truncate: " + error);
+	}
+}
+
+int
+memory_target::fstat(int fd, struct stat *stat_data)
+{
+	if (!get_fd(fd))
+		return -1;
+	fill_stat(fds[fd], stat_data);
+
+	return 0;
+}
+
+void
+memory_target::write(int fd, const char *data, std::size_t size, off_t offset)
+{
+	node *n = get_fd(fd);
+
+	if (!n)
+		throw std::runtime_error("could not write: bad file descriptor");
+
+	n->size = std::max(n->size, off_t(offset + size));
+	n->times[1] = now();
+	while (size > 0) {
+		off_t extent_begin = offset - offset % extent_size;
+		std::size_t offset_in_extent = offset - extent_begin;
+		std::size_t bytes = std::min(size, extent_size - offset_in_extent);
+		std::vector<char>& extent = n->extents[extent_begin];
+
+		if (extent.empty())
+			extent.resize(extent_size);
+		std::memcpy(extent.data() + offset_in_extent, data, bytes);
+		data += bytes;
+		size -= bytes;
+		offset += bytes;
+	}
+}
+
+std::size_t
+memory_target::read(int fd, char *data, std::size_t size, off_t offset)
+{
+	node *n = get_fd(fd);
+
+	if (!n)
+		throw std::runtime_error("could not read: bad file descriptor");
+	if (offset >= n->size)
+		return 0;
+
+	size = std::min(size, std::size_t(n->size - offset));
+	std::size_t result = size;
+	while (size > 0) {
+		off_t extent_begin = offset - offset % extent_size;
+		std::size_t offset_in_extent = offset - extent_begin;
+		std::size_t bytes = std::min(size, extent_size - offset_in_extent);
+		auto it = n->extents.find(extent_begin);
+
+		if (it == n->extents.end())
+			std::memset(data, 0, bytes);
+		else
+			std::memcpy(data, it->second.data() + offset_in_extent, bytes);
+		data += bytes;
+		size -= bytes;
+		offset += bytes;
+	}
+
+	return result;
+}
+
+static void
+write_failed(const std::string& what, const std::string& path)
+{
+	std::string error = std::strerror(errno);
+	throw std::runtime_error("could not " + what + " " + path + ": " + error);
+}
+
+/*
+ * Write one inode out to disk as name in dir_fd, and everything beneath
+ * it if it's a directory.  Hard links are made for inodes already
+ * written, which are found relative to root_fd.
+ */
+void
+memory_target::write_out(ino_t inode_number,
+						 int root_fd,
+						 int dir_fd,
+						 const std::string& name,
+						 const std::string& path,
+						 std::unordered_map<ino_t, std::string>& written)
+{
+	const node& n = nodes[inode_number];
+	auto seen = written.find(inode_number);
+
+	if (seen != written.end()) {
+		if (::linkat(root_fd, seen->second.c_str() + 1, dir_fd, name.c_str(), 0) < 0)
+			write_failed("link", path);
+		return;
+	}
+	written[inode_number] = path;
+
+	if (S_ISDIR(n.mode)) {
+		if (::mkdirat(dir_fd, name.c_str(), 0700) < 0)
+			write_failed("create directory", path);
+		int fd = ::openat(dir_fd, name.c_str(), O_RDONLY | O_DIRECTORY);
+		if (fd < 0)
+			write_failed("open directory", path);
+		try {
+			for (const auto& [child_name, child] : n.entries)
+				write_out(child, root_fd, fd, child_name,
+						  path + "/" + child_name, written);
+			if (::fchmod(fd, n.mode & 07777) < 0)
+				write_failed("chmod", path);
+			(void) ::fchown(fd, n.uid, n.gid);
+			if (::futimens(fd, n.times) < 0)
+				write_failed("set times on", path);
+		} catch (...) {
+			::close(fd);
+			throw;
+		}
+		::close(fd);
+	} else if (S_ISREG(n.mode)) {
+		int fd = ::openat(dir_fd, name.c_str(), O_WRONLY | O_CREAT | O_EXCL,
+						  n.mode & 07777);
+		if (fd < 0)
+			write_failed("create", path);
+		try {
+			for (const auto& [offset, extent] : n.extents) {
+				if (offset >= n.size)
+					break;
+				write_all(fd, extent.data(),
+						  std::min(off_t(extent.size()), n.size - offset),
+						  offset);
+			}
+			if (::ftruncate(fd, n.size) < 0)
+				write_failed("truncate", path);
+			if (::fchmod(fd, n.mode & 07777) < 0)
+				write_failed("chmod", path);
+			(void) ::fchown(fd, n.uid, n.gid);
+			if (::futimens(fd, n.times) < 0)
+				write_failed("set times on", path);
+		} catch (...) {
+			::close(fd);
+			throw;
+		}
+		::close(fd);
+	} else if (S_ISLNK(n.mode)) {
+		if (::symlinkat(n.symlink.c_str(), dir_fd, name.c_str()) < 0)
+			write_failed("create symlink", path);
+		(void) ::fchownat(dir_fd, name.c_str(), n.uid, n.gid, AT_SYMLINK_NOFOLLOW);
+		if (::utimensat(dir_fd, name.c_str(), n.times, AT_SYMLINK_NOFOLLOW) < 0)
+			write_failed("set times on", path);
+	}
+}
+
+void
+memory_target::save(const std::string& path,
+					std::unordered_map<ino_t, std::string> *paths)
+{
+	std::unordered_map<ino_t, std::string> written;
+	int fd = ::open(path.c_str(), O_RDONLY | O_DIRECTORY);
+
+	if (fd < 0)
+		write_failed("open directory", path);
+	written[root] = "/";
+	try {
+		for (const auto& [name, child] : nodes[root].entries)
+			write_out(child, fd, fd, name, "/" + name, written);
+	} catch (...) {
+		::close(fd);
+		throw;
+	}
+	::close(fd);
+
+	if (paths)
+		*paths = std::move(written);
+}
+
+/*
+ * Copy the contents of a directory on disk into a directory inode.  Hard
+ * links are recognised by their inode numbers on disk.
+ */
+void
+memory_target::read_in(int dir_fd,
+					   ino_t directory,
+					   const std::string& path,
+					   std::unordered_map<ino_t, ino_t>& seen)
+{
+	for (const std::string& name : list_directory(dir_fd, path)) {
+		std::string child_path = path + "/" + name;
+		struct stat stat_data;
+		ino_t inode_number;
+
+		if (::fstatat(dir_fd, name.c_str(), &stat_data, AT_SYMLINK_NOFOLLOW) < 0)
+			write_failed("stat", child_path);
+
+		auto it = seen.find(stat_data.st_ino);
+		if (it != seen.end() && !S_ISDIR(stat_data.st_mode)) {
+			nodes[directory].entries.emplace(name, it->second);
+			++nodes[it->second].nlink;
+			continue;
+		}
+
+		inode_number = make_node(stat_data.st_mode);
+		seen[stat_data.st_ino] = inode_number;
+		nodes[directory].entries.emplace(name, inode_number);
+
+		node& n = nodes[inode_number];
+		n.nlink = 1;
+		n.uid = stat_data.st_uid;
+		n.gid = stat_data.st_gid;
+		n.times[0] = stat_data.st_atim;
+		n.times[1] = stat_data.st_mtim;
+
+		if (S_ISDIR(stat_data.st_mode)) {
+			n.parent = directory;
+			int fd = ::openat(dir_fd, name.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+			if (fd < 0)
+				write_failed("open directory", child_path);
+			try {
+				read_in(fd, inode_number, child_path, seen);
+			} catch (...) {
+				::close(fd);
+				throw;
+			}
+			::close(fd);
+		} else if (S_ISREG(stat_data.st_mode)) {
+			int fd = ::openat(dir_fd, name.c_str(), O_RDONLY | O_NOFOLLOW);
+			if (fd < 0)
+				write_failed("open", child_path);
+			try {
+				std::vector<char> extent(extent_size);
+				std::size_t size;
+
+				for (off_t offset = 0;
+					 (size = read_all(fd, extent.data(), extent.size(), offset)) > 0;
+					 offset += size) {
+					// The tail of the last extent must read as zeroes if
+					// the file grows later, not as what the one before left
+					// behind.
+					std::fill(extent.begin() + size, extent.end(), 0);
+					// Leave holes as holes.
+					if (std::any_of(extent.begin(), extent.begin() + size,
+									[](char c) { return c != 0; }))
+						n.extents[offset] = extent;
+				}
+				n.size = stat_data.st_size;
+			} catch (...) {
+				::close(fd);
+				throw;
+			}
+			::close(fd);
+		} else if (S_ISLNK(stat_data.st_mode)) {
+			std::vector<char> contents(stat_data.st_size + 1);
+			ssize_t size = ::readlinkat(dir_fd, name.c_str(),
+										contents.data(), contents.size());
+			if (size < 0)
+				write_failed("read symlink", child_path);
+			n.symlink.assign(contents.data(), size);
+			n.size = size;
+		} else {
+			throw std::runtime_error("unsupported file type at " + child_path);
+		}
+	}
+}
+
+void
+memory_target::load(const std::string& path)
+{
+	std::unordered_map<ino_t, ino_t> seen;
+	int fd = ::open(path.c_str(), O_RDONLY | O_DIRECTORY);
+
+	if (fd < 0)
+		write_failed("open directory", path);
+	try {
+		read_in(fd, root, "", seen);
+	} catch (...) {
+		::close(fd);
+		throw;
+	}
+	::close(fd);
+}
+
+void
+memory_target::move_to(const std::string& path,
+					   std::unordered_map<ino_t, std::string>& paths)
+{
+	// We're only in memory, so there's nothing to copy.
+	output_path = path;
+	paths.clear();
+}
+
+void
+memory_target::flush()
+{
+	save(output_path, nullptr);
+}
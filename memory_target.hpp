@@ -0,0 +1,113 @@
+#ifndef MEMORY_TARGET_HPP
+#define MEMORY_TARGET_HPP
+
+#include "io_backend.hpp"
+#include "target.hpp"
+
+#include <cstddef>
+#include <functional>
+#include <map>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+
+/*
+ * A target that exists only in memory, for replays where we only care
+ * about the final image.  Directories, symlinks, hard links, open but
+ * unlinked files and sparse files are modelled, and nothing touches the
+ * disk until flush() writes the tree out to the output directory, which
+ * must be empty.  Inode numbers are never reused.
+ *
+ * File contents are kept in fixed-size extents, so that a write at a
+ * large offset doesn't allocate the whole file.  The target is also its
+ * own io_backend, since reads and writes are just copies.
+ */
+struct memory_target : target, io_backend {
+	explicit memory_target(const std::string& output_path);
+
+	int mkdir(std::string_view path, mode_t mode) override;
+	int unlink(std::string_view path) override;
+	int rmdir(std::string_view path) override;
+	int symlink(std::string_view contents, std::string_view path) override;
+	int rename(std::string_view from, std::string_view to) override;
+	int link(std::string_view from, std::string_view to) override;
+	int chmod(std::string_view path, mode_t mode) override;
+	int chown(std::string_view path, uid_t uid, gid_t gid) override;
+	int utimens(std::string_view path, const struct timespec times[2]) override;
+	int stat(std::string_view path, struct stat *stat_data) override;
+	int lstat(std::string_view path, struct stat *stat_data) override;
+	int readdir(std::string_view path, std::vector<std::string>& names) override;
+	int readlink(std::string_view path, std::string& contents) override;
+
+	int open(std::string_view path, int flags, mode_t mode) override;
+	int close(int fd) override;
+	int ftruncate(int fd, off_t size) override;
+	int fstat(int fd, struct stat *stat_data) override;
+
+	io_backend& io() override { return *this; }
+	void write(int fd, const char *data, std::size_t size, off_t offset) override;
+	std::size_t read(int fd, char *data, std::size_t size, off_t offset) override;
+	void drain() override {}
+	void truncate(int fd, off_t size) override;
+
+	void save(const std::string& path,
+			  std::unordered_map<ino_t, std::string> *paths) override;
+	void load(const std::string& path) override;
+	void move_to(const std::string& path,
+				 std::unordered_map<ino_t, std::string>& paths) override;
+	void flush() override;
+
+private:
+	static const std::size_t extent_size = 4096;
+
+	struct node {
+		node() :
+			mode(0), uid(0), gid(0), nlink(0), open_count(0), size(0),
+			parent(0) {}
+		mode_t mode;
+		uid_t uid;
+		gid_t gid;
+		nlink_t nlink;
+		unsigned open_count;
+		off_t size;
+		ino_t parent;
+		struct timespec times[2];
+		std::map<off_t, std::vector<char>> extents;
+		std::string symlink;
+		std::map<std::string, ino_t, std::less<>> entries;
+	};
+
+	ino_t resolve(ino_t directory, std::string_view path, bool follow, int depth);
+	ino_t lookup(std::string_view path, bool follow);
+	ino_t lookup_parent(std::string_view path, std::string_view& name);
+	ino_t make_node(mode_t mode);
+	void release(ino_t inode_number);
+	node *get_fd(int fd);
+	void truncate(node& n, off_t size);
+	void fill_stat(ino_t inode_number, struct stat *stat_data);
+	void write_out(ino_t inode_number,
+				   int root_fd,
+				   int dir_fd,
+				   const std::string& name,
+				   const std::string& path,
+				   std::unordered_map<ino_t, std::string>& written);
+	void read_in(int dir_fd,
+				 ino_t directory,
+				 const std::string& path,
+				 std::unordered_map<ino_t, ino_t>& seen);
+
+	std::string output_path;
+	std::unordered_map<ino_t, node> nodes;
+	std::vector<ino_t> fds;
+	std::vector<int> free_fds;
+	ino_t root;
+	ino_t next_inode_number;
+	mode_t creation_mask;
+};
+
+#endif
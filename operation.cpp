@@ -1,6 +1,7 @@
 #include "operation.hpp"
 
 #include <istream>
+#include <ostream>
 
 static bool
 read_symbol(std::istream& stream, std::string& out)
@@ -36,8 +37,8 @@ decode_hex_digit(int x)
  * Non-printable characters are expected to be escaped as \xHH where
  * HH is a pair of lower-case hexidecimal digits.
  */
-static bool
-read_string(std::istream& stream, std::string& out)
+bool
+read_string_literal(std::istream& stream, std::string& out)
 {
 	int c;
 
@@ -82,8 +83,28 @@ read_string(std::istream& stream, std::string& out)
 	return false;
 }
 
-std::istream&
-operator>>(std::istream& stream, operation& out)
+/*
+ * Read a string literal into the scratch buffer, then copy it into the
+ * arena.
+ */
+static bool
+read_string(std::istream& stream,
+			std::string& scratch,
+			arena& storage,
+			std::string_view& out)
+{
+	if (!read_string_literal(stream, scratch))
+		return false;
+	out = storage.copy(scratch);
+	return true;
+}
+
+static std::istream&
+parse(std::istream& stream,
+	  operation& out,
+	  std::string& op,
+	  std::string& scratch,
+	  arena& storage)
 {
 	for (;;) {
 		int c = stream.get();
@@ -93,8 +114,9 @@ operator>>(std::istream& stream, operation& out)
 			continue;
 		if (c == '(') {
 			bool ok = true;
-			std::string op;
 
+			op.clear();
+			out.path = out.path2 = out.data = std::string_view();
 			if (!read_symbol(stream, op)) {
 				stream.setstate(std::ios_base::badbit);
 				return stream;
@@ -102,57 +124,57 @@ operator>>(std::istream& stream, operation& out)
 
 			if (op == "mkdir") {
 				out.op = operation::OP_MKDIR;
-				ok = read_string(stream, out.path);
+				ok = read_string(stream, scratch, storage, out.path);
 				if (ok)
 					ok = !!(stream >> out.mode);
 			} else if (op == "unlink") {
 				out.op = operation::OP_UNLINK;
-				ok = read_string(stream, out.path);
+				ok = read_string(stream, scratch, storage, out.path);
 			} else if (op == "rmdir") {
 				out.op = operation::OP_RMDIR;
-				ok = read_string(stream, out.path);
+				ok = read_string(stream, scratch, storage, out.path);
 			} else if (op == "symlink") {
 				out.op = operation::OP_SYMLINK;
-				ok = read_string(stream, out.path);
+				ok = read_string(stream, scratch, storage, out.path);
 				if (ok)
-					ok = read_string(stream, out.path2);
+					ok = read_string(stream, scratch, storage, out.path2);
 			} else if (op == "rename") {
 				out.op = operation::OP_RENAME;
-				ok = read_string(stream, out.path);
+				ok = read_string(stream, scratch, storage, out.path);
 				if (ok)
-					ok = read_string(stream, out.path2);
+					ok = read_string(stream, scratch, storage, out.path2);
 			} else if (op == "link") {
 				out.op = operation::OP_LINK;
-				ok = read_string(stream, out.path);
+				ok = read_string(stream, scratch, storage, out.path);
 				if (ok)
-					ok = read_string(stream, out.path2);
+					ok = read_string(stream, scratch, storage, out.path2);
 			} else if (op == "chmod") {
 				out.op = operation::OP_CHMOD;
-				ok = read_string(stream, out.path);
+				ok = read_string(stream, scratch, storage, out.path);
 				if (ok)
 					ok = !!(stream >> out.mode);
 			} else if (op == "chown") {
 				out.op = operation::OP_CHOWN;
-				ok = read_string(stream, out.path);
+				ok = read_string(stream, scratch, storage, out.path);
 				if (ok)
 					ok = !!(stream >> out.uid);
 				if (ok)
 					ok = !!(stream >> out.gid);
 			} else if (op == "truncate") {
 				out.op = operation::OP_TRUNCATE;
-				ok = read_string(stream, out.path);
+				ok = read_string(stream, scratch, storage, out.path);
 				if (ok)
 					ok = !!(stream >> out.size);
 			} else if (op == "ftruncate") {
 				out.op = operation::OP_FTRUNCATE;
-				ok = read_string(stream, out.path);
+				ok = read_string(stream, scratch, storage, out.path);
 				if (ok)
 					ok = !!(stream >> out.size);
 				if (ok)
 					ok = !!(stream >> out.file_handle_id);
 			} else if (op == "create") {
 				out.op = operation::OP_CREATE;
-				ok = read_string(stream, out.path);
+				ok = read_string(stream, scratch, storage, out.path);
 				if (ok)
 					ok = !!(stream >> out.flags);
 				if (ok)
@@ -161,16 +183,16 @@ operator>>(std::istream& stream, operation& out)
 					ok = !!(stream >> out.file_handle_id);
 			} else if (op == "open") {
 				out.op = operation::OP_OPEN;
-				ok = read_string(stream, out.path);
+				ok = read_string(stream, scratch, storage, out.path);
 				if (ok)
 					ok = !!(stream >> out.flags);
 				if (ok)
 					ok = !!(stream >> out.file_handle_id);
 			} else if (op == "write") {
 				out.op = operation::OP_WRITE;
-				ok = read_string(stream, out.path);
+				ok = read_string(stream, scratch, storage, out.path);
 				if (ok)
-					ok = read_string(stream, out.data);
+					ok = read_string(stream, scratch, storage, out.data);
 				if (ok)
 					ok = !!(stream >> out.offset);
 				if (ok)
@@ -180,14 +202,14 @@ operator>>(std::istream& stream, operation& out)
 				ok = !!(stream >> out.file_handle_id);
 			} else if (op == "fsync") {
 				out.op = operation::OP_FSYNC;
-				ok = read_string(stream, out.path);
+				ok = read_string(stream, scratch, storage, out.path);
 				if (ok)
 					ok = !!(stream >> out.datasync);
 				if (ok)
 					ok = !!(stream >> out.file_handle_id);
 			} else if (op == "utimens") {
 				out.op = operation::OP_UTIMENS;
-				ok = read_string(stream, out.path);
+				ok = read_string(stream, scratch, storage, out.path);
 				if (ok)
 					ok = !!(stream >> out.utime[0].tv_sec);
 				if (ok)
@@ -216,6 +238,63 @@ operator>>(std::istream& stream, operation& out)
 	}
 }
 
+/*
+ * The inverse of read_string_literal(), escaping the same way that
+ * dsfs_record does.
+ */
+void
+write_string_literal(std::ostream& stream, std::string_view value)
+{
+	const char *hex = "0123456789abcdef";
+
+	stream << '"';
+	for (char c : value) {
+		if (c == '\\')
+			stream << "\\\\";
+		else if (c == '"')
+			stream << "\\\"";
+		else if (c == '\n')
+			stream << "\\n";
+		else if (c >= 32 && c <= 126)
+			stream << c;
+		else
+			stream << "\\x" << hex[((unsigned char) c) >> 4] << hex[c & 0xf];
+	}
+	stream << '"';
+}
+
+bool
+operation_reader::read(std::istream& stream, operation& out, arena& storage)
+{
+	return !!parse(stream, out, symbol, scratch, storage);
+}
+
+void
+operation_reader::read_batch(std::istream& stream,
+							 operation_batch& batch,
+							 std::size_t max_operations)
+{
+	operation op;
+
+	while (batch.operations.size() < max_operations) {
+		if (!read(stream, op, batch.storage)) {
+			batch.stop = true;
+			break;
+		}
+		batch.operations.push_back(op);
+	}
+}
+
+void
+operation_batch::clear()
+{
+	operations.clear();
+	storage.reset();
+	stop = false;
+	offset = -1;
+	error = nullptr;
+}
+
 std::string
 stringify(operation::op_type op)
 {
@@ -235,7 +314,7 @@ stringify(operation::op_type op)
 	case operation::OP_CHMOD:
 		return "chmod";
 	case operation::OP_CHOWN:
-		return "chmod";
+		return "chown";
 	case operation::OP_TRUNCATE:
 		return "truncate";
 	case operation::OP_FTRUNCATE:
@@ -248,9 +327,28 @@ stringify(operation::op_type op)
 		return "write";
 	case operation::OP_RELEASE:
 		return "release";
+	case operation::OP_FSYNC:
+		return "fsync";
 	case operation::OP_UTIMENS:
 		return "utimens";
 	default:
 		return "<unknown>";
 	}
 }
+
+/*
+ * The inverse of stringify(), for command line options and index files
+ * that name operation types.
+ */
+bool
+parse_op_type(const std::string& name, operation::op_type& out)
+{
+	for (int i = 0; i < operation_type_count; ++i) {
+		operation::op_type op = static_cast<operation::op_type>(i);
+		if (stringify(op) == name) {
+			out = op;
+			return true;
+		}
+	}
+	return false;
+}
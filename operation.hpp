@@ -1,7 +1,17 @@
 #ifndef DSFS_OPERATION_HPP
 #define DSFS_OPERATION_HPP
 
+#include "arena.hpp"
+
+#include <cstddef>
+#include <exception>
+#include <iosfwd>
 #include <string>
+#include <string_view>
+#include <vector>
+
+#include <sys/types.h>
+#include <time.h>
 
 /*
  * Files are referenced in the log by "handles" (these were the file
@@ -12,9 +22,14 @@ typedef int file_handle_id_t;
 /*
  * One operation that was logged by dsfs_record, has been read from
  * the log file, and is ready to be replayed.
+ *
+ * Variable-length fields point into an arena owned by whoever read the
+ * operation (usually an operation_batch), so operations are cheap to
+ * copy and never own heap memory of their own.  Only the fields used by
+ * a given op type are meaningful.
  */
 struct operation {
-	enum op_type {
+	enum op_type : unsigned char {
 		OP_MKDIR,
 		OP_UNLINK,
 		OP_RMDIR,
@@ -32,16 +47,16 @@ struct operation {
 		OP_FSYNC,
 		OP_UTIMENS
 	} op;
-	std::string path;
-	std::string path2;
-	std::string data;
 	int uid;
 	int gid;
 	int mode;
 	int flags;
+	int datasync;
 	off_t offset;
 	size_t size;
-	int datasync;
+	std::string_view path;
+	std::string_view path2;
+	std::string_view data;
 	struct timespec utime[2];
 
 	/*
@@ -53,9 +68,90 @@ struct operation {
 	file_handle_id_t file_handle_id;
 };
 
+/*
+ * The number of distinct op_type values, for tables indexed by type.
+ */
+const int operation_type_count = operation::OP_UTIMENS + 1;
+
+/*
+ * A view of a contiguous run of operations, standing in for C++20's
+ * std::span<const operation>.
+ */
+struct operation_span {
+	operation_span() : first(nullptr), count(0) {}
+	operation_span(const operation *first, std::size_t count) :
+		first(first), count(count) {}
+
+	const operation *begin() const { return first; }
+	const operation *end() const { return first + count; }
+	std::size_t size() const { return count; }
+	const operation& operator[](std::size_t i) const { return first[i]; }
+
+private:
+	const operation *first;
+	std::size_t count;
+};
+
+/*
+ * A run of consecutive operations read from a log, along with the arena
+ * that holds their strings.  If stop is set, the log ended (or couldn't
+ * be parsed) after the last of these operations.  If known, offset is
+ * the position in the log that the first of them was read from, and
+ * reading can start again from there.
+ */
+struct operation_batch {
+	operation_batch() : stop(false), offset(-1) {}
+
+	/*
+	 * Forget the contents, keeping the memory for the next batch.
+	 */
+	void clear();
+
+	std::vector<operation> operations;
+	arena storage;
+	bool stop;
+	off_t offset;
+	std::exception_ptr error;
+};
+
+/*
+ * Reads operations from a stream.  The reader holds scratch space that
+ * is reused from one record to the next.
+ */
+struct operation_reader {
+	/*
+	 * Read one operation, copying its strings into storage.  Returns
+	 * false at end of stream, or on error (in which case badbit is set
+	 * on the stream).
+	 */
+	bool read(std::istream& stream, operation& out, arena& storage);
+
+	/*
+	 * Append up to max_operations operations to a batch, setting
+	 * batch.stop if the stream is exhausted.
+	 */
+	void read_batch(std::istream& stream,
+					operation_batch& batch,
+					std::size_t max_operations);
+
+private:
+	std::string symbol;
+	std::string scratch;
+};
+
 std::string
 stringify(operation::op_type op);
 
-std::istream& operator>>(std::istream& stream, operation& out);
+bool
+parse_op_type(const std::string& name, operation::op_type& out);
+
+/*
+ * Read and write strings in the quoted and escaped form used in logs.
+ */
+bool
+read_string_literal(std::istream& stream, std::string& out);
+
+void
+write_string_literal(std::ostream& stream, std::string_view value);
 
 #endif
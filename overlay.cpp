@@ -0,0 +1,438 @@
+#include "overlay.hpp"
+#include "io_backend.hpp"
+#include "operation.hpp"
+#include "tree.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <istream>
+#include <ostream>
+#include <stdexcept>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char overlay_header[] = "dsfs-overlay 1";
+
+/*
+ * How much of each file to compare at a time.
+ */
+static const std::size_t chunk_size = 64 * 1024;
+
+static void
+fail(const std::string& what, const std::string& path)
+{
+	std::string error = std::strerror(errno);
+	throw std::runtime_error("could not " + what + " " + path + ": " + error);
+}
+
+/*
+ * The names in a directory, in order.
+ */
+static std::vector<std::string>
+sorted_names(const std::string& path)
+{
+	int fd = ::open(path.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+	std::vector<std::string> names;
+
+	if (fd < 0)
+		fail("open directory", path);
+	try {
+		names = list_directory(fd, path);
+	} catch (...) {
+		::close(fd);
+		throw;
+	}
+	::close(fd);
+	std::sort(names.begin(), names.end());
+
+	return names;
+}
+
+static std::string
+read_symlink(const std::string& path, const struct stat& stat_data)
+{
+	std::string contents(stat_data.st_size + 1, '\0');
+	ssize_t size = ::readlink(path.c_str(), &contents[0], contents.size());
+
+	if (size < 0)
+		fail("read symlink", path);
+	contents.resize(size);
+	return contents;
+}
+
+static void
+write_change(std::ostream& out, const char *word, const std::string& path)
+{
+	out << word << " ";
+	write_string_literal(out, path);
+}
+
+/*
+ * Extents are written raw after their line, since escaping binary data
+ * would make it bigger than the image it came from.
+ */
+static void
+write_extent(std::ostream& out, off_t offset, const std::string& data)
+{
+	out << "extent " << offset << " " << data.size() << "\n";
+	out.write(data.data(), data.size());
+	out << "\n";
+}
+
+/*
+ * Describe how the file at image differs from the one at base, which is
+ * empty if there isn't one.  Nothing is written if they're the same.
+ */
+static void
+diff_file(const std::string& base,
+		  const struct stat *base_stat,
+		  const std::string& image,
+		  const struct stat& image_stat,
+		  const std::string& path,
+		  std::ostream& out)
+{
+	off_t size = image_stat.st_size;
+	bool changed = !base_stat || base_stat->st_size != size ||
+		(base_stat->st_mode & 07777) != (image_stat.st_mode & 07777);
+	bool written = false;
+	std::vector<char> image_data(chunk_size);
+	std::vector<char> base_data(chunk_size);
+	int image_fd;
+	int base_fd = -1;
+
+	image_fd = ::open(image.c_str(), O_RDONLY | O_NOFOLLOW);
+	if (image_fd < 0)
+		fail("open", image);
+	if (base_stat) {
+		base_fd = ::open(base.c_str(), O_RDONLY | O_NOFOLLOW);
+		if (base_fd < 0) {
+			int error = errno;
+			::close(image_fd);
+			errno = error;
+			fail("open", base);
+		}
+	}
+
+	// The header only goes out once we know there's something to say.
+	auto header = [&]() {
+		if (written)
+			return;
+		write_change(out, "file", path);
+		out << " " << (image_stat.st_mode & 07777) << " " << size << "\n";
+		written = true;
+	};
+
+	try {
+		// An extent is written out when the run of differing blocks it
+		// belongs to ends.
+		off_t extent_begin = 0;
+		std::string extent;
+
+		for (off_t offset = 0; offset < size; offset += chunk_size) {
+			std::size_t image_size = read_all(image_fd, image_data.data(),
+											  chunk_size, offset);
+			std::size_t base_size = 0;
+
+			if (base_fd >= 0)
+				base_size = read_all(base_fd, base_data.data(), chunk_size, offset);
+			// Past the end of the base, extending it gives zeroes.
+			std::memset(base_data.data() + base_size, 0, chunk_size - base_size);
+
+			for (std::size_t block = 0; block < image_size; block += overlay_block) {
+				std::size_t length = std::min(overlay_block, image_size - block);
+
+				if (std::memcmp(image_data.data() + block,
+								base_data.data() + block,
+								length) == 0)
+					continue;
+				if (!extent.empty() &&
+					extent_begin + off_t(extent.size()) != offset + off_t(block)) {
+					header();
+					write_extent(out, extent_begin, extent);
+					extent.clear();
+				}
+				if (extent.empty())
+					extent_begin = offset + block;
+				extent.append(image_data.data() + block, length);
+			}
+			if (image_size < chunk_size)
+				break;
+		}
+		if (!extent.empty()) {
+			header();
+			write_extent(out, extent_begin, extent);
+		}
+		if (changed)
+			header();
+	} catch (...) {
+		::close(image_fd);
+		if (base_fd >= 0)
+			::close(base_fd);
+		throw;
+	}
+	::close(image_fd);
+	if (base_fd >= 0)
+		::close(base_fd);
+}
+
+/*
+ * Describe how the directory at image differs from the one at base,
+ * which is empty if there isn't one.
+ */
+static void
+diff_directory(const std::string& base,
+			   const std::string& image,
+			   const std::string& path,
+			   std::ostream& out)
+{
+	std::vector<std::string> image_names = sorted_names(image);
+	std::vector<std::string> base_names;
+
+	if (!base.empty())
+		base_names = sorted_names(base);
+
+	for (const std::string& name : base_names) {
+		if (!std::binary_search(image_names.begin(), image_names.end(), name)) {
+			write_change(out, "remove", path == "/" ? "/" + name : path + "/" + name);
+			out << "\n";
+		}
+	}
+
+	for (const std::string& name : image_names) {
+		std::string child = path == "/" ? "/" + name : path + "/" + name;
+		std::string image_child = image + "/" + name;
+		std::string base_child;
+		struct stat image_stat;
+		struct stat base_stat;
+		bool in_base = false;
+
+		if (::lstat(image_child.c_str(), &image_stat) < 0)
+			fail("stat", image_child);
+		if (std::binary_search(base_names.begin(), base_names.end(), name)) {
+			base_child = base + "/" + name;
+			if (::lstat(base_child.c_str(), &base_stat) < 0)
+				fail("stat", base_child);
+			in_base = true;
+
+			// Something of a different type is in the way.
+			if ((base_stat.st_mode & S_IFMT) != (image_stat.st_mode & S_IFMT)) {
+				write_change(out, "remove", child);
+				out << "\n";
+				in_base = false;
+				base_child.clear();
+			}
+		}
+
+		if (S_ISDIR(image_stat.st_mode)) {
+			if (!in_base) {
+				write_change(out, "mkdir", child);
+				out << " " << (image_stat.st_mode & 07777) << "\n";
+			} else if ((base_stat.st_mode & 07777) != (image_stat.st_mode & 07777)) {
+				write_change(out, "chmod", child);
+				out << " " << (image_stat.st_mode & 07777) << "\n";
+			}
+			diff_directory(base_child, image_child, child, out);
+		} else if (S_ISREG(image_stat.st_mode)) {
+			diff_file(base_child, in_base ? &base_stat : nullptr,
+					  image_child, image_stat, child, out);
+		} else if (S_ISLNK(image_stat.st_mode)) {
+			std::string contents = read_symlink(image_child, image_stat);
+
+			if (in_base && read_symlink(base_child, base_stat) == contents)
+				continue;
+			if (in_base) {
+				write_change(out, "remove", child);
+				out << "\n";
+			}
+			write_change(out, "symlink", child);
+			out << " ";
+			write_string_literal(out, contents);
+			out << "\n";
+		} else {
+			throw std::runtime_error("unsupported file type at " + image_child);
+		}
+	}
+}
+
+void
+write_overlay(const std::string& base, const std::string& image, std::ostream& out)
+{
+	out << overlay_header << "\n";
+	diff_directory(base, image, "/", out);
+}
+
+/*
+ * Overlay paths must stay inside the tree they're applied to.
+ */
+static bool
+safe_path(const std::string& path)
+{
+	if (path.size() < 2 || path[0] != '/')
+		return false;
+	for (std::size_t begin = 1; begin <= path.size();) {
+		std::size_t end = std::min(path.find('/', begin), path.size());
+		std::string component = path.substr(begin, end - begin);
+
+		if (component.empty() || component == "." || component == "..")
+			return false;
+		begin = end + 1;
+	}
+	return true;
+}
+
+/*
+ * Give the file at path a link of its own, so that changing it doesn't
+ * change the other names it has in the base.
+ */
+static void
+break_link(const std::string& path, const struct stat& stat_data)
+{
+	std::string temporary = path + ".dsfs-overlay";
+	std::vector<char> data(chunk_size);
+	int from = ::open(path.c_str(), O_RDONLY | O_NOFOLLOW);
+	int to;
+
+	if (from < 0)
+		fail("open", path);
+	to = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_EXCL, stat_data.st_mode & 07777);
+	if (to < 0) {
+		int error = errno;
+		::close(from);
+		errno = error;
+		fail("create", temporary);
+	}
+	try {
+		std::size_t size;
+
+		for (off_t offset = 0;
+			 (size = read_all(from, data.data(), data.size(), offset)) > 0;
+			 offset += size)
+			write_all(to, data.data(), size, offset);
+	} catch (...) {
+		::close(from);
+		::close(to);
+		throw;
+	}
+	::close(from);
+	if (::close(to) < 0)
+		fail("write", temporary);
+	if (::rename(temporary.c_str(), path.c_str()) < 0)
+		fail("rename", temporary);
+}
+
+void
+apply_overlay(std::istream& in, const std::string& path)
+{
+	std::string line;
+	std::string word;
+	int fd = -1;
+
+	if (!std::getline(in, line) || line != overlay_header)
+		throw std::runtime_error("not an overlay");
+
+	try {
+		while (in >> word) {
+			std::string name;
+			std::string data;
+			std::string full;
+			mode_t mode;
+			off_t offset;
+
+			if (word == "extent") {
+				std::size_t size;
+
+				if (fd < 0 || !(in >> offset >> size) || in.get() != '\n')
+					throw std::runtime_error("bad extent in overlay");
+				data.resize(size);
+				if (!in.read(&data[0], size) || in.get() != '\n')
+					throw std::runtime_error("truncated extent in overlay");
+				write_all(fd, data.data(), data.size(), offset);
+				continue;
+			}
+
+			if (fd >= 0) {
+				if (::close(fd) < 0)
+					fail("write", full);
+				fd = -1;
+			}
+			if (!read_string_literal(in, name) || !safe_path(name))
+				throw std::runtime_error("bad path in overlay");
+			full = path + name;
+
+			if (word == "remove") {
+				remove_tree(full);
+			} else if (word == "mkdir") {
+				if (!(in >> mode))
+					throw std::runtime_error("bad mkdir in overlay");
+				if (::mkdir(full.c_str(), 0700) < 0 || ::chmod(full.c_str(), mode) < 0)
+					fail("create directory", full);
+			} else if (word == "chmod") {
+				if (!(in >> mode))
+					throw std::runtime_error("bad chmod in overlay");
+				if (::chmod(full.c_str(), mode) < 0)
+					fail("change mode of", full);
+			} else if (word == "symlink") {
+				if (!read_string_literal(in, data))
+					throw std::runtime_error("bad symlink in overlay");
+				if (::symlink(data.c_str(), full.c_str()) < 0)
+					fail("create symlink", full);
+			} else if (word == "file") {
+				struct stat stat_data;
+
+				if (!(in >> mode >> offset))
+					throw std::runtime_error("bad file in overlay");
+				if (::lstat(full.c_str(), &stat_data) == 0 && stat_data.st_nlink > 1)
+					break_link(full, stat_data);
+				fd = ::open(full.c_str(), O_WRONLY | O_CREAT | O_NOFOLLOW, 0600);
+				if (fd < 0)
+					fail("open", full);
+				if (::fchmod(fd, mode) < 0 || ::ftruncate(fd, offset) < 0)
+					fail("resize", full);
+			} else {
+				throw std::runtime_error("unknown change \"" + word + "\" in overlay");
+			}
+		}
+		if (!in.eof())
+			throw std::runtime_error("bad overlay");
+	} catch (...) {
+		if (fd >= 0)
+			::close(fd);
+		throw;
+	}
+	if (fd >= 0 && ::close(fd) < 0)
+		fail("write", path);
+}
+
+void
+replace_with_overlay(const std::string& base, const std::string& path)
+{
+	std::string temporary = path + ".overlay";
+	std::ofstream out(temporary, std::ios_base::binary);
+
+	if (!out)
+		throw std::runtime_error("could not create " + temporary);
+	write_overlay(base, path, out);
+	if (!out.flush())
+		throw std::runtime_error("could not write " + temporary);
+	out.close();
+	remove_tree(path);
+	if (::rename(temporary.c_str(), path.c_str()) < 0)
+		fail("rename", temporary);
+}
+
+std::string
+overlay_base_tree(const std::string& path)
+{
+	struct stat stat_data;
+
+	if (::stat((path + "/state").c_str(), &stat_data) == 0 &&
+		::stat((path + "/tree").c_str(), &stat_data) == 0 &&
+		S_ISDIR(stat_data.st_mode))
+		return path + "/tree";
+	return path;
+}
@@ -0,0 +1,48 @@
+#ifndef OVERLAY_HPP
+#define OVERLAY_HPP
+
+#include <cstddef>
+#include <iosfwd>
+#include <string>
+
+/*
+ * An overlay describes a crash image as the changes that turn a base
+ * image into it: names removed, directories and symlinks created, and for
+ * each regular file that's new or different, its permissions, its size
+ * and the extents of its contents that differ from the base, compared
+ * overlay_block bytes at a time.  Blocks of zeroes past the end of the
+ * base file are left out, since extending the file provides them.  The
+ * format is text, one change per line, with paths quoted and escaped
+ * as in logs, except that each extent's data follows its line raw.
+ * Timestamps, ownership and hard links aren't kept.
+ */
+static const std::size_t overlay_block = 512;
+
+/*
+ * Write an overlay that turns the tree at base into the tree at image.
+ */
+void
+write_overlay(const std::string& base, const std::string& image, std::ostream& out);
+
+/*
+ * Apply an overlay to the tree at path, which should hold a copy of the
+ * overlay's base.  Throws if the overlay is malformed or doesn't fit.
+ */
+void
+apply_overlay(std::istream& in, const std::string& path);
+
+/*
+ * Replace the image directory at path with an overlay file of the same
+ * name, relative to base.
+ */
+void
+replace_with_overlay(const std::string& base, const std::string& path);
+
+/*
+ * The tree that --overlay-base PATH means: the tree inside a checkpoint
+ * if PATH is one, and otherwise PATH itself.
+ */
+std::string
+overlay_base_tree(const std::string& path);
+
+#endif
@@ -0,0 +1,215 @@
+#include "parallel_parser.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <istream>
+#include <limits>
+#include <stdexcept>
+#include <streambuf>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * Like pread(), but with retry and exceptions.  Returns less than size
+ * only at end of file.
+ */
+static std::size_t
+read_all(int fd, char *data, std::size_t size, off_t offset)
+{
+	std::size_t read_so_far = 0;
+
+	while (read_so_far < size) {
+		ssize_t read = ::pread(fd,
+							   data + read_so_far,
+							   size - read_so_far,
+							   offset + read_so_far);
+		if (read < 0) {
+			std::string error = std::strerror(errno);
+			throw std::runtime_error("could not read log: " + error);
+		} else if (read == 0) {
+			break;
+		}
+		read_so_far += read;
+	}
+
+	return read_so_far;
+}
+
+/*
+ * An input stream buffer over a range of memory we already hold, so
+ * that we can reuse the stream parsing code in operation.cpp.
+ */
+struct memory_buffer : std::streambuf {
+	memory_buffer(char *begin, char *end) { setg(begin, begin, end); }
+};
+
+parallel_parser::parallel_parser(const std::string& path,
+								 off_t begin,
+								 int threads,
+								 std::size_t chunk_size) :
+	begin(begin),
+	chunk_size(chunk_size),
+	next_chunk(0),
+	next_delivery(0),
+	finished(false),
+	shutting_down(false)
+{
+	struct stat stat_data;
+
+	if (threads < 1)
+		throw std::runtime_error("need at least one parser thread");
+
+	fd = ::open(path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		std::string error = std::strerror(errno);
+		throw std::runtime_error("could not open log " + path + ": " + error);
+	}
+	if (::fstat(fd, &stat_data) < 0) {
+		std::string error = std::strerror(errno);
+		::close(fd);
+		throw std::runtime_error("could not stat log " + path + ": " + error);
+	}
+	end = std::max(begin, off_t(stat_data.st_size));
+	chunks = (end - begin + chunk_size - 1) / chunk_size;
+
+	// Let workers run a couple of chunks each ahead of the consumer.
+	window = threads * 2;
+
+	for (int i = 0; i < threads; ++i)
+		workers.emplace_back(&parallel_parser::work, this);
+}
+
+parallel_parser::~parallel_parser()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		shutting_down = true;
+	}
+	work_ready.notify_all();
+	for (auto& worker : workers)
+		worker.join();
+	::close(fd);
+}
+
+/*
+ * Find the first record boundary at or after a given position, where a
+ * boundary is the start of the region we were asked to parse, or any
+ * position immediately after a newline.
+ */
+off_t
+parallel_parser::find_boundary(off_t position, std::vector<char>& scratch)
+{
+	if (position <= begin)
+		return begin;
+
+	scratch.resize(64 * 1024);
+	while (position < end) {
+		std::size_t size = read_all(fd, scratch.data(), scratch.size(),
+									position - 1);
+		if (size == 0)
+			break;
+		auto newline = std::find(scratch.begin(), scratch.begin() + size, '\n');
+		if (newline != scratch.begin() + size)
+			return position + (newline - scratch.begin());
+		position += size;
+	}
+
+	return end;
+}
+
+void
+parallel_parser::parse_chunk(std::size_t chunk, operation_batch& batch)
+{
+	std::vector<char> buffer;
+	off_t nominal_begin = begin + chunk * chunk_size;
+	off_t chunk_begin = find_boundary(nominal_begin, buffer);
+	off_t chunk_end = find_boundary(nominal_begin + chunk_size, buffer);
+	operation_reader reader;
+
+	if (chunk_end <= chunk_begin)
+		return;
+
+	buffer.resize(chunk_end - chunk_begin);
+	buffer.resize(read_all(fd, buffer.data(), buffer.size(), chunk_begin));
+
+	batch.offset = chunk_begin;
+	memory_buffer memory(buffer.data(), buffer.data() + buffer.size());
+	std::istream stream(&memory);
+	reader.read_batch(stream, batch, std::numeric_limits<std::size_t>::max());
+
+	// Running out of input at the end of the chunk is expected.  Anything
+	// else means the serial parser would have stopped here.
+	batch.stop = stream.bad() || !stream.eof();
+}
+
+void
+parallel_parser::work()
+{
+	for (;;) {
+		operation_batch batch;
+		std::size_t chunk;
+
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			work_ready.wait(lock, [&]() {
+				return shutting_down ||
+					next_chunk >= chunks ||
+					next_chunk < next_delivery + window;
+			});
+			if (shutting_down || next_chunk >= chunks)
+				return;
+			chunk = next_chunk++;
+			if (!recycled.empty()) {
+				batch = std::move(recycled.back());
+				recycled.pop_back();
+			}
+		}
+
+		try {
+			parse_chunk(chunk, batch);
+		} catch (...) {
+			batch.error = std::current_exception();
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			parsed[chunk] = std::move(batch);
+		}
+		batch_ready.notify_all();
+	}
+}
+
+bool
+parallel_parser::next(operation_batch& batch)
+{
+	std::unique_lock<std::mutex> lock(mutex);
+
+	// Give the caller's old batch back to the workers.
+	batch.clear();
+	recycled.push_back(std::move(batch));
+	batch.clear();
+
+	if (finished || next_delivery >= chunks)
+		return false;
+
+	batch_ready.wait(lock, [&]() {
+		return parsed.count(next_delivery) > 0;
+	});
+	auto it = parsed.find(next_delivery);
+	batch = std::move(it->second);
+	parsed.erase(it);
+	++next_delivery;
+	lock.unlock();
+	work_ready.notify_all();
+
+	if (batch.error) {
+		finished = true;
+		std::rethrow_exception(batch.error);
+	}
+	if (batch.stop)
+		finished = true;
+
+	return true;
+}
@@ -0,0 +1,66 @@
+#ifndef PARALLEL_PARSER_HPP
+#define PARALLEL_PARSER_HPP
+
+#include "operation.hpp"
+
+#include <condition_variable>
+#include <cstddef>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/types.h>
+
+/*
+ * Parses a log file on several threads at once.  The file is cut into
+ * chunks that begin and end at record boundaries (records are one per
+ * line, since dsfs_record escapes newlines in strings), each chunk is
+ * parsed into a batch by whichever worker gets to it first, and the
+ * batches are handed back to the caller strictly in log order.
+ *
+ * Workers only run a bounded distance ahead of the caller, so memory
+ * use doesn't depend on the size of the log.  If a batch has stop set,
+ * the serial parser would have given up after its last operation, so no
+ * more batches follow.
+ */
+struct parallel_parser {
+	parallel_parser(const std::string& path,
+					off_t begin,
+					int threads,
+					std::size_t chunk_size = 4 * 1024 * 1024);
+	~parallel_parser();
+
+	/*
+	 * Get the next batch in log order, returning false at the end of
+	 * the log.  The batch passed in is recycled.  Throws
+	 * if a worker couldn't read the file.
+	 */
+	bool next(operation_batch& batch);
+
+private:
+	void work();
+	void parse_chunk(std::size_t chunk, operation_batch& batch);
+	off_t find_boundary(off_t position, std::vector<char>& scratch);
+
+	int fd;
+	off_t begin;
+	off_t end;
+	std::size_t chunk_size;
+	std::size_t chunks;
+	std::size_t window;
+
+	std::mutex mutex;
+	std::condition_variable work_ready;
+	std::condition_variable batch_ready;
+	std::size_t next_chunk;
+	std::size_t next_delivery;
+	bool finished;
+	bool shutting_down;
+	std::map<std::size_t, operation_batch> parsed;
+	std::vector<operation_batch> recycled;
+	std::vector<std::thread> workers;
+};
+
+#endif
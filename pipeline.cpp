@@ -0,0 +1,72 @@
+#include "pipeline.hpp"
+
+batch_prefetcher::batch_prefetcher(source_type source, std::size_t depth) :
+	source(std::move(source)),
+	full(depth),
+	empty(depth + 1),
+	shutting_down(false),
+	finished(false),
+	worker(&batch_prefetcher::work, this)
+{
+}
+
+batch_prefetcher::~batch_prefetcher()
+{
+	shutting_down.store(true);
+	worker.join();
+}
+
+void
+batch_prefetcher::work()
+{
+	for (;;) {
+		operation_batch batch;
+		bool more;
+
+		empty.try_pop(batch);
+		batch.clear();
+		try {
+			more = source(batch);
+		} catch (...) {
+			batch.error = std::current_exception();
+			more = false;
+		}
+
+		// An empty batch with stop set marks the end.
+		if (!more) {
+			batch.operations.clear();
+			batch.stop = true;
+		}
+
+		for (int attempt = 0; !full.try_push(std::move(batch)); ++attempt) {
+			if (shutting_down.load())
+				return;
+			full.backoff(attempt);
+		}
+
+		if (!more)
+			return;
+	}
+}
+
+bool
+batch_prefetcher::next(operation_batch& batch)
+{
+	if (finished)
+		return false;
+
+	empty.try_push(std::move(batch));
+	batch = operation_batch();
+	full.pop(batch);
+
+	if (batch.error) {
+		finished = true;
+		std::rethrow_exception(batch.error);
+	}
+	if (batch.operations.empty() && batch.stop) {
+		finished = true;
+		return false;
+	}
+
+	return true;
+}
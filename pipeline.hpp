@@ -0,0 +1,40 @@
+#ifndef PIPELINE_HPP
+#define PIPELINE_HPP
+
+#include "operation.hpp"
+#include "spsc_queue.hpp"
+
+#include <cstddef>
+#include <functional>
+#include <thread>
+
+/*
+ * Runs a source of operation batches on its own thread, so that parsing
+ * carries on while earlier batches are being replayed.  Batches come out
+ * in the order the source produced them, and are recycled back to the
+ * source thread once the consumer asks for the next one.
+ */
+struct batch_prefetcher {
+	typedef std::function<bool(operation_batch&)> source_type;
+
+	batch_prefetcher(source_type source, std::size_t depth = 8);
+	~batch_prefetcher();
+
+	/*
+	 * Same contract as the source: fill in the next batch, or return
+	 * false at the end.  Rethrows anything the source threw.
+	 */
+	bool next(operation_batch& batch);
+
+private:
+	void work();
+
+	source_type source;
+	spsc_queue<operation_batch> full;
+	spsc_queue<operation_batch> empty;
+	std::atomic<bool> shutting_down;
+	bool finished;
+	std::thread worker;
+};
+
+#endif
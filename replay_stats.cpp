@@ -0,0 +1,84 @@
+#include "replay_stats.hpp"
+
+#include <iomanip>
+#include <ostream>
+
+replay_stats::replay_stats() :
+	operations(),
+	operation_time(),
+	peak_buffered_bytes(0),
+	peak_spilled_bytes(0),
+	parse_time(0),
+	apply_time(0),
+	image_time(0),
+	total_time(0)
+{
+}
+
+static double
+seconds(replay_stats::clock::duration time)
+{
+	return std::chrono::duration<double>(time).count();
+}
+
+void
+print_stats(std::ostream& out, const replay_stats& stats)
+{
+	out << std::fixed << std::setprecision(6);
+	for (int i = 0; i < operation_type_count; ++i) {
+		if (stats.operations[i] == 0)
+			continue;
+		out << "op " << stringify(operation::op_type(i)) << " "
+			<< stats.operations[i] << " " << seconds(stats.operation_time[i])
+			<< "\n";
+	}
+	out << "bytes-written-through " << stats.sectors.bytes_written_through << "\n"
+		<< "bytes-buffered " << stats.sectors.bytes_buffered << "\n"
+		<< "sectors-flushed " << stats.sectors.sectors_flushed << "\n"
+		<< "sectors-lost " << stats.sectors.sectors_lost << "\n";
+	for (const replay_stats::loss& loss : stats.losses)
+		out << "lost inode " << loss.inode << " " << loss.sectors << "\n";
+	out << "peak-buffered-bytes " << stats.peak_buffered_bytes << "\n"
+		<< "peak-spilled-bytes " << stats.peak_spilled_bytes << "\n"
+		<< "parse-seconds " << seconds(stats.parse_time) << "\n"
+		<< "apply-seconds " << seconds(stats.apply_time) << "\n"
+		<< "image-seconds " << seconds(stats.image_time) << "\n"
+		<< "total-seconds " << seconds(stats.total_time) << "\n";
+}
+
+void
+print_stats_json(std::ostream& out, const replay_stats& stats)
+{
+	const char *separator = "";
+
+	out << std::fixed << std::setprecision(6) << "{\n  \"operations\": {";
+	for (int i = 0; i < operation_type_count; ++i) {
+		if (stats.operations[i] == 0)
+			continue;
+		out << separator << "\n    \"" << stringify(operation::op_type(i))
+			<< "\": { \"count\": " << stats.operations[i]
+			<< ", \"seconds\": " << seconds(stats.operation_time[i]) << " }";
+		separator = ",";
+	}
+	out << "\n  },\n"
+		<< "  \"bytes_written_through\": " << stats.sectors.bytes_written_through
+		<< ",\n"
+		<< "  \"bytes_buffered\": " << stats.sectors.bytes_buffered << ",\n"
+		<< "  \"sectors_flushed\": " << stats.sectors.sectors_flushed << ",\n"
+		<< "  \"sectors_lost\": " << stats.sectors.sectors_lost << ",\n"
+		<< "  \"losses\": [";
+	separator = "";
+	for (const replay_stats::loss& loss : stats.losses) {
+		out << separator << "\n    { \"inode\": " << loss.inode
+			<< ", \"sectors\": " << loss.sectors << " }";
+		separator = ",";
+	}
+	out << "\n  ],\n"
+		<< "  \"peak_buffered_bytes\": " << stats.peak_buffered_bytes << ",\n"
+		<< "  \"peak_spilled_bytes\": " << stats.peak_spilled_bytes << ",\n"
+		<< "  \"parse_seconds\": " << seconds(stats.parse_time) << ",\n"
+		<< "  \"apply_seconds\": " << seconds(stats.apply_time) << ",\n"
+		<< "  \"image_seconds\": " << seconds(stats.image_time) << ",\n"
+		<< "  \"total_seconds\": " << seconds(stats.total_time) << "\n"
+		<< "}\n";
+}
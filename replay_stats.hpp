@@ -0,0 +1,61 @@
+#ifndef REPLAY_STATS_HPP
+#define REPLAY_STATS_HPP
+
+#include "file.hpp"
+#include "operation.hpp"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <iosfwd>
+#include <vector>
+
+#include <sys/types.h>
+
+/*
+ * What a replay did and where its time went, for dsfs_replay --stats.
+ * The replayer counts operations, and times them if asked to; its files
+ * keep the sector counters; the caller fills in the time spent waiting
+ * for the log and taking images.
+ */
+struct replay_stats {
+	typedef std::chrono::steady_clock clock;
+
+	replay_stats();
+
+	std::uint64_t operations[operation_type_count];
+	clock::duration operation_time[operation_type_count];
+
+	file_counters sectors;
+
+	/*
+	 * The sectors each file forgot when power was lost, by inode number.
+	 */
+	struct loss {
+		ino_t inode;
+		std::uint64_t sectors;
+	};
+	std::vector<loss> losses;
+
+	/*
+	 * The most bytes of sector slots in use at once, in memory (waiting
+	 * for fsync, or cached) and spilled to the shadow file.
+	 */
+	std::size_t peak_buffered_bytes;
+	std::size_t peak_spilled_bytes;
+
+	clock::duration parse_time;
+	clock::duration apply_time;
+	clock::duration image_time;
+	clock::duration total_time;
+};
+
+/*
+ * One line per figure, or one JSON object.
+ */
+void
+print_stats(std::ostream& out, const replay_stats& stats);
+void
+print_stats_json(std::ostream& out, const replay_stats& stats);
+
+#endif
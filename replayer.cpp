@@ -1,118 +1,152 @@
 #include "replayer.hpp"
+#include "tree.hpp"
 
-#include <cassert>
+#include <algorithm>
+#include <cstdlib>
 #include <cstring>
+#include <fstream>
+#include <iostream>
 #include <stdexcept>
 
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
-/*
- * Compute the parent directory.
- */
-static void
-get_parent(std::string& parent, const std::string& path)
+replayer::replayer(std::unique_ptr<target> tree,
+				   off_t sector_size,
+				   file_writeback_mode file_mode,
+				   std::uint64_t seed,
+				   directory_writeback_mode directory_mode) :
+	tree(std::move(tree)),
+	sector_size(sector_size),
+	file_mode(file_mode),
+	seed(seed),
+	directory_mode(directory_mode),
+	next_file_id(0),
+	sectors(sector_size),
+	pins(*this->tree),
+	replayed(0),
+	timing(false)
 {
-	if (path[0] != '/')
-		throw std::runtime_error("get_parent -- unexpected relative path " + path);
-	parent = path;
-	while (parent.size() > 0 && parent[parent.size() - 1] != '/')
-		parent.resize(parent.size() - 1);
 }
 
-#include <iostream>
-/*
- * Given a remapped path, get the inode number so that we can look it
- * up in our inode table.
- */
-static ino_t
-get_inode_number(const std::string& path)
+replayer::~replayer()
 {
-	struct stat stat_data;
-	int fd;
-	int rc;
-
-	fd = ::open(path.c_str(), O_RDONLY);
-	if (fd < 0) {
-		std::string error = std::strerror(errno);
-		throw std::runtime_error("could not open directory " + path + ": " + error);
-	}
-	rc = ::fstat(fd, &stat_data);
-	if (rc < 0) {
-		std::string error = std::strerror(errno);
-		::close(fd);
-		throw std::runtime_error("could not stat directory " + path + ": " + error);
+	// Let queued writes finish before we close their fds.  There's
+	// nobody to report errors to at this point.
+	try {
+		tree->io().drain();
+	} catch (...) {
 	}
-	::close(fd);
-
-	return stat_data.st_ino;
-}
-
-replayer::replayer(const std::string& target_path,
-				   off_t sector_size,
-				   file_writeback_mode file_mode) :
-	target_path(target_path),
-	sector_size(sector_size),
-	file_mode(file_mode)
-{
+	close_all();
 }
 
+/*
+ * Close every file handle and cached file descriptor.
+ */
 void
-replayer::remap(std::string& remapped, const std::string& path)
+replayer::close_all()
 {
-	remapped = target_path;
-	assert(path[0] == '/');
-	remapped.append(path);
+	for (auto& fh : file_handle_table) {
+		if (fh.fd != -1)
+			tree->close(fh.fd);
+	}
+	file_handle_table.clear();
+	open_files.clear([this](const file_handlex& fh) { tree->close(fh.fd); });
 }
 
-void
-replayer::open_file_handle(const std::string& path,
-						   int file_handle_id,
-						   int fd)
+/*
+ * Find the file object for an open file descriptor in the target
+ * directory, creating it if we haven't seen it before.  If the caller
+ * knows that the inode was only just created, any object we have is
+ * left over from an earlier file that had the same inode number before
+ * it was unlinked, so we start again.
+ */
+file *
+replayer::lookup_file(std::string_view path, int fd, bool fresh)
 {
 	struct stat stat_data;
-	bool is_dir;
 
 	// Get the inode number and type in the target directory.
-	int rc = fstat(fd, &stat_data);
+	int rc = tree->fstat(fd, &stat_data);
 	if (rc < 0)
-		throw std::runtime_error("could not stat file " + path);
+		throw std::runtime_error("could not stat file " + std::string(path));
 
 	// What kind of inode is this?
 	if (S_ISDIR(stat_data.st_mode)) {
-		is_dir = true;
-	} else if (S_ISREG(stat_data.st_mode)) {
-		is_dir = false;
+		throw std::runtime_error("unsupported: log opens directory");
 	} else if (S_ISLNK(stat_data.st_mode)) {
 		throw std::runtime_error("unsupported: log opens symlink directly");
-	} else {
+	} else if (!S_ISREG(stat_data.st_mode)) {
 		throw std::runtime_error("unsupported: log opens unsupported file type");
 	}
 
-	// Look up our inode object, and create it if needed
-	std::unique_ptr<inode>& inode = inode_table[stat_data.st_ino];
+	// Look up our file object, and create it if needed.  A directory
+	// object must be left over from an earlier directory.
+	inode_ref& ref = inode_table[stat_data.st_ino];
 
-	if (!inode) {
-		if (is_dir)
-			inode = std::make_unique<directory>(path);
-		else
-			inode = std::make_unique<file>(sector_size, file_mode);
+	if ((ref.file && fresh) || ref.directory)
+		forget_inode(stat_data.st_ino);
+	else if (fresh && hasher)
+		hasher->forget(stat_data.st_ino);
+	if (!ref.file) {
+		ref.slot = files.make(sectors,
+							  file_mode,
+							  tree->io(),
+							  seed,
+							  next_file_id++,
+							  stats.sectors);
+		ref.file = &files[ref.slot];
+		if (hasher)
+			ref.file->track_changes();
 	}
 
-	// Sanity check that the inode hasn't changed type underneath us
-	if (is_dir)
-		assert(dynamic_cast<directory *>(inode.get()));
-	else
-		assert(dynamic_cast<file *>(inode.get()));
+	return ref.file;
+}
+
+/*
+ * Destroy whatever we know about an inode number, which has been reused.
+ * Its entry in the table is left empty.
+ */
+void
+replayer::forget_inode(ino_t inode_number)
+{
+	auto found = inode_table.find(inode_number);
+
+	if (hasher)
+		hasher->forget(inode_number);
+	if (found == inode_table.end())
+		return;
+	inode_ref& ref = found->second;
+	if (ref.file)
+		files.destroy(ref.slot);
+	else if (ref.directory)
+		directories.destroy(ref.slot);
+	ref = inode_ref{};
+}
+
+void
+replayer::limit_buffering(std::size_t bytes, const std::string& spill_dir)
+{
+	sectors.limit(bytes, spill_dir);
+}
+
+void
+replayer::open_file_handle(std::string_view path,
+						   int file_handle_id,
+						   int fd,
+						   bool fresh)
+{
+	file *file = lookup_file(path, fd, fresh);
 
 	// Record that we have this file_handle_id open
 	if (file_handle_table.size() < std::size_t(file_handle_id) + 1)
 		file_handle_table.resize(std::size_t(file_handle_id) + 1);
-	if (file_handle_table[file_handle_id].inode)
+	if (file_handle_table[file_handle_id].file)
 		throw std::runtime_error("log opens the same file handle ID twice");
-	file_handle_table[file_handle_id] = file_handlex(fd, inode.get());
+	file_handle_table[file_handle_id] = file_handlex(fd, file);
 }
 
 void
@@ -125,7 +159,8 @@ replayer::close_file_handle(int file_handle_id)
 		throw std::runtime_error("log closes unknown file handle ID");
 
 	// This file handle table slot is now empty
-	file_handle_table[file_handle_id].inode = NULL;
+	tree->close(file_handle_table[file_handle_id].fd);
+	file_handle_table[file_handle_id].file = NULL;
 	file_handle_table[file_handle_id].fd = -1;
 }
 
@@ -140,36 +175,592 @@ replayer::get_file_handle(const operation& op)
 			throw std::runtime_error("log references unknown file handle ID");
 		return file_handle_table[op.file_handle_id];
 	} else {
-		// We have to open a temporary fd, and then somehow close it
-		// later...
-		throw std::runtime_error("XXX -- unimplemented -- open temporary");
+		// The log only gave us a path.
+		return get_file_by_path(op.path);
 	}
 }
 
+/*
+ * Get a file handle for a path, reusing a recently opened one if we
+ * can.  These are closed when they fall out of the cache, or when the
+ * path is unlinked or renamed.
+ */
+const file_handlex&
+replayer::get_file_by_path(std::string_view path)
+{
+	if (const file_handlex *fh = open_files.find(path))
+		return *fh;
+
+	int fd = tree->open(path, O_RDWR);
+	if (fd < 0) {
+		std::string error = std::strerror(errno);
+		throw std::runtime_error("could not open file " + std::string(path) +
+								 ": " + error);
+	}
+
+	file_handlex evicted;
+	try {
+		if (open_files.insert(path, file_handlex(fd, lookup_file(path, fd, false)), evicted)) {
+			tree->io().drain();
+			tree->close(evicted.fd);
+		}
+	} catch (...) {
+		tree->close(fd);
+		throw;
+	}
+
+	return *open_files.find(path);
+}
+
+/*
+ * Forget cached file descriptors for a path that has been unlinked or
+ * renamed away, and with prefix set, anything beneath it.
+ */
+void
+replayer::forget_path(std::string_view path, bool prefix)
+{
+	open_files.invalidate(path, prefix,
+						  [this](const file_handlex& fh) { tree->close(fh.fd); });
+}
+
 void
 replayer::lose_power()
 {
-	for (auto& [inode_number, inode] : inode_table)
-		inode->lose_power();
+	std::vector<directory *> changed;
+
+	tree->io().drain();
+
+	// Undo directory changes before the files forget their sectors.
+	// Anything created since a directory's last fsync is removed, deepest
+	// first so that new directories are empty by the time we get to them,
+	// and then the files that were removed are put back.
+	directories.for_each([&](directory& dir) {
+		if (dir.pending())
+			changed.push_back(&dir);
+	});
+	std::sort(changed.begin(), changed.end(), [](directory *a, directory *b) {
+		return std::count(a->path().begin(), a->path().end(), '/') >
+			std::count(b->path().begin(), b->path().end(), '/');
+	});
+	for (directory *dir : changed)
+		dir->undo_additions();
+	for (directory *dir : changed)
+		dir->undo_removals();
+
+	// Files that have been unlinked, or that are no longer in the table
+	// after move_target(), lose power too, but there's no inode number
+	// to report them by.  Losing power twice loses nothing.
+	for (const auto& [inode_number, ref] : inode_table) {
+		if (ref.file)
+			report_loss(inode_number, ref.file->lose_power());
+	}
+	files.for_each([this](file& f) { report_loss(0, f.lose_power()); });
+	directories.for_each([](directory& dir) { dir.lose_power(); });
+	pins.clear();
+}
+
+void
+replayer::report_loss(ino_t inode_number, std::size_t lost)
+{
+	if (lost == 0)
+		return;
+	if (inode_number != 0)
+		std::cout << "inode " << inode_number << " ";
+	else
+		std::cout << "unlinked file ";
+	std::cout << "forgot " << lost << " sectors due to power loss\n";
+	stats.losses.push_back(replay_stats::loss{ inode_number, lost });
+}
+
+replay_stats&
+replayer::statistics()
+{
+	stats.peak_buffered_bytes = sectors.peak_in_use() * sector_size;
+	stats.peak_spilled_bytes = sectors.peak_spilled() * sector_size;
+	return stats;
+}
+
+void
+replayer::flush()
+{
+	tree->flush();
+}
+
+/*
+ * The state file is plain text, with strings quoted and escaped as in
+ * logs.  Inodes are identified by a path at which they can be found in
+ * the saved tree, since inode numbers won't survive copying.
+ */
+void
+replayer::save_checkpoint(const std::string& path)
+{
+	std::string tree_path = path + "/tree";
+
+	if (::mkdir(tree_path.c_str(), 0777) < 0) {
+		std::string error = std::strerror(errno);
+		throw std::runtime_error("could not create " + tree_path + ": " + error);
+	}
+
+	std::ofstream state(path + "/state");
+	save_state(tree_path, state);
+	if (!state.flush())
+		throw std::runtime_error("could not write " + path + "/state");
+}
+
+void
+replayer::load_checkpoint(const std::string& path)
+{
+	std::ifstream state(path + "/state");
+
+	if (!state)
+		throw std::runtime_error("could not open " + path + "/state");
+	load_state(state, path + "/tree", "checkpoint " + path, true);
+}
+
+void
+replayer::hand_over(const std::string& path, std::ostream& state)
+{
+	tree->io().drain();
+	save_state(path, state);
+}
+
+void
+replayer::take_over(std::istream& state, const std::string& tree_path)
+{
+	load_state(state, tree_path, "fast-forward state", false);
+}
+
+/*
+ * Copy the target into the empty directory at tree_path, and write
+ * everything else we'd need to carry on to state.
+ */
+void
+replayer::save_state(const std::string& tree_path, std::ostream& state)
+{
+	std::unordered_map<ino_t, std::string> paths;
+
+	tree->save(tree_path, &paths);
+
+	state << "dsfs-checkpoint 4\n"
+		  << "sector-size " << sector_size << "\n"
+		  << "writeback " << file_mode << "\n"
+		  << "directory-writeback " << directory_mode << "\n"
+		  << "seed " << seed << "\n"
+		  << "files " << next_file_id << "\n"
+		  << "pins " << pins.next_pin() << "\n"
+		  << "replayed " << replayed << "\n";
+
+	// Inodes that are no longer linked into the tree can't affect the
+	// outcome, except for reporting lost sectors, so they're dropped.
+	for (const auto& [inode_number, ref] : inode_table) {
+		auto found = paths.find(inode_number);
+		if (found == paths.end() || (!ref.file && !ref.directory))
+			continue;
+		state << "inode " << (ref.directory ? "directory " : "file ");
+		write_string_literal(state, found->second);
+		state << "\n";
+		if (ref.directory)
+			ref.directory->save(state);
+		else
+			ref.file->save(state);
+	}
+
+	for (std::size_t id = 0; id < file_handle_table.size(); ++id) {
+		const file_handlex& fh = file_handle_table[id];
+		struct stat stat_data;
+
+		if (fh.fd == -1)
+			continue;
+		if (tree->fstat(fh.fd, &stat_data) < 0) {
+			std::string error = std::strerror(errno);
+			throw std::runtime_error("could not stat file handle: " + error);
+		}
+		auto found = paths.find(stat_data.st_ino);
+		if (found == paths.end())
+			throw std::runtime_error("cannot checkpoint file handle " +
+									 std::to_string(id) +
+									 ", because its file has been unlinked");
+		state << "handle " << id << " ";
+		write_string_literal(state, found->second);
+		state << "\n";
+	}
+	state << "end\n";
+}
+
+/*
+ * Read back what save_state() wrote, loading the tree from tree_path
+ * unless it's empty because the tree is already in place.  The name is
+ * for error messages.  The writeback modes only have to match if
+ * same_modes is set; otherwise, nothing can have been waiting for fsync.
+ */
+void
+replayer::load_state(std::istream& state,
+					 const std::string& tree_path,
+					 const std::string& name,
+					 bool same_modes)
+{
+	std::string word;
+	std::string kind;
+	std::string inode_path;
+	off_t saved_sector_size;
+	int saved_mode;
+	int saved_directory_mode;
+	std::uint64_t saved_seed;
+	std::uint64_t saved_next_file_id;
+	std::uint64_t saved_next_pin;
+	int version;
+
+	if (!(state >> word >> version) || word != "dsfs-checkpoint" || version != 4)
+		throw std::runtime_error("unrecognized format in " + name);
+	if (!(state >> word >> saved_sector_size) || word != "sector-size" ||
+		!(state >> word >> saved_mode) || word != "writeback" ||
+		!(state >> word >> saved_directory_mode) || word != "directory-writeback" ||
+		!(state >> word >> saved_seed) || word != "seed" ||
+		!(state >> word >> saved_next_file_id) || word != "files" ||
+		!(state >> word >> saved_next_pin) || word != "pins" ||
+		!(state >> word >> replayed) || word != "replayed")
+		throw std::runtime_error("bad header in " + name);
+	if (saved_sector_size != sector_size || saved_seed != seed ||
+		(same_modes && (saved_mode != file_mode ||
+						saved_directory_mode != directory_mode)))
+		throw std::runtime_error(name +
+								 " was taken with a different sector size, writeback mode or seed");
+
+	if (!tree_path.empty())
+		tree->load(tree_path);
+	pins.set_next_pin(saved_next_pin);
+
+	while (state >> word && word != "end") {
+		if (word == "inode") {
+			if (!(state >> kind) || !read_string_literal(state, inode_path))
+				throw std::runtime_error("bad inode in " + name);
+			// The root can't be opened by path, but directories don't
+			// need to be.
+			if (kind == "directory") {
+				get_directory(inode_path).load(state);
+			} else if (kind == "file") {
+				file *file;
+				int fd = tree->open(inode_path, O_RDONLY);
+				if (fd < 0) {
+					std::string error = std::strerror(errno);
+					throw std::runtime_error("could not open " + inode_path +
+											 ": " + error);
+				}
+				try {
+					file = lookup_file(inode_path, fd, true);
+				} catch (...) {
+					tree->close(fd);
+					throw;
+				}
+				tree->close(fd);
+				file->load(state);
+			} else {
+				throw std::runtime_error("bad inode in " + name);
+			}
+		} else if (word == "handle") {
+			int id;
+
+			if (!(state >> id) || id < 0 || !read_string_literal(state, inode_path))
+				throw std::runtime_error("bad file handle in " + name);
+			int fd = tree->open(inode_path, O_RDWR);
+			if (fd < 0) {
+				std::string error = std::strerror(errno);
+				throw std::runtime_error("could not open " + inode_path +
+										 ": " + error);
+			}
+			try {
+				open_file_handle(inode_path, id, fd, false);
+			} catch (...) {
+				tree->close(fd);
+				throw;
+			}
+		} else {
+			throw std::runtime_error("unexpected " + word + " in " + name);
+		}
+	}
+	if (word != "end")
+		throw std::runtime_error("truncated " + name);
+
+	// Loading the files took ids of their own.
+	next_file_id = saved_next_file_id;
+}
+
+/*
+ * Copy the target directory to path and carry on from there, as if we'd
+ * been replaying into it all along.  Inodes that are no longer linked
+ * into the tree can't be found in the copy, so they drop out of the
+ * table, but stay in the pools.  File handles are closed, since any that
+ * were open on unlinked files couldn't be reopened; only use this when
+ * we're about to lose power.
+ */
+void
+replayer::move_target(const std::string& path)
+{
+	std::unordered_map<ino_t, std::string> paths;
+	std::unordered_map<ino_t, inode_ref> moved;
+
+	tree->io().drain();
+	close_all();
+	tree->move_to(path, paths);
+	if (paths.empty())
+		return;
+
+	for (auto& [inode_number, ref] : inode_table) {
+		auto found = paths.find(inode_number);
+		struct stat stat_data;
+
+		if (found == paths.end())
+			continue;
+		if (tree->stat(found->second, &stat_data) < 0)
+			throw std::runtime_error("could not stat " + path + found->second);
+		moved[stat_data.st_ino] = ref;
+	}
+	inode_table = std::move(moved);
+}
+
+/*
+ * Run work in a forked copy of the process, which can do as it likes with
+ * its copy of our state, and wait for it.  What is for error messages.
+ */
+void
+replayer::in_child(const std::string& what,
+				   int output_fd,
+				   const std::function<void()>& work)
+{
+	pid_t pid;
+	int status;
+
+	// The child mustn't inherit writes in flight, or output that we
+	// haven't flushed yet and would then print twice.
+	tree->io().drain();
+	std::cout.flush();
+
+	pid = ::fork();
+	if (pid < 0) {
+		std::string error = std::strerror(errno);
+		throw std::runtime_error("could not fork: " + error);
+	} else if (pid == 0) {
+		status = EXIT_SUCCESS;
+		if (output_fd >= 0)
+			::dup2(output_fd, STDOUT_FILENO);
+		try {
+			work();
+		} catch (const std::exception& e) {
+			std::cerr << "while trying to " << what << ": " << e.what()
+					  << std::endl;
+			status = EXIT_FAILURE;
+		}
+		std::cout.flush();
+		// Skip destructors, which would wait for threads that only
+		// exist in the parent.
+		::_exit(status);
+	}
+
+	while (::waitpid(pid, &status, 0) < 0) {
+		if (errno != EINTR) {
+			std::string error = std::strerror(errno);
+			throw std::runtime_error("could not wait for child: " + error);
+		}
+	}
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+		throw std::runtime_error("could not " + what);
+}
+
+void
+replayer::crash_image(const std::string& path, int output_fd)
+{
+	in_child("create crash image " + path, output_fd, [&]() {
+		move_target(path);
+		lose_power();
+		tree->flush();
+	});
+}
+
+bool
+replayer::crash_image_hash(std::uint64_t& hash)
+{
+	bool pending = false;
+
+	// Files lose nothing on disk when the power goes, since their unsynced
+	// sectors never got there, but directories put things back.
+	directories.for_each([&](directory& dir) {
+		pending = pending || dir.pending();
+	});
+	if (pending)
+		return false;
+
+	if (!hasher) {
+		hasher = std::make_unique<image_hasher>();
+		files.for_each([](file& f) { f.track_changes(); });
+	}
+	change_function changed = [this](ino_t inode_number, change_list& changes) {
+		auto found = inode_table.find(inode_number);
+
+		// Nothing writes to a file we haven't got an object for.
+		if (found == inode_table.end() || !found->second.file) {
+			changes.clear();
+			return true;
+		}
+		return found->second.file->take_changes(changes);
+	};
+	hash = hasher->hash(*tree, &changed);
+
+	return true;
+}
+
+void
+replayer::enumerate_crash_images(const std::string& dir,
+								 std::size_t max_lost,
+								 const loss_visitor& visit,
+								 int output_fd)
+{
+	in_child("enumerate crash images in " + dir, output_fd, [&]() {
+		std::string live = dir + "/live";
+		std::string base = dir + "/base";
+		std::unordered_map<ino_t, std::string> paths;
+		std::vector<std::pair<ino_t, unsynced_sector>> found;
+		std::vector<unsynced_sector> sectors;
+
+		for (const std::string& path : { live, base }) {
+			remove_tree(path);
+			if (::mkdir(path.c_str(), 0777) < 0) {
+				std::string error = std::strerror(errno);
+				throw std::runtime_error("could not create " + path + ": " + error);
+			}
+		}
+
+		// Take note of the sectors before losing them, then write out
+		// what the disk would hold if they were all lost.
+		move_target(live);
+		for (const auto& [inode_number, ref] : inode_table) {
+			if (!ref.file)
+				continue;
+			ref.file->unsynced([&](off_t offset, std::string_view data) {
+				found.emplace_back(inode_number,
+								   unsynced_sector{ "",
+													offset,
+													{ data.begin(), data.end() } });
+			});
+		}
+		lose_power();
+		tree->save(base, &paths);
+
+		// Files that have been unlinked aren't in the image, so their
+		// sectors don't matter.
+		for (auto& [inode_number, sector] : found) {
+			auto path = paths.find(inode_number);
+			if (path == paths.end())
+				continue;
+			sector.path = path->second;
+			sectors.push_back(std::move(sector));
+		}
+		enumerate_losses(base, std::move(sectors), max_lost, dir, visit);
+		remove_tree(live);
+		remove_tree(base);
+	});
 }
 
 directory&
-replayer::get_directory(const std::string& path)
+replayer::get_directory(std::string_view path)
 {
-	std::string remapped;
+	struct stat stat_data;
+
+	if (tree->stat(path, &stat_data) < 0) {
+		std::string error = std::strerror(errno);
+		throw std::runtime_error("could not stat directory " +
+								 std::string(path) + ": " + error);
+	}
 
-	remap(remapped, path);
+	inode_ref& ref = inode_table[stat_data.st_ino];
 
-	auto& inode = inode_table[get_inode_number(remapped)];
+	if (ref.file)
+		throw std::runtime_error("expected " + std::string(path) +
+								 " to be a directory, but it's a file");
 
 	// Make a new one if we haven't heard of it before.
-	if (!inode)
-		inode = std::make_unique<directory>(path);
+	if (!ref.directory) {
+		ref.slot = directories.make(*tree, pins, path);
+		ref.directory = &directories[ref.slot];
+	}
+
+	return *ref.directory;
+}
+
+/*
+ * The directory object for path, if it's a directory we know about.
+ */
+directory *
+replayer::known_directory(std::string_view path)
+{
+	struct stat stat_data;
+
+	if (tree->stat(path, &stat_data) < 0)
+		return nullptr;
+
+	auto found = inode_table.find(stat_data.st_ino);
+	if (found == inode_table.end())
+		return nullptr;
+	return found->second.directory;
+}
 
-	if (auto result = dynamic_cast<directory *>(inode.get()))
-		return *result;
+/*
+ * If directory changes can be lost, find the directory that should hear
+ * about a change to the entry at path, and set name to the entry's name.
+ */
+directory *
+replayer::changes_in(std::string_view path, std::string& name)
+{
+	std::string_view parent;
+	std::string_view entry;
 
-	throw std::runtime_error("expected " + path + " to be a directory, but it's a file");
+	if (directory_mode == DIRECTORY_WRITEBACK_ALL)
+		return nullptr;
+
+	split_path(path, parent, entry);
+	directory& dir = get_directory(parent);
+	dir.set_path(parent);
+	name.assign(entry);
+
+	return &dir;
+}
+
+/*
+ * Something at path has been committed, so the directories it's in must
+ * have been too.
+ */
+void
+replayer::commit_parents(std::string_view path)
+{
+	std::string_view parent;
+	std::string_view unused;
+	std::string name;
+
+	split_path(path, parent, unused);
+	while (parent != "/") {
+		directory *dir = changes_in(parent, name);
+
+		if (!dir->changed(name))
+			break;
+		dir->commit(name);
+		split_path(parent, parent, unused);
+	}
+}
+
+/*
+ * A directory has been renamed, so directories with changes to undo
+ * beneath it have new paths.
+ */
+void
+replayer::moved_directory(std::string_view from, std::string_view to)
+{
+	directories.for_each([&](directory& dir) {
+		if (!dir.pending())
+			return;
+		std::string_view path = dir.path();
+		if (path.substr(0, from.size()) == from &&
+			(path.size() == from.size() || path[from.size()] == '/'))
+			dir.set_path(std::string(to) + std::string(path.substr(from.size())));
+	});
 }
 
 void
@@ -177,82 +768,178 @@ replayer::replay(const operation& op)
 {
 	int rc = 0;
 	int fd;
+	bool created;
+	std::string name;
+	std::string name2;
+	replay_stats::clock::time_point start;
+
+	if (timing)
+		start = replay_stats::clock::now();
+
+	// Writes may still be in flight.  They only need to be ordered
+	// against each other and fsync, but everything else might close,
+	// truncate, rename or otherwise depend on the files they touch.
+	if (op.op != operation::OP_WRITE && op.op != operation::OP_FSYNC)
+		tree->io().drain();
 
 	switch (op.op) {
 	case operation::OP_MKDIR:
-		remap(remapped, op.path);
-		rc = ::mkdir(remapped.c_str(), op.mode);
+		rc = tree->mkdir(op.path, op.mode);
+		if (rc == 0) {
+			// Forget anything we knew about an earlier directory that
+			// had the same inode number.
+			struct stat stat_data;
+			if (tree->stat(op.path, &stat_data) == 0)
+				forget_inode(stat_data.st_ino);
+			if (directory *dir = changes_in(op.path, name))
+				dir->added(name);
+		}
 		break;
 	case operation::OP_UNLINK:
-		remap(remapped, op.path);
-		rc = ::unlink(remapped.c_str());
+		{
+			directory *dir = changes_in(op.path, name);
+
+			if (dir)
+				dir->changing(name);
+			rc = tree->unlink(op.path);
+			forget_path(op.path, false);
+			if (dir && rc == 0)
+				dir->removed(name);
+		}
 		break;
 	case operation::OP_RMDIR:
-		remap(remapped, op.path);
-		rc = ::rmdir(remapped.c_str());
+		{
+			directory *dir = changes_in(op.path, name);
+			directory *removed = dir ? known_directory(op.path) : nullptr;
+
+			rc = tree->rmdir(op.path);
+			forget_path(op.path, true);
+			// Directories can't be put back, so removing one is
+			// committed at once, along with the changes that emptied
+			// it.
+			if (dir && rc == 0) {
+				if (removed)
+					removed->synchronize();
+				dir->removed(name);
+			}
+		}
 		break;
 	case operation::OP_SYMLINK:
-		remap(remapped, op.path2);
-		rc = ::symlink(op.path.c_str(), remapped.c_str());
-		// XXX forget symnlink if parent dir not synced!
+		rc = tree->symlink(op.path, op.path2);
+		if (rc == 0) {
+			if (directory *dir = changes_in(op.path2, name))
+				dir->added(name);
+		}
 		break;
 	case operation::OP_RENAME:
-		remap(remapped, op.path);
-		remap(remapped2, op.path2);
-		rc = ::rename(remapped.c_str(), remapped2.c_str());
-		// If the parent directory is the same (we just renamed, we
-		// didn't move) then we might potentially undo it on crash.
-		// If it's a move, it's not yet clear how to do that, so we'll
-		// leave it committed.
-		get_parent(parent, op.path);
-		get_parent(parent2, op.path2);
-		if (parent == parent2)
-			get_directory(parent).rename(op.path, op.path2);
+		{
+			directory *dir = changes_in(op.path, name);
+			directory *dir2 = changes_in(op.path2, name2);
+			bool moving_directory = false;
+			bool undoable = true;
+			struct stat stat_data;
+
+			// Moving a directory that was there at the last fsync, or
+			// replacing one, is committed at once, since we can't put
+			// directories back.  Anything else can be undone like an
+			// unlink and a link.
+			if (dir) {
+				moving_directory = tree->lstat(op.path, &stat_data) == 0 &&
+					S_ISDIR(stat_data.st_mode);
+				if (moving_directory &&
+					tree->lstat(op.path2, &stat_data) == 0 &&
+					S_ISDIR(stat_data.st_mode)) {
+					if (directory *replaced = known_directory(op.path2))
+						replaced->synchronize();
+					undoable = false;
+				} else if (moving_directory && !dir->changed(name)) {
+					undoable = false;
+				}
+				if (undoable) {
+					dir->changing(name);
+					dir2->changing(name2);
+				}
+			}
+
+			rc = tree->rename(op.path, op.path2);
+			if (rc < 0)
+				break;
+			forget_path(op.path, true);
+			forget_path(op.path2, true);
+			if (dir) {
+				// Renaming one link to a file onto another leaves both.
+				if (undoable) {
+					if (tree->lstat(op.path, &stat_data) < 0)
+						dir->removed(name);
+				} else {
+					dir->commit(name);
+					dir2->commit(name2);
+					commit_parents(op.path2);
+				}
+				if (moving_directory)
+					moved_directory(op.path, op.path2);
+			}
+		}
 		break;
 	case operation::OP_LINK:
-		remap(remapped, op.path);
-		remap(remapped2, op.path2);
-		rc = ::link(remapped.c_str(), remapped2.c_str());
+		rc = tree->link(op.path, op.path2);
+		if (rc == 0) {
+			if (directory *dir = changes_in(op.path2, name))
+				dir->added(name);
+		}
 		break;
 	case operation::OP_CHMOD:
-		remap(remapped, op.path);
-		rc = ::chmod(remapped.c_str(), op.mode);
+		rc = tree->chmod(op.path, op.mode);
 		break;
 	case operation::OP_CHOWN:
-		remap(remapped, op.path);
-		rc = ::chown(remapped.c_str(), op.uid, op.gid);
+		rc = tree->chown(op.path, op.uid, op.gid);
 		break;
 	case operation::OP_TRUNCATE:
-		remap(remapped, op.path);
-		rc = ::truncate(remapped.c_str(), op.size);
+		{
+			auto& fh = get_file_by_path(op.path);
+
+			fh.file->truncate(fh.fd, op.size);
+		}
 		break;
 	case operation::OP_FTRUNCATE:
-		// XXX simulate delayed commit of truncate!
-		rc = ::ftruncate(get_file_handle(op).fd, op.size);
+		{
+			auto& fh = get_file_handle(op);
+
+			fh.file->truncate(fh.fd, op.size);
+		}
 		break;
 	case operation::OP_CREATE:
-		remap(remapped, op.path);
-		fd = ::open(remapped.c_str(), O_RDWR | O_CREAT, op.mode);
+		// Try exclusive creation first, so we know whether this is a
+		// new inode.
+		fd = tree->open(op.path, O_RDWR | O_CREAT | O_EXCL, op.mode);
+		created = fd >= 0;
+		if (fd < 0 && errno == EEXIST)
+			fd = tree->open(op.path, O_RDWR | O_CREAT, op.mode);
 		if (fd < 0) {
 			std::string error = std::strerror(errno);
-			throw std::runtime_error("could not create file " + remapped + ": " + error);
+			throw std::runtime_error("could not create file " +
+									 std::string(op.path) + ": " + error);
+		}
+		open_file_handle(op.path, op.file_handle_id, fd, created);
+		if (created) {
+			if (directory *dir = changes_in(op.path, name))
+				dir->added(name);
 		}
-		open_file_handle(op.path, op.file_handle_id, fd);
 		break;
 	case operation::OP_OPEN:
-		remap(remapped, op.path);
-		fd = ::open(remapped.c_str(), O_RDWR);
+		fd = tree->open(op.path, O_RDWR);
 		if (fd < 0) {
 			std::string error = std::strerror(errno);
-			throw std::runtime_error("could not open file " + remapped + ": " + error);
+			throw std::runtime_error("could not open file " +
+									 std::string(op.path) + ": " + error);
 		}
-		open_file_handle(op.path, op.file_handle_id, fd);
+		open_file_handle(op.path, op.file_handle_id, fd, false);
 		break;
 	case operation::OP_WRITE:
 		{
 			auto& fh = get_file_handle(op);
 
-			fh.inode->write(fh.fd,
+			fh.file->write(fh.fd,
 							op.data.data(),
 							op.data.size(),
 							op.offset);
@@ -262,13 +949,22 @@ replayer::replay(const operation& op)
 		close_file_handle(op.file_handle_id);
 		break;
 	case operation::OP_UTIMENS:
-		remap(remapped, op.path);
-		rc = ::utimensat(AT_FDCWD, remapped.c_str(), op.utime, 0);
+		rc = tree->utimens(op.path, op.utime);
 		break;
 	case operation::OP_FSYNC:
 		{
+			struct stat stat_data;
+
+			// Directories are only ever fsynced by path.
+			if (op.file_handle_id < 0 && !open_files.find(op.path) &&
+				tree->stat(op.path, &stat_data) == 0 &&
+				S_ISDIR(stat_data.st_mode)) {
+				get_directory(op.path).synchronize();
+				break;
+			}
+
 			auto& fh = get_file_handle(op);
-			fh.inode->synchronize(fh.fd);
+			fh.file->synchronize(fh.fd);
 		}
 		break;
 	default:
@@ -278,4 +974,15 @@ replayer::replay(const operation& op)
 		std::string error = std::strerror(errno);
 		throw std::runtime_error(stringify(op.op) + " failed: " + error);
 	}
+	++replayed;
+	++stats.operations[op.op];
+	if (timing)
+		stats.operation_time[op.op] += replay_stats::clock::now() - start;
+}
+
+void
+replayer::replay_batch(operation_span ops)
+{
+	for (const operation& op : ops)
+		replay(op);
 }
@@ -1,8 +1,17 @@
 #include "directory.hpp"
+#include "fd_cache.hpp"
 #include "file.hpp"
-#include "inode.hpp"
+#include "image_hash.hpp"
+#include "inode_pool.hpp"
+#include "io_backend.hpp"
+#include "loss_enumerator.hpp"
 #include "operation.hpp"
+#include "replay_stats.hpp"
+#include "target.hpp"
 
+#include <cstdint>
+#include <functional>
+#include <iosfwd>
 #include <memory>
 #include <unordered_map>
 #include <vector>
@@ -10,53 +19,190 @@
 /*
  * We maintain a table of file handles, indexed by file handle ID, so
  * that we have a place to keep track of our file descriptor and our
- * inode object.
+ * file object.
  */
 struct file_handlex {
-	file_handlex(int fd, inode *inode) : fd(fd), inode(inode) {}
-	file_handlex() : fd(-1), inode(NULL) {}
+	file_handlex(int fd, struct file *file) : fd(fd), file(file) {}
+	file_handlex() : fd(-1), file(NULL) {}
 	int fd;
-	struct inode *inode;
+	struct file *file;
+};
+
+/*
+ * What we know about an inode: either a file or a directory, and its
+ * slot in the pool it came from.
+ */
+struct inode_ref {
+	struct file *file;
+	struct directory *directory;
+	std::uint32_t slot;
 };
 
 struct replayer {
 	/*
 	 * Construct a replayer that will replay operations into a given
-	 * directory.  The path doesn't have to be the same as was used
-	 * when recording.
+	 * target, usually a posix_target for a directory.  The path
+	 * doesn't have to be the same as was used when recording.  The seed
+	 * is for FILE_WRITEBACK_RANDOM.  With DIRECTORY_WRITEBACK_NONE,
+	 * losing power undoes changes to directory entries since each
+	 * directory's last fsync.
 	 */
-	replayer(const std::string& target_path,
+	replayer(std::unique_ptr<target> tree,
 			 off_t sector_size,
-			 file_writeback_mode file_writeback_mode);
+			 file_writeback_mode file_writeback_mode,
+			 std::uint64_t seed = 0,
+			 directory_writeback_mode directory_mode = DIRECTORY_WRITEBACK_ALL);
+	~replayer();
+
+	/*
+	 * Keep at most bytes of unsynced sectors in memory, and put the rest
+	 * in a file in spill_dir.
+	 */
+	void limit_buffering(std::size_t bytes, const std::string& spill_dir);
 
 	/*
 	 * Replay one operation into the target directory.  Throws on error.
 	 */
 	void replay(const operation& op);
 
+	/*
+	 * Replay a run of operations in order.  Throws on error, in which
+	 * case operations_replayed() says how far we got.
+	 */
+	void replay_batch(operation_span ops);
+
+	/*
+	 * The number of operations successfully replayed so far.
+	 */
+	std::size_t operations_replayed() const { return replayed; }
+
+	/*
+	 * Time each operation as it's replayed, which costs a couple of
+	 * clock reads per operation.
+	 */
+	void time_operations(bool on) { timing = on; }
+
+	/*
+	 * What we've done so far.  The caller can add its own timings.
+	 */
+	replay_stats& statistics();
+
 	void lose_power();
 
+	/*
+	 * Make sure the target directory on disk is up to date, which for
+	 * an in-memory target means writing it out.
+	 */
+	void flush();
+
+	/*
+	 * Save everything needed to carry on from this point into a new
+	 * directory: a copy of the target directory, and a description of
+	 * the sectors and directory changes we're holding back and the
+	 * file handles we have open.  Throws if a file handle refers to a
+	 * file that has been unlinked, since it couldn't be reopened.
+	 */
+	void save_checkpoint(const std::string& path);
+
+	/*
+	 * Fill the empty target directory from a checkpoint and pick up
+	 * where it left off.  The sector size and writeback mode must match
+	 * the ones the checkpoint was taken with.
+	 */
+	void load_checkpoint(const std::string& path);
+
+	/*
+	 * Let another replayer carry on from here, as for a checkpoint.  We
+	 * write our target out into the empty directory at path, which can
+	 * be the other replayer's target directory, and describe the rest of
+	 * our state in state.  It's for fast-forwarding: we should have been
+	 * replaying with FILE_WRITEBACK_ALL and DIRECTORY_WRITEBACK_ALL, so
+	 * that nothing is waiting for fsync, and the other replayer can use
+	 * any writeback mode.
+	 */
+	void hand_over(const std::string& path, std::ostream& state);
+
+	/*
+	 * Pick up what hand_over() left, before replaying anything.  If
+	 * tree_path is given, our target is loaded from there; otherwise
+	 * the tree must already be in our target directory.
+	 */
+	void take_over(std::istream& state, const std::string& tree_path = "");
+
+	/*
+	 * Fill the empty directory at path with what the target directory
+	 * would contain if we lost power right now, without disturbing the
+	 * replay.  This happens in a forked copy of the process, which can
+	 * do as it likes with its copy of our state.  If output_fd is
+	 * given, the copy's messages go there instead of to stdout.
+	 */
+	void crash_image(const std::string& path, int output_fd = -1);
+
+	/*
+	 * Set hash to the image_hasher hash of the image crash_image()
+	 * would build right now, without building it, and return true.  The
+	 * first call reads the whole target, and later ones only what has
+	 * changed since.  Returns false if there are directory changes that
+	 * losing power would undo, in which case the image has to be built
+	 * and hashed with hash_tree().
+	 */
+	bool crash_image_hash(std::uint64_t& hash);
+
+	/*
+	 * Like crash_image(), but build an image in dir for every way of
+	 * losing up to max_lost of the sectors that haven't been synced,
+	 * as enumerate_losses() does, and hand each one to visit.  The
+	 * visitor runs in the forked copy.
+	 */
+	void enumerate_crash_images(const std::string& dir,
+								std::size_t max_lost,
+								const loss_visitor& visit,
+								int output_fd = -1);
+
 private:
-	const std::string target_path;
+	std::unique_ptr<target> tree;
 	off_t sector_size;
 	file_writeback_mode file_mode;
+	std::uint64_t seed;
+	directory_writeback_mode directory_mode;
+	std::uint64_t next_file_id;
 	std::vector<file_handlex> file_handle_table;
-	std::unordered_map<ino_t, std::unique_ptr<inode>> inode_table;
+	replay_stats stats;
+	sector_pool sectors;
+	pinned_files pins;
+	inode_pool<file> files;
+	inode_pool<directory> directories;
+	std::unordered_map<ino_t, inode_ref> inode_table;
+
+	file_fd_cache<file_handlex> open_files;
+	std::unique_ptr<image_hasher> hasher;
+	std::size_t replayed;
+	bool timing;
 
-	void remap(std::string& remapped, const std::string& path);
-	directory& get_directory(const std::string& path);
+	file *lookup_file(std::string_view path, int fd, bool fresh);
+	void forget_inode(ino_t inode_number);
+	directory& get_directory(std::string_view path);
+	directory *known_directory(std::string_view path);
+	directory *changes_in(std::string_view path, std::string& name);
+	void commit_parents(std::string_view path);
+	void moved_directory(std::string_view from, std::string_view to);
 	const file_handlex& get_file_handle(const operation& op);
-	void open_file_handle(const std::string& path,
+	const file_handlex& get_file_by_path(std::string_view path);
+	void forget_path(std::string_view path, bool prefix);
+	void open_file_handle(std::string_view path,
 						  int file_handle_id,
-						  int fd);
+						  int fd,
+						  bool fresh);
 	void close_file_handle(int file_handle_id);
-
-	/*
-	 * Scratch space preserved across replay() calls, for computing
-	 * paths without repeated allocation.
-	 */
-	std::string remapped;
-	std::string remapped2;
-	std::string parent;
-	std::string parent2;
+	void close_all();
+	void save_state(const std::string& tree_path, std::ostream& state);
+	void load_state(std::istream& state,
+					const std::string& tree_path,
+					const std::string& name,
+					bool same_modes);
+	void move_target(const std::string& path);
+	void report_loss(ino_t inode_number, std::size_t lost);
+	void in_child(const std::string& what,
+				  int output_fd,
+				  const std::function<void()>& work);
 };
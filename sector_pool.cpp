@@ -0,0 +1,321 @@
+#include "sector_pool.hpp"
+#include "io_backend.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iterator>
+#include <limits>
+#include <stdexcept>
+
+#include <stdlib.h>
+#include <unistd.h>
+
+sector_pool::sector_pool(std::size_t sector_size, std::size_t slots_per_chunk) :
+	size(sector_size),
+	slots_per_chunk(slots_per_chunk),
+	next_slot(0),
+	max_in_memory(std::numeric_limits<std::size_t>::max()),
+	peak_slots(0),
+	spill_fd(-1),
+	next_spill_slot(0),
+	peak_spill_slots(0)
+{
+}
+
+sector_pool::~sector_pool()
+{
+	if (spill_fd >= 0)
+		::close(spill_fd);
+}
+
+void
+sector_pool::limit(std::size_t bytes, const std::string& spill_dir)
+{
+	max_in_memory = bytes / size;
+	this->spill_dir = spill_dir;
+}
+
+std::uint32_t
+sector_pool::allocate()
+{
+	std::uint32_t slot;
+
+	if (full()) {
+		if (spill_fd < 0) {
+			std::string path = spill_dir + "/dsfs_spill.XXXXXX";
+
+			spill_fd = ::mkstemp(&path[0]);
+			if (spill_fd < 0) {
+				std::string error = std::strerror(errno);
+				throw std::runtime_error("could not create " + path + ": " + error);
+			}
+			::unlink(path.c_str());
+		}
+		if (!free_spill_slots.empty()) {
+			slot = free_spill_slots.back();
+			free_spill_slots.pop_back();
+		} else if (next_spill_slot == spill_bit) {
+			throw std::runtime_error("too many sectors to spill");
+		} else {
+			slot = next_spill_slot++ | spill_bit;
+		}
+		peak_spill_slots = std::max(peak_spill_slots,
+									next_spill_slot - free_spill_slots.size());
+		return slot;
+	}
+	if (!free_slots.empty()) {
+		slot = free_slots.back();
+		free_slots.pop_back();
+	} else {
+		if (next_slot == chunks.size() * slots_per_chunk)
+			chunks.emplace_back(allocate_aligned(size * slots_per_chunk));
+		slot = next_slot++;
+	}
+	peak_slots = std::max(peak_slots, in_use());
+	return slot;
+}
+
+void
+sector_pool::release(std::uint32_t slot)
+{
+	if (spilled(slot))
+		free_spill_slots.push_back(slot);
+	else
+		free_slots.push_back(slot);
+}
+
+void
+sector_pool::read(std::uint32_t slot, char *data, std::size_t length)
+{
+	if (!spilled(slot)) {
+		std::memcpy(data, this->data(slot), length);
+		return;
+	}
+
+	off_t offset = off_t(slot & ~spill_bit) * size;
+	std::size_t read_size = read_all(spill_fd, data, length, offset);
+	std::memset(data + read_size, 0, length - read_size);
+}
+
+void
+sector_pool::write(std::uint32_t slot,
+				   const char *data,
+				   std::size_t length,
+				   std::size_t offset)
+{
+	if (!spilled(slot))
+		std::memcpy(this->data(slot) + offset, data, length);
+	else
+		write_all(spill_fd, data, length, off_t(slot & ~spill_bit) * size + offset);
+}
+
+sector_map::sector_map() :
+	table(16, entry{ unused, 0, 0 }),
+	count(0)
+{
+}
+
+std::size_t
+sector_map::home(std::uint64_t sector) const
+{
+	// Fibonacci hashing spreads runs of consecutive sectors out.
+	return (sector * 0x9e3779b97f4a7c15ULL) >> 32 & (table.size() - 1);
+}
+
+sector_map::entry *
+sector_map::find(std::uint64_t sector)
+{
+	for (std::size_t i = home(sector);; i = (i + 1) & (table.size() - 1)) {
+		if (table[i].sector == sector)
+			return &table[i];
+		if (table[i].sector == unused)
+			return nullptr;
+	}
+}
+
+const sector_map::entry *
+sector_map::find(std::uint64_t sector) const
+{
+	return const_cast<sector_map *>(this)->find(sector);
+}
+
+sector_map::entry&
+sector_map::insert(std::uint64_t sector, bool& inserted)
+{
+	// Keep the load factor under a half, so that probe sequences stay
+	// short.
+	if ((count + 1) * 2 > table.size())
+		grow();
+
+	for (std::size_t i = home(sector);; i = (i + 1) & (table.size() - 1)) {
+		if (table[i].sector == sector) {
+			inserted = false;
+			return table[i];
+		}
+		if (table[i].sector == unused) {
+			inserted = true;
+			++count;
+			table[i].sector = sector;
+			return table[i];
+		}
+	}
+}
+
+bool
+sector_map::erase(std::uint64_t sector, entry& removed)
+{
+	std::size_t mask = table.size() - 1;
+	std::size_t i = home(sector);
+
+	while (table[i].sector != sector) {
+		if (table[i].sector == unused)
+			return false;
+		i = (i + 1) & mask;
+	}
+	removed = table[i];
+	--count;
+
+	// Shift later members of the probe sequence back into the hole, so
+	// that we never need tombstones.
+	for (std::size_t j = (i + 1) & mask; table[j].sector != unused; j = (j + 1) & mask) {
+		std::size_t k = home(table[j].sector);
+		bool movable = i <= j ? (k <= i || k > j) : (k <= i && k > j);
+		if (movable) {
+			table[i] = table[j];
+			i = j;
+		}
+	}
+	table[i].sector = unused;
+	return true;
+}
+
+std::vector<sector_map::entry>
+sector_map::sorted() const
+{
+	std::vector<entry> result;
+
+	result.reserve(count);
+	for (const entry& e : table) {
+		if (e.sector != unused)
+			result.push_back(e);
+	}
+	std::sort(result.begin(), result.end(), [](const entry& a, const entry& b) {
+		return a.sector < b.sector;
+	});
+	return result;
+}
+
+void
+sector_map::clear()
+{
+	std::size_t size = 16;
+
+	if (count == 0)
+		return;
+
+	// Size the table for about as many sectors as were just cleared, so
+	// that a file that once buffered a lot doesn't make every later
+	// sorted() and clear() scan a huge, nearly empty table.
+	while (size < count * 2)
+		size *= 2;
+	if (size < table.size())
+		std::vector<entry>(size, entry{ unused, 0, 0 }).swap(table);
+	else
+		std::fill(table.begin(), table.end(), entry{ unused, 0, 0 });
+	count = 0;
+}
+
+void
+sector_map::grow()
+{
+	std::vector<entry> old(table.size() * 2, entry{ unused, 0, 0 });
+
+	old.swap(table);
+	for (const entry& e : old) {
+		if (e.sector == unused)
+			continue;
+		std::size_t i = home(e.sector);
+		while (table[i].sector != unused)
+			i = (i + 1) & (table.size() - 1);
+		table[i] = e;
+	}
+}
+
+void
+sector_extents::add(std::uint64_t sector)
+{
+	run_map::iterator next = extents.upper_bound(sector);
+
+	// Extend the run before, if it ends here, joining it to the run
+	// after if that begins just after.
+	if (next != extents.begin()) {
+		run_map::iterator before = std::prev(next);
+
+		if (before->second > sector)
+			return;
+		if (before->second == sector) {
+			before->second = sector + 1;
+			if (next != extents.end() && next->first == sector + 1) {
+				before->second = next->second;
+				extents.erase(next);
+			}
+			return;
+		}
+	}
+
+	// Otherwise extend the run after backwards, or start a new one.
+	if (next != extents.end() && next->first == sector + 1) {
+		std::uint64_t end = next->second;
+
+		next = extents.erase(next);
+		extents.emplace_hint(next, sector, end);
+	} else {
+		extents.emplace_hint(next, sector, sector + 1);
+	}
+}
+
+void
+sector_extents::remove(std::uint64_t sector)
+{
+	run_map::iterator run = extents.upper_bound(sector);
+
+	if (run == extents.begin())
+		return;
+	--run;
+	if (run->second <= sector)
+		return;
+
+	std::uint64_t end = run->second;
+	if (run->first == sector)
+		run = extents.erase(run);
+	else
+		run->second = sector;
+	if (sector + 1 < end)
+		extents.emplace_hint(run, sector + 1, end);
+}
+
+std::vector<std::pair<std::uint64_t, std::uint64_t>>
+sector_extents::cut(std::uint64_t first)
+{
+	std::vector<std::pair<std::uint64_t, std::uint64_t>> removed;
+	run_map::iterator run = extents.upper_bound(first);
+
+	// The run before may straddle the cut.
+	if (run != extents.begin()) {
+		run_map::iterator before = std::prev(run);
+
+		if (before->second > first) {
+			removed.emplace_back(first, before->second);
+			if (before->first == first)
+				extents.erase(before);
+			else
+				before->second = first;
+		}
+	}
+	for (run_map::iterator i = run; i != extents.end(); ++i)
+		removed.emplace_back(i->first, i->second);
+	extents.erase(run, extents.end());
+
+	return removed;
+}
@@ -0,0 +1,182 @@
+#ifndef SECTOR_POOL_HPP
+#define SECTOR_POOL_HPP
+
+#include "io_backend.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+/*
+ * Sector-sized buffers for data that is waiting for fsync, carved out of
+ * large chunks and recycled through a free list.  Once a replay has
+ * buffered as much as it's going to at once, buffering another sector
+ * doesn't touch the heap.  Slots are identified by number, and their
+ * contents are undefined until written.  Chunks are aligned for O_DIRECT,
+ * so with a sector size that's a multiple of direct_alignment, slots can
+ * be written out without copying.
+ *
+ * Given a limit, the pool keeps at most that many bytes in memory, and
+ * hands out slots in a shadow file after that.  Those are spilled(), and
+ * can only be reached through read() and write().
+ */
+struct sector_pool {
+	explicit sector_pool(std::size_t sector_size,
+						 std::size_t slots_per_chunk = 1024);
+	~sector_pool();
+
+	/*
+	 * Spill to an unlinked file in spill_dir once bytes of slots are in
+	 * memory.  The file is created when first needed.
+	 */
+	void limit(std::size_t bytes, const std::string& spill_dir);
+
+	std::uint32_t allocate();
+	void release(std::uint32_t slot);
+
+	static bool spilled(std::uint32_t slot) { return slot & spill_bit; }
+
+	char *data(std::uint32_t slot)
+	{
+		return chunks[slot / slots_per_chunk].get() +
+			(slot % slots_per_chunk) * size;
+	}
+
+	/*
+	 * Copy part of a slot in or out, wherever it is.  Bytes of a spilled
+	 * slot that were never written read as zero.
+	 */
+	void read(std::uint32_t slot, char *data, std::size_t length);
+	void write(std::uint32_t slot,
+			   const char *data,
+			   std::size_t length,
+			   std::size_t offset = 0);
+
+	std::size_t sector_size() const { return size; }
+
+	/*
+	 * Whether the next allocate() will spill.
+	 */
+	bool full() const { return in_use() >= max_in_memory; }
+
+	/*
+	 * The number of slots in memory handed out and not yet released.
+	 */
+	std::size_t in_use() const { return next_slot - free_slots.size(); }
+
+	/*
+	 * The most slots that have been handed out at once, in memory and
+	 * spilled.
+	 */
+	std::size_t peak_in_use() const { return peak_slots; }
+	std::size_t peak_spilled() const { return peak_spill_slots; }
+
+private:
+	static const std::uint32_t spill_bit = 0x80000000;
+
+	std::size_t size;
+	std::size_t slots_per_chunk;
+	std::vector<aligned_memory> chunks;
+	std::vector<std::uint32_t> free_slots;
+	std::uint32_t next_slot;
+	std::size_t max_in_memory;
+	std::size_t peak_slots;
+
+	std::string spill_dir;
+	int spill_fd;
+	std::vector<std::uint32_t> free_spill_slots;
+	std::uint32_t next_spill_slot;
+	std::size_t peak_spill_slots;
+};
+
+/*
+ * An open-addressing hash table from sector number to a slot in a
+ * sector_pool and the number of bytes of it in use.  Entries live in one
+ * flat array, so there's no allocation per sector and lookups don't chase
+ * pointers.
+ */
+struct sector_map {
+	struct entry {
+		std::uint64_t sector;
+		std::uint32_t slot;
+		std::uint32_t length;
+	};
+
+	sector_map();
+
+	/*
+	 * Find a sector, or return nullptr.
+	 */
+	entry *find(std::uint64_t sector);
+	const entry *find(std::uint64_t sector) const;
+
+	/*
+	 * Find a sector, adding it if necessary, in which case its slot and
+	 * length are for the caller to fill in.  Pointers to entries are
+	 * only good until the next insert() or erase().
+	 */
+	entry& insert(std::uint64_t sector, bool& inserted);
+
+	/*
+	 * Remove a sector, handing back its entry so that the caller can
+	 * release the slot.  Returns false if it wasn't there.
+	 */
+	bool erase(std::uint64_t sector, entry& removed);
+
+	std::size_t size() const { return count; }
+	bool empty() const { return count == 0; }
+
+	/*
+	 * The entries in order of sector number.
+	 */
+	std::vector<entry> sorted() const;
+
+	/*
+	 * Forget all entries, keeping the table for reuse.
+	 */
+	void clear();
+
+private:
+	static const std::uint64_t unused = ~std::uint64_t(0);
+
+	std::size_t home(std::uint64_t sector) const;
+	void grow();
+
+	std::vector<entry> table;
+	std::size_t count;
+};
+
+/*
+ * A set of sector numbers kept as runs of consecutive sectors, so that
+ * they can be visited in order, or everything past some point can be cut
+ * off, without looking at the rest.  Adding or removing a sector is
+ * O(log runs).
+ */
+struct sector_extents {
+	typedef std::map<std::uint64_t, std::uint64_t> run_map;
+
+	void add(std::uint64_t sector);
+	void remove(std::uint64_t sector);
+
+	/*
+	 * Remove every sector from first onwards, and return the runs that
+	 * were removed as [begin, end) pairs.
+	 */
+	std::vector<std::pair<std::uint64_t, std::uint64_t>> cut(std::uint64_t first);
+
+	/*
+	 * Each run's first sector, mapped to the sector after its last.
+	 */
+	const run_map& runs() const { return extents; }
+
+	void clear() { extents.clear(); }
+
+private:
+	run_map extents;
+};
+
+#endif
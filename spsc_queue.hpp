@@ -0,0 +1,81 @@
+#ifndef SPSC_QUEUE_HPP
+#define SPSC_QUEUE_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <memory>
+#include <thread>
+
+/*
+ * A bounded, lock-free queue for exactly one producer thread and one
+ * consumer thread.  Blocking operations spin briefly and then back off
+ * with short sleeps, since the stages of a replay pipeline are expected
+ * to be busy most of the time.
+ */
+template <typename T>
+struct spsc_queue {
+	explicit spsc_queue(std::size_t capacity) :
+		capacity(capacity + 1),
+		slots(std::make_unique<T[]>(capacity + 1)),
+		head(0),
+		tail(0)
+	{
+	}
+
+	bool try_push(T&& value)
+	{
+		std::size_t t = tail.load(std::memory_order_relaxed);
+		std::size_t next = (t + 1) % capacity;
+		if (next == head.load(std::memory_order_acquire))
+			return false;
+		slots[t] = std::move(value);
+		tail.store(next, std::memory_order_release);
+		return true;
+	}
+
+	bool try_pop(T& value)
+	{
+		std::size_t h = head.load(std::memory_order_relaxed);
+		if (h == tail.load(std::memory_order_acquire))
+			return false;
+		value = std::move(slots[h]);
+		head.store((h + 1) % capacity, std::memory_order_release);
+		return true;
+	}
+
+	void push(T&& value)
+	{
+		for (int attempt = 0; !try_push(std::move(value)); ++attempt)
+			backoff(attempt);
+	}
+
+	void pop(T& value)
+	{
+		for (int attempt = 0; !try_pop(value); ++attempt)
+			backoff(attempt);
+	}
+
+	bool empty() const
+	{
+		return head.load(std::memory_order_acquire) ==
+			tail.load(std::memory_order_acquire);
+	}
+
+	static void backoff(int attempt)
+	{
+		if (attempt < 64)
+			std::this_thread::yield();
+		else
+			std::this_thread::sleep_for(std::chrono::microseconds(
+				attempt < 1024 ? 10 : 500));
+	}
+
+private:
+	const std::size_t capacity;
+	std::unique_ptr<T[]> slots;
+	alignas(64) std::atomic<std::size_t> head;
+	alignas(64) std::atomic<std::size_t> tail;
+};
+
+#endif
@@ -0,0 +1,186 @@
+#include "target.hpp"
+#include "tree.hpp"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+posix_target::posix_target(const std::string& path,
+						   std::unique_ptr<io_backend> io,
+						   bool direct) :
+	path(path),
+	backend(io ? std::move(io) : std::make_unique<blocking_io>()),
+	direct(direct),
+	directories(path)
+{
+}
+
+int
+posix_target::mkdir(std::string_view path, mode_t mode)
+{
+	int dir_fd = directories.get_parent(path, name);
+	return ::mkdirat(dir_fd, name.c_str(), mode);
+}
+
+int
+posix_target::unlink(std::string_view path)
+{
+	int dir_fd = directories.get_parent(path, name);
+	return ::unlinkat(dir_fd, name.c_str(), 0);
+}
+
+int
+posix_target::rmdir(std::string_view path)
+{
+	int dir_fd = directories.get_parent(path, name);
+	int rc = ::unlinkat(dir_fd, name.c_str(), AT_REMOVEDIR);
+	directories.invalidate(path);
+	return rc;
+}
+
+int
+posix_target::symlink(std::string_view contents, std::string_view path)
+{
+	int dir_fd = directories.get_parent(path, name);
+	name2.assign(contents);
+	return ::symlinkat(name2.c_str(), dir_fd, name.c_str());
+}
+
+int
+posix_target::rename(std::string_view from, std::string_view to)
+{
+	int dir_fd = directories.get_parent(from, name);
+	int dir_fd2 = directories.get_parent(to, name2);
+	int rc = ::renameat(dir_fd, name.c_str(), dir_fd2, name2.c_str());
+	if (rc == 0) {
+		directories.invalidate(from);
+		directories.invalidate(to);
+	}
+	return rc;
+}
+
+int
+posix_target::link(std::string_view from, std::string_view to)
+{
+	int dir_fd = directories.get_parent(from, name);
+	int dir_fd2 = directories.get_parent(to, name2);
+	return ::linkat(dir_fd, name.c_str(), dir_fd2, name2.c_str(), 0);
+}
+
+int
+posix_target::chmod(std::string_view path, mode_t mode)
+{
+	int dir_fd = directories.get_parent(path, name);
+	return ::fchmodat(dir_fd, name.c_str(), mode, 0);
+}
+
+int
+posix_target::chown(std::string_view path, uid_t uid, gid_t gid)
+{
+	int dir_fd = directories.get_parent(path, name);
+	return ::fchownat(dir_fd, name.c_str(), uid, gid, 0);
+}
+
+int
+posix_target::utimens(std::string_view path, const struct timespec times[2])
+{
+	int dir_fd = directories.get_parent(path, name);
+	return ::utimensat(dir_fd, name.c_str(), times, 0);
+}
+
+int
+posix_target::stat(std::string_view path, struct stat *stat_data)
+{
+	if (path == "/")
+		return ::fstat(directories.get(path), stat_data);
+	int dir_fd = directories.get_parent(path, name);
+	return ::fstatat(dir_fd, name.c_str(), stat_data, 0);
+}
+
+int
+posix_target::lstat(std::string_view path, struct stat *stat_data)
+{
+	if (path == "/")
+		return ::fstat(directories.get(path), stat_data);
+	int dir_fd = directories.get_parent(path, name);
+	return ::fstatat(dir_fd, name.c_str(), stat_data, AT_SYMLINK_NOFOLLOW);
+}
+
+int
+posix_target::readdir(std::string_view path, std::vector<std::string>& names)
+{
+	names = list_directory(directories.get(path), std::string(path));
+	return 0;
+}
+
+int
+posix_target::readlink(std::string_view path, std::string& contents)
+{
+	struct stat stat_data;
+	int dir_fd = directories.get_parent(path, name);
+
+	if (::fstatat(dir_fd, name.c_str(), &stat_data, AT_SYMLINK_NOFOLLOW) < 0)
+		return -1;
+	contents.resize(stat_data.st_size + 1);
+	ssize_t size = ::readlinkat(dir_fd, name.c_str(), &contents[0], contents.size());
+	if (size < 0)
+		return -1;
+	contents.resize(size);
+	return 0;
+}
+
+int
+posix_target::open(std::string_view path, int flags, mode_t mode)
+{
+	int dir_fd = directories.get_parent(path, name);
+	if (direct)
+		return open_direct(dir_fd, name.c_str(), flags, mode);
+	return ::openat(dir_fd, name.c_str(), flags, mode);
+}
+
+int
+posix_target::close(int fd)
+{
+	return ::close(fd);
+}
+
+int
+posix_target::ftruncate(int fd, off_t size)
+{
+	return ::ftruncate(fd, size);
+}
+
+int
+posix_target::fstat(int fd, struct stat *stat_data)
+{
+	return ::fstat(fd, stat_data);
+}
+
+void
+posix_target::save(const std::string& path,
+				   std::unordered_map<ino_t, std::string> *paths)
+{
+	backend->drain();
+	copy_tree(this->path, path, paths, direct);
+}
+
+void
+posix_target::load(const std::string& path)
+{
+	copy_tree(path, this->path, nullptr, direct);
+}
+
+void
+posix_target::move_to(const std::string& path,
+					  std::unordered_map<ino_t, std::string>& paths)
+{
+	backend->drain();
+	copy_tree(this->path, path, &paths, direct);
+	directories.reopen(path);
+	this->path = path;
+}
+
+void
+posix_target::flush()
+{
+	backend->drain();
+}
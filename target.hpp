@@ -0,0 +1,137 @@
+#ifndef TARGET_HPP
+#define TARGET_HPP
+
+#include "fd_cache.hpp"
+#include "io_backend.hpp"
+
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+
+/*
+ * The file system that operations are replayed into.  Paths are log
+ * paths, relative to the root of the target.  Each operation stands in
+ * for the system call of the same name, returning -1 and setting errno
+ * if it fails, except that a missing or unusable parent directory is
+ * reported by throwing.  Descriptors returned by open() are only
+ * meaningful to the same target and its io_backend.
+ */
+struct target {
+	virtual ~target() {}
+
+	virtual int mkdir(std::string_view path, mode_t mode) = 0;
+	virtual int unlink(std::string_view path) = 0;
+	virtual int rmdir(std::string_view path) = 0;
+	virtual int symlink(std::string_view contents, std::string_view path) = 0;
+	virtual int rename(std::string_view from, std::string_view to) = 0;
+	virtual int link(std::string_view from, std::string_view to) = 0;
+	virtual int chmod(std::string_view path, mode_t mode) = 0;
+	virtual int chown(std::string_view path, uid_t uid, gid_t gid) = 0;
+	virtual int utimens(std::string_view path, const struct timespec times[2]) = 0;
+	virtual int stat(std::string_view path, struct stat *stat_data) = 0;
+	virtual int lstat(std::string_view path, struct stat *stat_data) = 0;
+
+	/*
+	 * The names in a directory other than "." and "..", in no particular
+	 * order, and the contents of a symlink.
+	 */
+	virtual int readdir(std::string_view path, std::vector<std::string>& names) = 0;
+	virtual int readlink(std::string_view path, std::string& contents) = 0;
+
+	virtual int open(std::string_view path, int flags, mode_t mode = 0) = 0;
+	virtual int close(int fd) = 0;
+	virtual int ftruncate(int fd, off_t size) = 0;
+	virtual int fstat(int fd, struct stat *stat_data) = 0;
+
+	/*
+	 * File contents are read and written through this.
+	 */
+	virtual io_backend& io() = 0;
+
+	/*
+	 * Copy the whole tree into the existing empty directory at path,
+	 * reporting a path for every inode as copy_tree() does.
+	 */
+	virtual void save(const std::string& path,
+					  std::unordered_map<ino_t, std::string> *paths) = 0;
+
+	/*
+	 * Replace the (empty) contents of the target with a copy of the
+	 * tree at path.
+	 */
+	virtual void load(const std::string& path) = 0;
+
+	/*
+	 * Carry on in a copy of the target in the existing empty directory
+	 * at path, leaving the original alone.  Descriptors must all have
+	 * been closed.  If inode numbers change, paths receives the old
+	 * inode numbers as for save().
+	 */
+	virtual void move_to(const std::string& path,
+						 std::unordered_map<ino_t, std::string>& paths) = 0;
+
+	/*
+	 * Make sure the directory on disk matches the modelled state.
+	 */
+	virtual void flush() = 0;
+};
+
+/*
+ * Replays into a real directory, using *at() system calls relative to
+ * cached directory descriptors.  With direct, files are opened with
+ * O_DIRECT where possible, and so are the copies made for images and
+ * checkpoints, which then needs a direct_io backend.
+ */
+struct posix_target : target {
+	posix_target(const std::string& path,
+				 std::unique_ptr<io_backend> io,
+				 bool direct = false);
+
+	int mkdir(std::string_view path, mode_t mode) override;
+	int unlink(std::string_view path) override;
+	int rmdir(std::string_view path) override;
+	int symlink(std::string_view contents, std::string_view path) override;
+	int rename(std::string_view from, std::string_view to) override;
+	int link(std::string_view from, std::string_view to) override;
+	int chmod(std::string_view path, mode_t mode) override;
+	int chown(std::string_view path, uid_t uid, gid_t gid) override;
+	int utimens(std::string_view path, const struct timespec times[2]) override;
+	int stat(std::string_view path, struct stat *stat_data) override;
+	int lstat(std::string_view path, struct stat *stat_data) override;
+	int readdir(std::string_view path, std::vector<std::string>& names) override;
+	int readlink(std::string_view path, std::string& contents) override;
+
+	int open(std::string_view path, int flags, mode_t mode) override;
+	int close(int fd) override;
+	int ftruncate(int fd, off_t size) override;
+	int fstat(int fd, struct stat *stat_data) override;
+
+	io_backend& io() override { return *backend; }
+
+	void save(const std::string& path,
+			  std::unordered_map<ino_t, std::string> *paths) override;
+	void load(const std::string& path) override;
+	void move_to(const std::string& path,
+				 std::unordered_map<ino_t, std::string>& paths) override;
+	void flush() override;
+
+private:
+	std::string path;
+	std::unique_ptr<io_backend> backend;
+	bool direct;
+	directory_fd_cache directories;
+
+	/*
+	 * Scratch space for final path components.
+	 */
+	std::string name;
+	std::string name2;
+};
+
+#endif
@@ -9,14 +9,19 @@ operations="` wc -l < $log `"
 mkdir -p output
 
 echo $test_name
+# One pass over the log leaves output/$test_name.sweep/$i looking like
+# --take $i would have, for every $i.
+live_dir=output/$test_name.live
+sweep_dir=output/$test_name.sweep
+rm -fr $live_dir $sweep_dir && mkdir -p $live_dir
+# Any extra options for this test are in tests/$test_name.args.
+args=""
+if [ -f tests/$test_name.args ] ; then
+	args="` cat tests/$test_name.args `"
+fi
+./dsfs_replay $live_dir --sector-size 3 --writeback even $args --sweep every:1 --sweep-dir $sweep_dir < $log > output/$test_name.stdout
 for i in ` seq 0 $operations ` ; do
-	target_dir=output/$test_name.$i
 	expected_dir=expected/$test_name.$i
-	rm -fr $target_dir && mkdir -p $target_dir $expected_dir
-	./dsfs_replay $target_dir --sector-size 3 --writeback even --take $i < $log > output/$test_name.stdout
-done
-for i in ` seq 0 $operations ` ; do
-	target_dir=output/$test_name.$i
-	expected_dir=expected/$test_name.$i
-	diff -a -u -r -x .empty $target_dir $expected_dir
+	mkdir -p $expected_dir
+	diff -a -u -r -x .empty $sweep_dir/$i $expected_dir
 done
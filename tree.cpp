@@ -0,0 +1,288 @@
+#include "tree.hpp"
+#include "io_backend.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static void
+fail(const std::string& what, const std::string& path)
+{
+	std::string error = std::strerror(errno);
+	throw std::runtime_error("could not " + what + " " + path + ": " + error);
+}
+
+std::vector<std::string>
+list_directory(int dir_fd, const std::string& path)
+{
+	std::vector<std::string> names;
+	int fd = ::dup(dir_fd);
+	DIR *dir;
+
+	if (fd < 0 || !(dir = ::fdopendir(fd))) {
+		if (fd >= 0)
+			::close(fd);
+		fail("read directory", path);
+	}
+	::rewinddir(dir);
+	while (struct dirent *entry = ::readdir(dir)) {
+		if (std::strcmp(entry->d_name, ".") == 0 ||
+			std::strcmp(entry->d_name, "..") == 0)
+			continue;
+		names.push_back(entry->d_name);
+	}
+	::closedir(dir);
+
+	return names;
+}
+
+/*
+ * The access and modification times, in the form futimens() wants.
+ */
+struct file_times {
+	explicit file_times(const struct stat& stat_data)
+	{
+		times[0] = stat_data.st_atim;
+		times[1] = stat_data.st_mtim;
+	}
+	struct timespec times[2];
+};
+
+static int
+open_directory(int dir_fd, const std::string& name, const std::string& path)
+{
+	int fd = ::openat(dir_fd, name.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+	if (fd < 0)
+		fail("open directory", path);
+	return fd;
+}
+
+struct tree_copy {
+	int to_root;
+	bool direct;
+	std::unordered_map<ino_t, std::string> copied;
+	aligned_memory buffer;
+};
+
+/*
+ * How much of a file to copy at a time.
+ */
+static const std::size_t copy_chunk = 64 * 1024;
+
+static void
+copy_file(int from_dir, int to_dir, const std::string& name,
+		  const struct stat& stat_data, const std::string& path,
+		  tree_copy& state)
+{
+	int from_flags = O_RDONLY | O_NOFOLLOW;
+	int to_flags = O_WRONLY | O_CREAT | O_EXCL;
+	int from_fd = state.direct ?
+		open_direct(from_dir, name.c_str(), from_flags) :
+		::openat(from_dir, name.c_str(), from_flags);
+	if (from_fd < 0)
+		fail("open", path);
+	int to_fd = state.direct ?
+		open_direct(to_dir, name.c_str(), to_flags, stat_data.st_mode & 07777) :
+		::openat(to_dir, name.c_str(), to_flags, stat_data.st_mode & 07777);
+	if (to_fd < 0) {
+		::close(from_fd);
+		fail("create", path);
+	}
+
+	try {
+		char *buffer = state.buffer.get();
+		off_t offset = 0;
+		std::size_t size;
+
+		do {
+			std::size_t length;
+
+			if (state.direct) {
+				// Only whole blocks can be written, so the last one
+				// is padded, and the file cut back afterwards.
+				size = read_direct(from_fd, buffer, copy_chunk, offset);
+				length = size + (direct_alignment - size % direct_alignment) %
+					direct_alignment;
+				std::memset(buffer + size, 0, length - size);
+			} else {
+				size = read_all(from_fd, buffer, copy_chunk, offset);
+				length = size;
+			}
+			if (size > 0)
+				write_all(to_fd, buffer, length, offset);
+			offset += size;
+		} while (size == copy_chunk);
+		if (state.direct && offset % direct_alignment != 0 &&
+			::ftruncate(to_fd, offset) < 0)
+			fail("truncate", path);
+		// Permission bits may have been masked by umask.
+		if (::fchmod(to_fd, stat_data.st_mode & 07777) < 0)
+			fail("chmod", path);
+		(void) ::fchown(to_fd, stat_data.st_uid, stat_data.st_gid);
+		if (::futimens(to_fd, file_times(stat_data).times) < 0)
+			fail("set times on", path);
+	} catch (...) {
+		::close(from_fd);
+		::close(to_fd);
+		throw;
+	}
+	::close(from_fd);
+	::close(to_fd);
+}
+
+static void
+copy_directory(int from_dir, int to_dir, const std::string& path,
+			   tree_copy& state)
+{
+	for (const std::string& name : list_directory(from_dir, path)) {
+		std::string child = path + "/" + name;
+		struct stat stat_data;
+
+		if (::fstatat(from_dir, name.c_str(), &stat_data, AT_SYMLINK_NOFOLLOW) < 0)
+			fail("stat", child);
+
+		// If we've seen this inode already, it's a hard link.
+		auto seen = state.copied.find(stat_data.st_ino);
+		if (seen != state.copied.end() && !S_ISDIR(stat_data.st_mode)) {
+			if (::linkat(state.to_root, seen->second.c_str() + 1,
+						 to_dir, name.c_str(), 0) < 0)
+				fail("link", child);
+			continue;
+		}
+		state.copied[stat_data.st_ino] = child;
+
+		if (S_ISDIR(stat_data.st_mode)) {
+			if (::mkdirat(to_dir, name.c_str(), 0700) < 0)
+				fail("create directory", child);
+			int from_fd = open_directory(from_dir, name, child);
+			int to_fd = -1;
+			try {
+				to_fd = open_directory(to_dir, name, child);
+				copy_directory(from_fd, to_fd, child, state);
+				// Set the times last, since copying the contents
+				// changes them.
+				if (::fchmod(to_fd, stat_data.st_mode & 07777) < 0)
+					fail("chmod", child);
+				(void) ::fchown(to_fd, stat_data.st_uid, stat_data.st_gid);
+				if (::futimens(to_fd, file_times(stat_data).times) < 0)
+					fail("set times on", child);
+			} catch (...) {
+				::close(from_fd);
+				if (to_fd >= 0)
+					::close(to_fd);
+				throw;
+			}
+			::close(from_fd);
+			::close(to_fd);
+		} else if (S_ISREG(stat_data.st_mode)) {
+			copy_file(from_dir, to_dir, name, stat_data, child, state);
+		} else if (S_ISLNK(stat_data.st_mode)) {
+			std::vector<char> target(stat_data.st_size + 1);
+			ssize_t size = ::readlinkat(from_dir, name.c_str(),
+										target.data(), target.size());
+			if (size < 0)
+				fail("read symlink", child);
+			target.resize(size);
+			target.push_back('\0');
+			if (::symlinkat(target.data(), to_dir, name.c_str()) < 0)
+				fail("create symlink", child);
+			(void) ::fchownat(to_dir, name.c_str(), stat_data.st_uid,
+							  stat_data.st_gid, AT_SYMLINK_NOFOLLOW);
+			if (::utimensat(to_dir, name.c_str(), file_times(stat_data).times,
+							AT_SYMLINK_NOFOLLOW) < 0)
+				fail("set times on", child);
+		} else {
+			throw std::runtime_error("unsupported file type at " + child);
+		}
+	}
+}
+
+void
+copy_tree(const std::string& from,
+		  const std::string& to,
+		  std::unordered_map<ino_t, std::string> *paths,
+		  bool direct)
+{
+	tree_copy state;
+	int from_fd = open_directory(AT_FDCWD, from, from);
+
+	state.to_root = -1;
+	state.direct = direct;
+	try {
+		struct stat stat_data;
+
+		state.buffer.reset(allocate_aligned(copy_chunk));
+		if (::fstat(from_fd, &stat_data) < 0)
+			fail("stat", from);
+		state.copied[stat_data.st_ino] = "/";
+		state.to_root = open_directory(AT_FDCWD, to, to);
+		copy_directory(from_fd, state.to_root, "", state);
+	} catch (...) {
+		::close(from_fd);
+		if (state.to_root >= 0)
+			::close(state.to_root);
+		throw;
+	}
+	::close(from_fd);
+	::close(state.to_root);
+
+	if (paths)
+		*paths = std::move(state.copied);
+}
+
+static void
+remove_contents(int dir_fd, const std::string& path)
+{
+	for (const std::string& name : list_directory(dir_fd, path)) {
+		std::string child = path + "/" + name;
+		struct stat stat_data;
+
+		if (::fstatat(dir_fd, name.c_str(), &stat_data, AT_SYMLINK_NOFOLLOW) < 0)
+			fail("stat", child);
+		if (S_ISDIR(stat_data.st_mode)) {
+			int fd = open_directory(dir_fd, name, child);
+			try {
+				remove_contents(fd, child);
+			} catch (...) {
+				::close(fd);
+				throw;
+			}
+			::close(fd);
+			if (::unlinkat(dir_fd, name.c_str(), AT_REMOVEDIR) < 0)
+				fail("remove directory", child);
+		} else if (::unlinkat(dir_fd, name.c_str(), 0) < 0) {
+			fail("remove", child);
+		}
+	}
+}
+
+void
+remove_tree(const std::string& path)
+{
+	int fd = ::open(path.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+	if (fd < 0) {
+		if (errno == ENOENT)
+			return;
+		if (errno == ENOTDIR || errno == ELOOP) {
+			if (::unlink(path.c_str()) < 0)
+				fail("remove", path);
+			return;
+		}
+		fail("open directory", path);
+	}
+	try {
+		remove_contents(fd, path);
+	} catch (...) {
+		::close(fd);
+		throw;
+	}
+	::close(fd);
+	if (::rmdir(path.c_str()) < 0)
+		fail("remove directory", path);
+}
@@ -0,0 +1,40 @@
+#ifndef TREE_HPP
+#define TREE_HPP
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <sys/types.h>
+
+/*
+ * Copy everything inside directory from into directory to, which must
+ * already exist.  Directories, regular files and symlinks are supported,
+ * and permissions, timestamps and hard links are preserved (ownership
+ * too, if we're allowed).  If paths is given, it receives a path for
+ * every inode copied, keyed by inode number in from.  Paths are
+ * relative to from but begin with "/", like the paths in a log.  With
+ * direct, files are read and written with O_DIRECT where possible, so
+ * that the copy doesn't fill the page cache.
+ */
+void
+copy_tree(const std::string& from,
+		  const std::string& to,
+		  std::unordered_map<ino_t, std::string> *paths = nullptr,
+		  bool direct = false);
+
+/*
+ * The names in an open directory, other than "." and "..".  The path is
+ * only for error messages.
+ */
+std::vector<std::string>
+list_directory(int dir_fd, const std::string& path);
+
+/*
+ * Remove a directory and everything beneath it, or whatever else is at
+ * path.  It's not an error if it doesn't exist.
+ */
+void
+remove_tree(const std::string& path);
+
+#endif
@@ -0,0 +1,313 @@
+#include "uring_io.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#ifdef __linux__
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static int
+io_uring_setup(unsigned entries, struct io_uring_params *params)
+{
+	return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int
+io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+				   nullptr, 0);
+}
+
+static void *
+map_ring(int fd, std::size_t size, off_t offset)
+{
+	void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+				   MAP_SHARED | MAP_POPULATE, fd, offset);
+	if (p == MAP_FAILED) {
+		std::string error = std::strerror(errno);
+		throw std::runtime_error("could not map io_uring: " + error);
+	}
+	return p;
+}
+
+uring_io::uring_io(unsigned entries, unsigned batch) :
+	ring_fd(-1),
+	sq_ring(nullptr),
+	sq_ring_size(0),
+	cq_ring(nullptr),
+	cq_ring_size(0),
+	sqes(nullptr),
+	sqes_size(0),
+	batch(std::max(1u, batch)),
+	unsubmitted(0),
+	last_queued(0)
+{
+	struct io_uring_params params;
+
+	std::memset(&params, 0, sizeof(params));
+	ring_fd = io_uring_setup(entries, &params);
+	if (ring_fd < 0) {
+		std::string error = std::strerror(errno);
+		throw std::runtime_error("could not set up io_uring: " + error);
+	}
+
+	try {
+		sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+		cq_ring_size = params.cq_off.cqes +
+			params.cq_entries * sizeof(struct io_uring_cqe);
+		if (params.features & IORING_FEAT_SINGLE_MMAP) {
+			sq_ring_size = std::max(sq_ring_size, cq_ring_size);
+			sq_ring = map_ring(ring_fd, sq_ring_size, IORING_OFF_SQ_RING);
+			cq_ring = sq_ring;
+		} else {
+			sq_ring = map_ring(ring_fd, sq_ring_size, IORING_OFF_SQ_RING);
+			cq_ring = map_ring(ring_fd, cq_ring_size, IORING_OFF_CQ_RING);
+		}
+		sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+		sqes = map_ring(ring_fd, sqes_size, IORING_OFF_SQES);
+	} catch (...) {
+		if (cq_ring && cq_ring != sq_ring)
+			munmap(cq_ring, cq_ring_size);
+		if (sq_ring)
+			munmap(sq_ring, sq_ring_size);
+		close(ring_fd);
+		throw;
+	}
+
+	char *sq = static_cast<char *>(sq_ring);
+	char *cq = static_cast<char *>(cq_ring);
+	sq_tail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+	sq_mask = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+	sq_array = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+	cq_head = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+	cq_tail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+	cq_mask = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+	cqes = cq + params.cq_off.cqes;
+
+	// One slot per submission queue entry, so the queue can never fill
+	// up, and the completion queue (twice as big) can never overflow.
+	slots.resize(params.sq_entries);
+	for (std::size_t i = slots.size(); i > 0; --i)
+		free_slots.push_back(i - 1);
+}
+
+uring_io::~uring_io()
+{
+	try {
+		drain();
+	} catch (...) {
+		// Too late to report anything.
+	}
+	munmap(sqes, sqes_size);
+	if (cq_ring != sq_ring)
+		munmap(cq_ring, cq_ring_size);
+	munmap(sq_ring, sq_ring_size);
+	close(ring_fd);
+}
+
+bool
+uring_io::overlaps(const slot& s, int fd, std::size_t size, off_t offset) const
+{
+	return s.fd == fd &&
+		s.offset < offset + static_cast<off_t>(size) &&
+		offset < s.offset + static_cast<off_t>(s.data.size());
+}
+
+void
+uring_io::submit(unsigned min_complete)
+{
+	while (unsubmitted > 0 || min_complete > 0) {
+		int ret = io_uring_enter(ring_fd, unsubmitted, min_complete,
+								 min_complete > 0 ? IORING_ENTER_GETEVENTS : 0);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			std::string error = std::strerror(errno);
+			throw std::runtime_error("could not submit to io_uring: " + error);
+		}
+		unsubmitted -= std::min(unsubmitted, static_cast<unsigned>(ret));
+		if (unsubmitted == 0)
+			break;
+	}
+}
+
+void
+uring_io::complete(std::uint64_t index, int result)
+{
+	slot& s = slots[index];
+
+	// The buffer stays valid until the slot is next used, so give it
+	// back first; then an error can't leave us waiting for it forever.
+	busy_slots.erase(std::find(busy_slots.begin(), busy_slots.end(), index));
+	free_slots.push_back(index);
+
+	// A short write breaks a chain of linked writes, and the kernel
+	// cancels the rest.  Completions arrive in chain order, so finishing
+	// them here synchronously still applies them in the right order.
+	if (result == -ECANCELED) {
+		result = 0;
+	} else if (result < 0) {
+		std::string error = std::strerror(-result);
+		throw std::runtime_error("could not write: " + error);
+	}
+	if (static_cast<std::size_t>(result) < s.data.size())
+		write_all(s.fd, s.data.data() + result, s.data.size() - result,
+				  s.offset + result);
+}
+
+void
+uring_io::reap()
+{
+	unsigned head = *cq_head;
+	struct io_uring_cqe *ring = static_cast<struct io_uring_cqe *>(cqes);
+
+	while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+		struct io_uring_cqe *cqe = &ring[head & *cq_mask];
+		std::uint64_t index = cqe->user_data;
+		int result = cqe->res;
+
+		++head;
+		__atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+		complete(index, result);
+	}
+}
+
+void
+uring_io::wait_for(unsigned count)
+{
+	reap();
+	while (busy_slots.size() > count) {
+		submit(1);
+		reap();
+	}
+}
+
+void
+uring_io::write(int fd, const char *data, std::size_t size, off_t offset)
+{
+	struct iovec iov = { const_cast<char *>(data), size };
+
+	writev(fd, &iov, 1, offset);
+}
+
+void
+uring_io::writev(int fd, const struct iovec *iov, int count, off_t offset)
+{
+	std::size_t size = 0;
+
+	for (int i = 0; i < count; ++i)
+		size += iov[i].iov_len;
+
+	if (free_slots.empty())
+		wait_for(busy_slots.size() - 1);
+
+	// Writes to the same range must land in the order issued.  The usual
+	// case is a sector flushed by a modelled fsync after an earlier write
+	// of it; if that's the write we queued just now, link to it, and
+	// otherwise wait for the earlier one.
+	bool link = false;
+	for (std::size_t i : busy_slots) {
+		if (!overlaps(slots[i], fd, size, offset))
+			continue;
+		if (i == last_queued && unsubmitted > 0) {
+			link = true;
+		} else {
+			link = false;
+			drain();
+			break;
+		}
+	}
+
+	std::size_t index = free_slots.back();
+	free_slots.pop_back();
+	slot& s = slots[index];
+	s.fd = fd;
+	s.offset = offset;
+	s.data.clear();
+	for (int i = 0; i < count; ++i) {
+		const char *data = static_cast<const char *>(iov[i].iov_base);
+		s.data.insert(s.data.end(), data, data + iov[i].iov_len);
+	}
+	busy_slots.push_back(index);
+
+	struct io_uring_sqe *ring = static_cast<struct io_uring_sqe *>(sqes);
+	if (link)
+		ring[(*sq_tail - 1) & *sq_mask].flags |= IOSQE_IO_LINK;
+
+	unsigned tail = *sq_tail;
+	unsigned position = tail & *sq_mask;
+	struct io_uring_sqe *sqe = &ring[position];
+	std::memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_WRITE;
+	sqe->fd = fd;
+	sqe->addr = reinterpret_cast<std::uint64_t>(s.data.data());
+	sqe->len = size;
+	sqe->off = offset;
+	sqe->user_data = index;
+	sq_array[position] = position;
+	__atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	last_queued = index;
+	++unsubmitted;
+
+	if (unsubmitted >= batch) {
+		submit(0);
+		reap();
+	}
+}
+
+std::size_t
+uring_io::read(int fd, char *data, std::size_t size, off_t offset)
+{
+	drain();
+	return read_all(fd, data, size, offset);
+}
+
+void
+uring_io::drain()
+{
+	submit(0);
+	wait_for(0);
+}
+
+#else
+
+uring_io::uring_io(unsigned, unsigned)
+{
+	throw std::runtime_error("io_uring is only available on Linux");
+}
+
+uring_io::~uring_io()
+{
+}
+
+void
+uring_io::write(int, const char *, std::size_t, off_t)
+{
+}
+
+void
+uring_io::writev(int, const struct iovec *, int, off_t)
+{
+}
+
+std::size_t
+uring_io::read(int, char *, std::size_t, off_t)
+{
+	return 0;
+}
+
+void
+uring_io::drain()
+{
+}
+
+#endif
@@ -0,0 +1,72 @@
+#ifndef URING_IO_HPP
+#define URING_IO_HPP
+
+#include "io_backend.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <sys/types.h>
+
+/*
+ * Writes are copied into per-slot buffers and handed to the kernel through
+ * an io_uring, many per io_uring_enter() call.  Writes to disjoint ranges
+ * may complete in any order, which can't change the final contents of the
+ * target.  A write that overlaps one still in flight must land after it:
+ * if the earlier one hasn't been submitted yet, the two are linked with
+ * IOSQE_IO_LINK, and otherwise we wait for it first.  Reads drain
+ * everything and then happen synchronously.
+ *
+ * This talks to the kernel directly rather than through liburing, and is
+ * only available on Linux; elsewhere the constructor throws.
+ */
+struct uring_io : io_backend {
+	explicit uring_io(unsigned entries = 256, unsigned batch = 32);
+	~uring_io();
+
+	void write(int fd, const char *data, std::size_t size, off_t offset) override;
+	std::size_t read(int fd, char *data, std::size_t size, off_t offset) override;
+	void drain() override;
+	void writev(int fd, const struct iovec *iov, int count, off_t offset) override;
+
+private:
+	struct slot {
+		slot() : fd(-1), offset(0) {}
+		int fd;
+		off_t offset;
+		std::vector<char> data;
+	};
+
+	void wait_for(unsigned count);
+	void submit(unsigned min_complete);
+	void reap();
+	void complete(std::uint64_t index, int result);
+	bool overlaps(const slot& s, int fd, std::size_t size, off_t offset) const;
+
+	int ring_fd;
+
+	// The mapped submission and completion rings.
+	void *sq_ring;
+	std::size_t sq_ring_size;
+	void *cq_ring;
+	std::size_t cq_ring_size;
+	void *sqes;
+	std::size_t sqes_size;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	void *cqes;
+
+	unsigned batch;
+	std::vector<slot> slots;
+	std::vector<std::size_t> free_slots;
+	std::vector<std::size_t> busy_slots;
+	unsigned unsubmitted;		// queued since the last io_uring_enter()
+	std::size_t last_queued;	// slot of the most recently queued write
+};
+
+#endif
@@ -0,0 +1,84 @@
+#ifndef WORK_STEALING_HPP
+#define WORK_STEALING_HPP
+
+#include <cstddef>
+#include <deque>
+#include <memory>
+#include <mutex>
+
+/*
+ * A fixed set of jobs shared out between workers, each of which has its
+ * own deque.  Workers take jobs from the front of their own deque, and
+ * when it runs dry they steal the back half of someone else's.  Jobs keep
+ * their relative order, so a worker that was handed an ascending run
+ * still sees an ascending run after stealing.  All jobs are pushed before
+ * any worker starts, so an empty set of deques means we're finished.
+ */
+template <typename T>
+struct work_stealing_queues {
+	explicit work_stealing_queues(std::size_t workers) :
+		queues(std::make_unique<queue[]>(workers)),
+		workers(workers)
+	{
+	}
+
+	void push(std::size_t worker, T&& job)
+	{
+		std::lock_guard<std::mutex> lock(queues[worker].mutex);
+		queues[worker].jobs.push_back(std::move(job));
+	}
+
+	/*
+	 * Fetch the next job for worker.  Returns false if there's nothing
+	 * left anywhere.
+	 */
+	bool pop(std::size_t worker, T& job)
+	{
+		if (try_pop_front(worker, job))
+			return true;
+
+		for (std::size_t i = 1; i < workers; ++i) {
+			queue& victim = queues[(worker + i) % workers];
+			std::deque<T> loot;
+			{
+				std::lock_guard<std::mutex> lock(victim.mutex);
+				std::size_t n = (victim.jobs.size() + 1) / 2;
+				auto split = victim.jobs.end() - n;
+				loot.assign(std::make_move_iterator(split),
+							std::make_move_iterator(victim.jobs.end()));
+				victim.jobs.erase(split, victim.jobs.end());
+			}
+			if (loot.empty())
+				continue;
+
+			job = std::move(loot.front());
+			loot.pop_front();
+			std::lock_guard<std::mutex> lock(queues[worker].mutex);
+			for (T& rest : loot)
+				queues[worker].jobs.push_back(std::move(rest));
+			return true;
+		}
+		return false;
+	}
+
+private:
+	struct queue {
+		std::mutex mutex;
+		std::deque<T> jobs;
+	};
+
+	bool try_pop_front(std::size_t worker, T& job)
+	{
+		std::lock_guard<std::mutex> lock(queues[worker].mutex);
+		if (queues[worker].jobs.empty())
+			return false;
+		job = std::move(queues[worker].jobs.front());
+		queues[worker].jobs.pop_front();
+		return true;
+	}
+
+	std::unique_ptr<queue[]> queues;
+	const std::size_t workers;
+};
+
+#endif